@@ -0,0 +1,288 @@
+//---------------------------------------------------------------------------------------------
+//
+// Quectel benchmark sketch
+//
+// Copyright 2018, M2M Solutions AB
+//
+//---------------------------------------------------------------------------------------------
+//
+// Measures AT command round trip time, socket throughput by chunk size for
+// TCP and TLS, and module file I/O rates. Results are printed as one JSON
+// object per line so runs can be collected and compared between library
+// versions.
+//
+// Set BENCH_SIMULATED to 1 to run against the SimulatedModem instead of a
+// real module. The simulator has a configurable link latency and UART rate.
+// On hardware the socket tests need an echo server, set with BENCH_HOST.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Project configuration defines
+//
+#define serial              SerialUSB
+#define cellular            SerialCellular
+#define APN                 "m2m.cxn"
+
+#define PWRKEY              CM_PWRKEY
+#define STATUS              CM_STATUS
+
+#define BENCH_SIMULATED     0
+#define BENCH_LATENCY_MS    20
+#define BENCH_BAUD_RATE     115200
+
+#define BENCH_HOST          "tcpbin.com"
+#define BENCH_TCP_PORT      4242
+#define BENCH_TLS_PORT      4243
+
+#define BENCH_AT_ITERATIONS 20
+#define BENCH_SOCKET_BYTES  4096
+#define BENCH_FILE_BYTES    4096
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Includes
+//
+#include "M2M_Quectel.h"
+#include "SimulatedModem.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Global variables
+//
+#if BENCH_SIMULATED
+QuectelCellular quectel;
+SimulatedModem modem;
+#define TARGET "simulated"
+#else
+QuectelCellular quectel(PWRKEY, STATUS);
+#define TARGET "hardware"
+#endif
+
+const uint16_t chunkSizes[] = { 16, 64, 256, 512, 1024, 1460 };
+uint8_t buffer[1460 + 1];
+char text[32];
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Reporting
+//
+void reportLatency(const char* name, uint32_t count, uint32_t minimum, uint32_t total, uint32_t maximum)
+{
+    serial.print("{\"bench\":\"at\",\"cmd\":\"");
+    serial.print(name);
+    serial.print("\",\"n\":");
+    serial.print(count);
+    serial.print(",\"min_us\":");
+    serial.print(minimum);
+    serial.print(",\"avg_us\":");
+    serial.print(count ? total / count : 0);
+    serial.print(",\"max_us\":");
+    serial.print(maximum);
+    serial.println("}");
+}
+
+void reportRate(const char* bench, const char* direction, uint16_t chunk, uint32_t bytes, uint32_t micros, bool ok)
+{
+    serial.print("{\"bench\":\"");
+    serial.print(bench);
+    serial.print("\",\"dir\":\"");
+    serial.print(direction);
+    serial.print("\",\"chunk\":");
+    serial.print(chunk);
+    serial.print(",\"bytes\":");
+    serial.print(bytes);
+    serial.print(",\"us\":");
+    serial.print(micros);
+    serial.print(",\"bps\":");
+    serial.print(micros ? (uint32_t)((uint64_t)bytes * 1000000 / micros) : 0);
+    serial.print(",\"ok\":");
+    serial.print(ok ? "true" : "false");
+    serial.println("}");
+}
+
+void reportStats()
+{
+    QuectelStats stats = quectel.getStats();
+    const char* families[] = { "status", "socket", "file", "http" };
+
+    serial.print("{\"bench\":\"stats\",\"commands\":");
+    serial.print(stats.commandsSent);
+    serial.print(",\"timeouts\":");
+    serial.print(stats.timeouts);
+    serial.print(",\"retries\":");
+    serial.print(stats.retries);
+    serial.print(",\"cme_errors\":");
+    serial.print(stats.cmeErrors);
+    serial.print(",\"uart_in\":");
+    serial.print(stats.uartBytesIn);
+    serial.print(",\"uart_out\":");
+    serial.print(stats.uartBytesOut);
+    for (uint8_t i = 0; i < QT_COMMAND_FAMILIES; i++)
+    {
+        serial.print(",\"");
+        serial.print(families[i]);
+        serial.print("_ms\":[");
+        for (uint8_t j = 0; j < QT_LATENCY_BUCKETS; j++)
+        {
+            serial.print(j ? "," : "");
+            serial.print(stats.latency[i][j]);
+        }
+        serial.print("]");
+    }
+    serial.println("}");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Benchmarks
+//
+#define MEASURE_AT(name, call)                              \
+    {                                                       \
+        uint32_t minimum = 0xffffffff, maximum = 0, total = 0; \
+        for (uint16_t i = 0; i < BENCH_AT_ITERATIONS; i++)  \
+        {                                                   \
+            uint32_t start = micros();                      \
+            call;                                           \
+            uint32_t elapsed = micros() - start;            \
+            total += elapsed;                               \
+            minimum = elapsed < minimum ? elapsed : minimum; \
+            maximum = elapsed > maximum ? elapsed : maximum; \
+        }                                                   \
+        reportLatency(name, BENCH_AT_ITERATIONS, minimum, total, maximum); \
+    }
+
+void benchmarkCommands()
+{
+    MEASURE_AT("AT+CSQ", quectel.getRSSI());
+    // Answered from the state kept by the +CREG URCs, without a command
+    MEASURE_AT("registration (cached)", quectel.getNetworkRegistration());
+    MEASURE_AT("AT+QSIMSTAT?", quectel.getSimPresent());
+    MEASURE_AT("AT+GSN", quectel.getIMEI(text));
+}
+
+void benchmarkSocket(const char* bench, uint16_t port, TlsEncryption encryption)
+{
+    for (uint8_t i = 0; i < sizeof(chunkSizes) / sizeof(chunkSizes[0]); i++)
+    {
+        uint16_t chunk = chunkSizes[i];
+        if (!quectel.connect(BENCH_HOST, port, encryption))
+        {
+            reportRate(bench, "up", chunk, 0, 0, false);
+            continue;
+        }
+        for (uint16_t j = 0; j < chunk; j++)
+        {
+            buffer[j] = 'a' + j % 26;
+        }
+
+        // Uplink
+        uint32_t sent = 0;
+        bool ok = true;
+        uint32_t start = micros();
+        while (ok && sent < BENCH_SOCKET_BYTES)
+        {
+            ok = quectel.write(buffer, chunk) == chunk;
+            sent += ok ? chunk : 0;
+        }
+        reportRate(bench, "up", chunk, sent, micros() - start, ok);
+
+        // Downlink, the echo of the uplink
+        uint32_t received = 0;
+        uint32_t timeout = millis() + 30000;
+        start = micros();
+        while (received < sent && millis() < timeout)
+        {
+            if (quectel.available() > 0)
+            {
+                int length = quectel.read(buffer, chunk);
+                received += length > 0 ? length : 0;
+            }
+        }
+        reportRate(bench, "down", chunk, received, micros() - start, received == sent);
+        quectel.stop();
+    }
+}
+
+void benchmarkFile()
+{
+    const char* fileName = "bench.bin";
+    for (uint8_t i = 0; i < sizeof(chunkSizes) / sizeof(chunkSizes[0]); i++)
+    {
+        uint16_t chunk = chunkSizes[i];
+        FILE_HANDLE handle = quectel.openFile(fileName, true);
+        if (handle == NOT_A_FILE_HANDLE)
+        {
+            reportRate("file", "write", chunk, 0, 0, false);
+            continue;
+        }
+
+        uint32_t written = 0;
+        bool ok = true;
+        uint32_t start = micros();
+        while (ok && written + chunk <= BENCH_FILE_BYTES)
+        {
+            ok = quectel.writeFile(handle, buffer, chunk);
+            written += ok ? chunk : 0;
+        }
+        reportRate("file", "write", chunk, written, micros() - start, ok);
+
+        quectel.seekFile(handle, 0);
+        uint32_t read = 0;
+        ok = true;
+        start = micros();
+        while (ok && read < written)
+        {
+            ok = quectel.readFile(handle, buffer, chunk);
+            read += ok ? chunk : 0;
+        }
+        reportRate("file", "read", chunk, read, micros() - start, ok);
+
+        quectel.closeFile(handle);
+        quectel.deleteFile(fileName);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Code
+//
+void setup()
+{
+    while (!serial);
+    serial.begin(115200);
+
+    serial.print("{\"bench\":\"info\",\"library\":\"M2M_Quectel\",\"version\":\"");
+    serial.print(M2M_QUECTEL_VERSION);
+    serial.print("\",\"target\":\"");
+    serial.print(TARGET);
+    serial.print("\",\"baud\":");
+    serial.print(BENCH_BAUD_RATE);
+    serial.print(",\"latency_ms\":");
+    serial.print(BENCH_SIMULATED ? BENCH_LATENCY_MS : 0);
+    serial.println("}");
+
+#if BENCH_SIMULATED
+    modem.setLinkLatency(BENCH_LATENCY_MS);
+    modem.setBaudRate(BENCH_BAUD_RATE);
+    bool ready = quectel.begin(&modem);
+#else
+    bool ready = quectel.begin(&cellular);
+#endif
+    if (!ready || !quectel.connectNetwork(APN, "", ""))
+    {
+        serial.println("{\"bench\":\"error\",\"msg\":\"module not ready\"}");
+        return;
+    }
+
+    quectel.resetStats();
+    benchmarkCommands();
+    benchmarkSocket("tcp", BENCH_TCP_PORT, TlsEncryption::None);
+    benchmarkSocket("tls", BENCH_TLS_PORT, TlsEncryption::Tls12);
+    benchmarkFile();
+    reportStats();
+    serial.println("{\"bench\":\"done\"}");
+}
+
+void loop()
+{
+}
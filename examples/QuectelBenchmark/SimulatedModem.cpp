@@ -0,0 +1,1032 @@
+//---------------------------------------------------------------------------------------------
+//
+// Simulated Quectel modem for the benchmark sketch.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "SimulatedModem.h"
+
+SimulatedModem::SimulatedModem()
+{
+    _latency = 20;
+    _baudRate = 115200;
+    _echo = true;
+    _pbDonePending = true;
+    _connected = false;
+    _activeContexts = 0;
+    strcpy(_scanSequence, "020301");
+    strcpy(_scanMode, "0");
+    strcpy(_iotMode, "2");
+    strcpy(_bands, "0xf,0x400a0e189f,0xa0e189f");
+    strcpy(_urcPort, "1,\"usbat\"");
+    _cregMode = 0;
+    _cgregMode = 0;
+    _skipLinefeed = false;
+    _inputMode = InputMode::Command;
+    _dataRemaining = 0;
+    _dataLength = 0;
+    _socketUnread = 0;
+    _sslUnread = 0;
+    _udpOpen = false;
+    _datagramCount = 0;
+    _mqttOpen = false;
+    _mqttConnected = false;
+    _mqttTopic[0] = 0;
+    _mqttPublishId = 0;
+    _mqttStored = -1;
+    for (uint8_t i = 0; i < SIMULATED_MODEM_FILES; i++)
+    {
+        _files[i].name[0] = 0;
+    }
+    _writeFile = nullptr;
+    _txBusyUntil = 0;
+    _rxNextByteAt = 0;
+    _lineLength = 0;
+    _rxHead = 0;
+    _rxReleased = 0;
+    _rxQueued = 0;
+    _mux = false;
+    _muxRaw = false;
+    _muxChannel = 0;
+    _muxFlag = false;
+    _muxInLength = 0;
+    _muxOutLength = 0;
+}
+
+void SimulatedModem::setLinkLatency(uint32_t milliseconds)
+{
+    _latency = milliseconds;
+}
+
+void SimulatedModem::setBaudRate(uint32_t baudRate)
+{
+    _baudRate = baudRate;
+}
+
+void SimulatedModem::begin(unsigned long)
+{
+}
+
+void SimulatedModem::begin(unsigned long, uint16_t)
+{
+}
+
+void SimulatedModem::end()
+{
+}
+
+int SimulatedModem::available()
+{
+    release();
+    return _rxReleased;
+}
+
+int SimulatedModem::peek()
+{
+    release();
+    if (_rxReleased == 0)
+    {
+        return -1;
+    }
+    return _rx[_rxHead];
+}
+
+int SimulatedModem::read()
+{
+    release();
+    if (_rxReleased == 0)
+    {
+        return -1;
+    }
+    uint8_t value = _rx[_rxHead];
+    _rxHead = (_rxHead + 1) % SIMULATED_MODEM_RX_SIZE;
+    _rxReleased--;
+    _rxQueued--;
+    return value;
+}
+
+void SimulatedModem::flush()
+{
+    while ((int32_t)(_txBusyUntil - micros()) > 0)
+    {
+    }
+}
+
+int SimulatedModem::availableForWrite()
+{
+    int32_t busy = _txBusyUntil - micros();
+    if (busy <= 0)
+    {
+        return 64;
+    }
+    int32_t queued = busy / byteTime();
+    return queued >= 64 ? 0 : 64 - queued;
+}
+
+size_t SimulatedModem::write(uint8_t value)
+{
+    // Pace the transmitter, blocking once the emulated 64 byte FIFO is full
+    uint32_t now = micros();
+    if ((int32_t)(_txBusyUntil - now) < 0)
+    {
+        _txBusyUntil = now;
+    }
+    _txBusyUntil += byteTime();
+    while ((int32_t)(_txBusyUntil - micros()) > (int32_t)(64 * byteTime()))
+    {
+    }
+
+    if (_mux)
+    {
+        muxReceive(value);
+    }
+    else
+    {
+        input(value);
+    }
+    return 1;
+}
+
+void SimulatedModem::input(uint8_t value)
+{
+    switch (_inputMode)
+    {
+        case InputMode::Command:
+            if (value == '\r')
+            {
+                _line[_lineLength] = 0;
+                if (_echo)
+                {
+                    reply(_line);
+                    reply("\r\n");
+                }
+                processCommand();
+                _lineLength = 0;
+            }
+            else if (value != '\n' && _lineLength < SIMULATED_MODEM_LINE_SIZE - 1)
+            {
+                _line[_lineLength++] = value;
+            }
+            break;
+        default:
+            if (_skipLinefeed && value == '\n')
+            {
+                // The line feed ending the command line is not data
+                _skipLinefeed = false;
+                break;
+            }
+            _skipLinefeed = false;
+            if (_inputMode == InputMode::FileData ||
+                _inputMode == InputMode::UploadData)
+            {
+                uint32_t position = _writeFile->position + _dataLength - _dataRemaining;
+                if (position < SIMULATED_MODEM_FILE_SIZE)
+                {
+                    _writeFile->data[position] = value;
+                }
+            }
+            if (--_dataRemaining > 0)
+            {
+                break;
+            }
+            if (_inputMode == InputMode::SocketData)
+            {
+                _socketUnread += _dataLength;
+                reply("\r\nSEND OK\r\n");
+            }
+            else if (_inputMode == InputMode::MqttData)
+            {
+                char text[64];
+                sprintf(text, "\r\nOK\r\n\r\n+QMTPUB: 0,%u,0\r\n", _mqttPublishId);
+                reply(text);
+                if (strcmp(_mqttPublishTopic, _mqttTopic) == 0 &&
+                    _mqttStored < 0)
+                {
+                    _mqttStored = _dataLength;
+                    reply("\r\n+QMTRECV: 0,0\r\n");
+                }
+            }
+            else if (_inputMode == InputMode::UploadData)
+            {
+                char text[48];
+                _writeFile->size = _dataLength;
+                sprintf(text, "\r\n+QFUPL: %lu,0000\r\n\r\nOK\r\n", (unsigned long)_dataLength);
+                reply(text);
+            }
+            else if (_inputMode == InputMode::UdpData)
+            {
+                reply("\r\nSEND OK\r\n");
+                if (_datagramCount < SIMULATED_MODEM_DATAGRAMS)
+                {
+                    _datagrams[_datagramCount++] = _dataLength;
+                    reply("\r\n+QIURC: \"recv\",2\r\n");
+                }
+            }
+            else if (_inputMode == InputMode::SslData)
+            {
+                _sslUnread += _dataLength;
+                reply("\r\nSEND OK\r\n");
+            }
+            else
+            {
+                char text[48];
+                _writeFile->position += _dataLength;
+                if (_writeFile->position > _writeFile->size)
+                {
+                    _writeFile->size = _writeFile->position;
+                }
+                sprintf(text, "\r\n+QFWRITE: %lu,%lu\r\n\r\nOK\r\n",
+                    (unsigned long)_dataLength, (unsigned long)_writeFile->size);
+                reply(text);
+            }
+            _inputMode = InputMode::Command;
+            break;
+    }
+}
+
+void SimulatedModem::processCommand()
+{
+    const char* ok = "\r\nOK\r\n";
+    unsigned long value = 0;
+    long offset = 0;
+    char text[96];
+
+    if (strcmp(_line, "ATE0") == 0)
+    {
+        _echo = false;
+        reply(ok);
+    }
+    else if (strncmp(_line, "AT+CMUX=0", 9) == 0)
+    {
+        // The OK is the last byte before the frames
+        reply(ok);
+        _mux = true;
+        _muxFlag = false;
+        _muxInLength = 0;
+        _muxOutLength = 0;
+        memset(_muxLineLengths, 0, sizeof(_muxLineLengths));
+    }
+    else if (strcmp(_line, "ATI") == 0)
+    {
+        reply("\r\nQuectel\r\nUG96\r\nRevision: UG96LNAR02A06E1G\r\n\r\nOK\r\n");
+    }
+    else if (strcmp(_line, "AT+GSN") == 0)
+    {
+        reply("\r\n866758040000000\r\n\r\nOK\r\n");
+    }
+    else if (strcmp(_line, "AT+CSQ") == 0)
+    {
+        reply("\r\n+CSQ: 20,99\r\n\r\nOK\r\n");
+    }
+    else if (strcmp(_line, "AT+CREG?") == 0)
+    {
+        sprintf(text, "\r\n+CREG: %u,1\r\n\r\nOK\r\n", _cregMode);
+        reply(text);
+    }
+    else if (strcmp(_line, "AT+CGREG?") == 0)
+    {
+        sprintf(text, "\r\n+CGREG: %u,1\r\n\r\nOK\r\n", _cgregMode);
+        reply(text);
+    }
+    else if (sscanf(_line, "AT+CREG=%lu", &value) == 1)
+    {
+        _cregMode = value;
+        reply(ok);
+    }
+    else if (sscanf(_line, "AT+CGREG=%lu", &value) == 1)
+    {
+        _cgregMode = value;
+        reply(ok);
+    }
+    else if (strncmp(_line, "AT+CEREG", 8) == 0)
+    {
+        reply("\r\nERROR\r\n");
+    }
+    else if (strcmp(_line, "AT+QSIMSTAT?") == 0)
+    {
+        reply("\r\n+QSIMSTAT: 0,1\r\n\r\nOK\r\n");
+        if (_pbDonePending)
+        {
+            _pbDonePending = false;
+            reply("\r\nPB DONE\r\n");
+        }
+    }
+    else if (strncmp(_line, "AT+QPOWD", 8) == 0)
+    {
+        // The module boots with echo enabled
+        _echo = true;
+        _pbDonePending = true;
+        _connected = false;
+        _activeContexts = 0;
+        _cregMode = 0;
+        _cgregMode = 0;
+        reply("\r\nOK\r\n\r\nPOWERED DOWN\r\n");
+        // The reply is the last frame
+        _mux = false;
+    }
+    else if (processConfig())
+    {
+    }
+    else if (strcmp(_line, "AT+QNWINFO") == 0)
+    {
+        reply("\r\n+QNWINFO: \"CAT-M1\",\"24008\",\"LTE BAND 20\",6300\r\n\r\nOK\r\n");
+    }
+    else if (strcmp(_line, "AT+QIACT?") == 0)
+    {
+        for (uint8_t id = 1; id < 16; id++)
+        {
+            if (_activeContexts & (1 << id))
+            {
+                sprintf(text, "\r\n+QIACT: %u,1,1,\"10.0.%u.2\"\r\n", id, id - 1);
+                reply(text);
+            }
+        }
+        reply(ok);
+    }
+    else if (strncmp(_line, "AT+QIACT=", 9) == 0 ||
+             strncmp(_line, "AT+QIDEACT=", 11) == 0)
+    {
+        value = atoi(strchr(_line, '=') + 1) & 15;
+        if (_line[5] == 'A')
+        {
+            _activeContexts |= 1 << value;
+        }
+        else
+        {
+            _activeContexts &= ~(1 << value);
+        }
+        reply(ok);
+    }
+    else if (strncmp(_line, "AT+QIDNSGIP=", 12) == 0)
+    {
+        reply("\r\nOK\r\n\r\n+QIURC: \"dnsgip\",0,1,600\r\n\r\n+QIURC: \"dnsgip\",\"10.0.0.1\"\r\n");
+    }
+    else if (strcmp(_line, "AT+QMTCONN?") == 0)
+    {
+        reply(_mqttConnected ? "\r\n+QMTCONN: 0,3\r\n\r\nOK\r\n" : ok);
+    }
+    else if (strncmp(_line, "AT+QMTOPEN=0,", 13) == 0)
+    {
+        _mqttOpen = true;
+        reply("\r\nOK\r\n\r\n+QMTOPEN: 0,0\r\n");
+    }
+    else if (strcmp(_line, "AT+QMTCLOSE=0") == 0)
+    {
+        reply(_mqttOpen ? "\r\nOK\r\n\r\n+QMTCLOSE: 0,0\r\n" : "\r\nERROR\r\n");
+        _mqttOpen = false;
+        _mqttConnected = false;
+    }
+    else if (_mqttOpen && strncmp(_line, "AT+QMTCONN=0,", 13) == 0)
+    {
+        _mqttConnected = true;
+        reply("\r\nOK\r\n\r\n+QMTCONN: 0,0,0\r\n");
+    }
+    else if (strcmp(_line, "AT+QMTDISC=0") == 0)
+    {
+        _mqttOpen = false;
+        _mqttConnected = false;
+        reply("\r\nOK\r\n\r\n+QMTDISC: 0,0\r\n");
+    }
+    else if (_mqttConnected && sscanf(_line, "AT+QMTSUB=0,%lu,\"%31[^\"]\",%ld", &value, _mqttTopic, &offset) == 3)
+    {
+        sprintf(text, "\r\nOK\r\n\r\n+QMTSUB: 0,%lu,0,%ld\r\n", value, offset);
+        reply(text);
+    }
+    else if (_mqttConnected && sscanf(_line, "AT+QMTUNS=0,%lu,", &value) == 1)
+    {
+        _mqttTopic[0] = 0;
+        sprintf(text, "\r\nOK\r\n\r\n+QMTUNS: 0,%lu,0\r\n", value);
+        reply(text);
+    }
+    else if (_mqttConnected &&
+             sscanf(_line, "AT+QMTPUB=0,%lu,%*u,%*u,\"%31[^\"]\",%ld", &value, _mqttPublishTopic, &offset) == 3 &&
+             offset > 0)
+    {
+        _mqttPublishId = value;
+        _inputMode = InputMode::MqttData;
+        _dataLength = _dataRemaining = offset;
+        _skipLinefeed = true;
+        reply("\r\n> ");
+    }
+    else if (strcmp(_line, "AT+QMTRECV=0,0") == 0)
+    {
+        if (_mqttStored < 0)
+        {
+            reply(ok);
+        }
+        else
+        {
+            sprintf(text, "\r\n+QMTRECV: 0,1,\"%s\",%ld,\"", _mqttTopic, (long)_mqttStored);
+            replyData(text, _mqttStored);
+            reply("\"\r\n\r\nOK\r\n");
+            _mqttStored = -1;
+        }
+    }
+    else if (strncmp(_line, "AT+QIOPEN=1,2,\"UDP SERVICE\"", 27) == 0)
+    {
+        _udpOpen = true;
+        _datagramCount = 0;
+        reply("\r\nOK\r\n\r\n+QIOPEN: 2,0\r\n");
+    }
+    else if (strcmp(_line, "AT+QICLOSE=2") == 0)
+    {
+        _udpOpen = false;
+        _datagramCount = 0;
+        reply(ok);
+    }
+    else if (_udpOpen && sscanf(_line, "AT+QISEND=2,%lu,", &value) == 1 && value > 0)
+    {
+        _inputMode = InputMode::UdpData;
+        _dataLength = _dataRemaining = value;
+        _skipLinefeed = true;
+        reply("\r\n> ");
+    }
+    else if (strcmp(_line, "AT+QIRD=2") == 0)
+    {
+        if (_datagramCount == 0)
+        {
+            reply("\r\n+QIRD: 0\r\n\r\nOK\r\n");
+        }
+        else
+        {
+            value = _datagrams[0];
+            _datagramCount--;
+            memmove(_datagrams, _datagrams + 1, _datagramCount * sizeof(_datagrams[0]));
+            sprintf(text, "\r\n+QIRD: %lu,\"10.0.0.1\",5683\r\n", value);
+            replyData(text, value);
+            reply("\r\n\r\nOK\r\n");
+        }
+    }
+    else if (strncmp(_line, "AT+QIOPEN=", 10) == 0)
+    {
+        _connected = true;
+        _socketUnread = 0;
+        reply("\r\nOK\r\n\r\n+QIOPEN: 1,0\r\n");
+    }
+    else if (strncmp(_line, "AT+QSSLOPEN=", 12) == 0)
+    {
+        _connected = true;
+        _sslUnread = 0;
+        reply("\r\nOK\r\n\r\n+QSSLOPEN: 1,0\r\n");
+    }
+    else if ((strncmp(_line, "AT+QISEND=", 10) == 0 ||
+              strncmp(_line, "AT+QSSLSEND=", 12) == 0) &&
+             !_connected)
+    {
+        reply("\r\nERROR\r\n");
+    }
+    else if (sscanf(_line, "AT+QISEND=%*u,%lu", &value) == 1 && value > 0)
+    {
+        _inputMode = InputMode::SocketData;
+        _dataLength = _dataRemaining = value;
+        _skipLinefeed = true;
+        reply("\r\n> ");
+    }
+    else if (sscanf(_line, "AT+QSSLSEND=%*u,%lu", &value) == 1 && value > 0)
+    {
+        _inputMode = InputMode::SslData;
+        _dataLength = _dataRemaining = value;
+        _skipLinefeed = true;
+        reply("\r\n> ");
+    }
+    else if (sscanf(_line, "AT+QIRD=%*u,%lu", &value) == 1)
+    {
+        if (value == 0)
+        {
+            sprintf(text, "\r\n+QIRD: %lu,0,%lu\r\n\r\nOK\r\n",
+                (unsigned long)_socketUnread, (unsigned long)_socketUnread);
+            reply(text);
+        }
+        else
+        {
+            value = value < _socketUnread ? value : _socketUnread;
+            _socketUnread -= value;
+            sprintf(text, "\r\n+QIRD: %lu\r\n", value);
+            replyData(text, value);
+            reply("\r\n\r\nOK\r\n");
+        }
+    }
+    else if (sscanf(_line, "AT+QSSLRECV=%*u,%lu", &value) == 1)
+    {
+        value = value < _sslUnread ? value : _sslUnread;
+        _sslUnread -= value;
+        sprintf(text, "\r\n+QSSLRECV: %lu\r\n", value);
+        replyData(text, value);
+        reply("\r\n\r\nOK\r\n");
+    }
+    else if (strncmp(_line, "AT+QISTATE", 10) == 0 ||
+             strncmp(_line, "AT+QSSLSTATE", 12) == 0)
+    {
+        if (_connected)
+        {
+            reply("\r\n+QISTATE: 1,\"TCP\",\"10.0.0.1\",80,4097,2,1,1,0,\"uart1\"\r\n");
+        }
+        reply(ok);
+    }
+    else if (strncmp(_line, "AT+QICLOSE", 10) == 0 ||
+             strncmp(_line, "AT+QSSLCLOSE", 12) == 0)
+    {
+        _connected = false;
+        _socketUnread = 0;
+        _sslUnread = 0;
+        reply(ok);
+    }
+    else if (processFile())
+    {
+    }
+    else
+    {
+        // AT, AT+CMEE, AT+QCFG, AT+QICSGP, AT+QSSLCFG, AT+QFCLOSE...
+        reply(ok);
+    }
+}
+
+bool SimulatedModem::processConfig()
+{
+    static const char* const names[] = { "nwscanseq", "nwscanmode", "iotopmode", "band", "urc/port" };
+    char* values[] = { _scanSequence, _scanMode, _iotMode, _bands, _urcPort };
+    size_t sizes[] = { sizeof(_scanSequence), sizeof(_scanMode), sizeof(_iotMode), sizeof(_bands), sizeof(_urcPort) };
+    // The radio settings end with a take effect argument
+    const uint8_t radioSettings = 4;
+    char text[96];
+
+    if (strncmp(_line, "AT+QCFG=\"", 9) != 0)
+    {
+        return false;
+    }
+    for (uint8_t i = 0; i < 5; i++)
+    {
+        size_t length = strlen(names[i]);
+        if (strncmp(_line + 9, names[i], length) != 0 ||
+            _line[9 + length] != '"')
+        {
+            continue;
+        }
+        const char* value = _line + 10 + length;
+        if (*value == 0)
+        {
+            sprintf(text, "\r\n+QCFG: \"%s\",%s\r\n\r\nOK\r\n", names[i], values[i]);
+            reply(text);
+            return true;
+        }
+        // ,<value>,<effect>
+        const char* effect = i < radioSettings ? strrchr(value, ',') : value + strlen(value);
+        size_t valueLength = effect - value - 1;
+        if (valueLength >= sizes[i])
+        {
+            reply("\r\nERROR\r\n");
+            return true;
+        }
+        memcpy(values[i], value + 1, valueLength);
+        values[i][valueLength] = 0;
+        reply("\r\nOK\r\n");
+        return true;
+    }
+    return false;
+}
+
+bool SimulatedModem::processFile()
+{
+    const char* ok = "\r\nOK\r\n";
+    const char* notFound = "\r\n+CME ERROR: 405\r\n";
+    unsigned long handle = 0;
+    unsigned long value = 0;
+    long offset = 0;
+    char name[24];
+    char text[64];
+    File* file;
+
+    if (sscanf(_line, "AT+QFOPEN=\"%23[^\"]\",%lu", name, &value) == 2)
+    {
+        file = findFile(name);
+        if (file == nullptr)
+        {
+            file = findFile("");
+            if (file == nullptr)
+            {
+                reply("\r\n+CME ERROR: 409\r\n");
+                return true;
+            }
+            strcpy(file->name, name);
+            file->size = 0;
+        }
+        if (value == 1)
+        {
+            file->size = 0;
+        }
+        file->position = 0;
+        sprintf(text, "\r\n+QFOPEN: %u\r\n\r\nOK\r\n", (unsigned)(file - _files) + 1);
+        reply(text);
+    }
+    else if (sscanf(_line, "AT+QFWRITE=%lu,%lu", &handle, &value) == 2 && value > 0)
+    {
+        _writeFile = fileByHandle(handle);
+        if (_writeFile == nullptr)
+        {
+            reply(notFound);
+            return true;
+        }
+        _inputMode = InputMode::FileData;
+        _dataLength = _dataRemaining = value;
+        _skipLinefeed = true;
+        reply("\r\nCONNECT\r\n");
+    }
+    else if (sscanf(_line, "AT+QFREAD=%lu,%lu", &handle, &value) == 2)
+    {
+        file = fileByHandle(handle);
+        if (file == nullptr)
+        {
+            reply(notFound);
+            return true;
+        }
+        uint32_t left = file->size - file->position;
+        value = value < left ? value : left;
+        sprintf(text, "\r\nCONNECT %lu\r\n", value);
+        reply(text);
+        for (uint32_t i = 0; i < value; i++, file->position++)
+        {
+            queueByte(file->position < SIMULATED_MODEM_FILE_SIZE ?
+                file->data[file->position] : 'A' + file->position % 26);
+        }
+        reply(ok);
+    }
+    else if (sscanf(_line, "AT+QFSEEK=%lu,%ld,%lu", &handle, &offset, &value) == 3)
+    {
+        file = fileByHandle(handle);
+        if (file == nullptr)
+        {
+            reply(notFound);
+            return true;
+        }
+        file->position = value == 0 ? offset : value == 1 ? file->position + offset : file->size + offset;
+        reply(ok);
+    }
+    else if (sscanf(_line, "AT+QFPOSITION=%lu", &handle) == 1)
+    {
+        file = fileByHandle(handle);
+        sprintf(text, "\r\n+QFPOSITION: %lu\r\n\r\nOK\r\n", file ? (unsigned long)file->position : 0UL);
+        reply(file ? text : notFound);
+    }
+    else if (sscanf(_line, "AT+QFTUCAT=%lu", &handle) == 1)
+    {
+        file = fileByHandle(handle);
+        if (file != nullptr)
+        {
+            file->size = file->position;
+        }
+        reply(file ? ok : notFound);
+    }
+    else if (strncmp(_line, "AT+QFLST=\"", 10) == 0 && strchr(_line, '*') != nullptr)
+    {
+        // Wildcard listing, files whose name starts with the pattern
+        uint8_t length = strchr(_line, '*') - _line - 10;
+        length = length < sizeof(name) - 1 ? length : sizeof(name) - 1;
+        memcpy(name, _line + 10, length);
+        name[length] = 0;
+        for (uint8_t i = 0; i < SIMULATED_MODEM_FILES; i++)
+        {
+            if (_files[i].name[0] != 0 &&
+                strncmp(_files[i].name, name, strlen(name)) == 0)
+            {
+                sprintf(text, "\r\n+QFLST: \"%s\",%lu", _files[i].name, (unsigned long)_files[i].size);
+                reply(text);
+            }
+        }
+        reply("\r\n\r\nOK\r\n");
+    }
+    else if (sscanf(_line, "AT+QFLST=\"%23[^\"]\"", name) == 1)
+    {
+        file = findFile(name);
+        sprintf(text, "\r\n+QFLST: \"%s\",%lu\r\n\r\nOK\r\n", name, file ? (unsigned long)file->size : 0UL);
+        reply(file ? text : notFound);
+    }
+    else if (sscanf(_line, "AT+QFLDS=\"%23[^\"]\"", name) == 1)
+    {
+        unsigned long used = 0;
+        for (uint8_t i = 0; i < SIMULATED_MODEM_FILES; i++)
+        {
+            if (_files[i].name[0] != 0)
+            {
+                used += _files[i].size;
+            }
+        }
+        unsigned long total = SIMULATED_MODEM_FILES * SIMULATED_MODEM_FILE_SIZE;
+        sprintf(text, "\r\n+QFLDS: %lu,%lu\r\n\r\nOK\r\n", used < total ? total - used : 0, total);
+        reply(text);
+    }
+    else if (sscanf(_line, "AT+QFUPL=\"%23[^\"]\",%lu", name, &value) == 2 && value > 0)
+    {
+        _writeFile = findFile(name);
+        if (_writeFile == nullptr)
+        {
+            _writeFile = findFile("");
+            if (_writeFile == nullptr)
+            {
+                reply("\r\n+CME ERROR: 409\r\n");
+                return true;
+            }
+            strcpy(_writeFile->name, name);
+        }
+        _writeFile->size = 0;
+        _writeFile->position = 0;
+        _inputMode = InputMode::UploadData;
+        _dataLength = _dataRemaining = value;
+        _skipLinefeed = true;
+        reply("\r\nCONNECT\r\n");
+    }
+    else if (sscanf(_line, "AT+QFDWL=\"%23[^\"]\"", name) == 1)
+    {
+        file = findFile(name);
+        if (file == nullptr)
+        {
+            reply(notFound);
+            return true;
+        }
+        reply("\r\nCONNECT\r\n");
+        for (uint32_t i = 0; i < file->size; i++)
+        {
+            queueByte(i < SIMULATED_MODEM_FILE_SIZE ? file->data[i] : 'A' + i % 26);
+        }
+        sprintf(text, "\r\n+QFDWL: %lu,0000\r\n\r\nOK\r\n", (unsigned long)file->size);
+        reply(text);
+    }
+    else if (sscanf(_line, "AT+QFDEL=\"%23[^\"]\"", name) == 1)
+    {
+        file = findFile(name);
+        if (file != nullptr)
+        {
+            file->name[0] = 0;
+        }
+        reply(file ? ok : notFound);
+    }
+    else
+    {
+        // AT+QFCLOSE is answered with OK by processCommand()
+        return false;
+    }
+    return true;
+}
+
+SimulatedModem::File* SimulatedModem::findFile(const char* name)
+{
+    for (uint8_t i = 0; i < SIMULATED_MODEM_FILES; i++)
+    {
+        if (strcmp(_files[i].name, name) == 0)
+        {
+            return &_files[i];
+        }
+    }
+    return nullptr;
+}
+
+SimulatedModem::File* SimulatedModem::fileByHandle(unsigned long handle)
+{
+    if (handle < 1 || handle > SIMULATED_MODEM_FILES || _files[handle - 1].name[0] == 0)
+    {
+        return nullptr;
+    }
+    return &_files[handle - 1];
+}
+
+void SimulatedModem::reply(const char* text)
+{
+    while (*text)
+    {
+        queueByte(*text++);
+    }
+}
+
+void SimulatedModem::replyData(const char* header, uint32_t length)
+{
+    reply(header);
+    for (uint32_t i = 0; i < length; i++)
+    {
+        queueByte('A' + i % 26);
+    }
+}
+
+void SimulatedModem::queueByte(uint8_t value)
+{
+    if (_mux && !_muxRaw)
+    {
+        _muxOut[_muxOutLength++] = value;
+        if (_muxOutLength == sizeof(_muxOut))
+        {
+            muxFlush();
+        }
+        return;
+    }
+    release();
+    if (_rxQueued == _rxReleased)
+    {
+        // Nothing in flight, the reply starts after the link latency
+        _rxNextByteAt = micros() + _latency * 1000;
+    }
+    if (_rxQueued >= SIMULATED_MODEM_RX_SIZE)
+    {
+        // Overrun, like a real UART
+        return;
+    }
+    _rx[(_rxHead + _rxQueued) % SIMULATED_MODEM_RX_SIZE] = value;
+    _rxQueued++;
+}
+
+void SimulatedModem::release()
+{
+    uint32_t now = micros();
+    while (_rxReleased < _rxQueued &&
+           (int32_t)(now - _rxNextByteAt) >= 0)
+    {
+        _rxReleased++;
+        _rxNextByteAt += byteTime();
+    }
+}
+
+uint32_t SimulatedModem::byteTime()
+{
+    return 10000000UL / _baudRate;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CMUX, basic mode
+//
+void SimulatedModem::muxReceive(uint8_t value)
+{
+    // A frame starts after a flag, the rest of it is taken by its length,
+    // as F9 may be data
+    if (_muxInLength == 0)
+    {
+        if (value == 0xf9)
+        {
+            _muxFlag = true;
+            return;
+        }
+        if (!_muxFlag)
+        {
+            return;
+        }
+    }
+    if (_muxInLength < sizeof(_muxIn))
+    {
+        _muxIn[_muxInLength] = value;
+    }
+    _muxInLength++;
+    if (_muxInLength < 3)
+    {
+        return;
+    }
+    uint8_t headerLength = (_muxIn[2] & 1) ? 3 : 4;
+    if (_muxInLength < headerLength)
+    {
+        return;
+    }
+    uint16_t length = _muxIn[2] >> 1;
+    if (headerLength == 4)
+    {
+        length |= (uint16_t)_muxIn[3] << 7;
+    }
+    if (_muxInLength == headerLength + length + 1)
+    {
+        if (_muxInLength <= sizeof(_muxIn) &&
+            muxFcs(_muxIn, headerLength) == _muxIn[_muxInLength - 1])
+        {
+            muxFrame();
+        }
+        _muxInLength = 0;
+        _muxFlag = false;
+    }
+}
+
+void SimulatedModem::muxFrame()
+{
+    uint8_t dlci = _muxIn[0] >> 2;
+    uint8_t control = _muxIn[1] & ~0x10;
+    uint8_t length = _muxIn[2] >> 1;
+    uint8_t* data = _muxIn + 3;
+    if (control == 0x2f || control == 0x43)
+    {
+        // SABM or DISC, answered with UA, DISC on DLCI 0 ends multiplexing
+        muxSend(dlci, 0x73, nullptr, 0);
+        if (control == 0x43 && dlci == 0)
+        {
+            _mux = false;
+        }
+        return;
+    }
+    if (control != 0xef || dlci >= SIMULATED_MODEM_CHANNELS)
+    {
+        return;
+    }
+    if (dlci == 0)
+    {
+        // Control channel: CLD ends multiplexing, other commands are
+        // answered with the same value
+        uint8_t type = data[0];
+        if (!(type & 0x02))
+        {
+            return;
+        }
+        data[0] = type & ~0x02;
+        muxSend(0, 0xef, data, length);
+        if ((type & ~0x02) == 0xc1)
+        {
+            _mux = false;
+        }
+        return;
+    }
+    _muxChannel = dlci;
+    for (uint8_t i = 0; i < length; i++)
+    {
+        uint8_t value = data[i];
+        if (_inputMode != InputMode::Command)
+        {
+            input(value);
+            continue;
+        }
+        // Whole command lines, as commands on channels may interleave
+        char* line = _muxLines[dlci];
+        uint8_t& lineLength = _muxLineLengths[dlci];
+        if (value == '\r')
+        {
+            for (uint8_t j = 0; j < lineLength; j++)
+            {
+                input(line[j]);
+            }
+            input('\r');
+            lineLength = 0;
+        }
+        else if (value != '\n' && lineLength < SIMULATED_MODEM_LINE_SIZE - 1)
+        {
+            line[lineLength++] = value;
+        }
+    }
+    muxFlush();
+}
+
+void SimulatedModem::muxSend(uint8_t dlci, uint8_t control, const uint8_t* data, uint8_t length)
+{
+    uint8_t header[3];
+    header[0] = (dlci << 2) | 0x03;
+    header[1] = control;
+    header[2] = (length << 1) | 1;
+    _muxRaw = true;
+    queueByte(0xf9);
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        queueByte(header[i]);
+    }
+    for (uint8_t i = 0; i < length; i++)
+    {
+        queueByte(data[i]);
+    }
+    queueByte(muxFcs(header, 3));
+    queueByte(0xf9);
+    _muxRaw = false;
+}
+
+void SimulatedModem::muxFlush()
+{
+    if (_muxOutLength == 0)
+    {
+        return;
+    }
+    // UIH from the module, C/R clear
+    uint8_t length = _muxOutLength;
+    _muxOutLength = 0;
+    uint8_t header[3];
+    header[0] = (_muxChannel << 2) | 0x01;
+    header[1] = 0xef;
+    header[2] = (length << 1) | 1;
+    _muxRaw = true;
+    queueByte(0xf9);
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        queueByte(header[i]);
+    }
+    for (uint8_t i = 0; i < length; i++)
+    {
+        queueByte(_muxOut[i]);
+    }
+    queueByte(muxFcs(header, 3));
+    queueByte(0xf9);
+    _muxRaw = false;
+}
+
+uint8_t SimulatedModem::muxFcs(const uint8_t* data, uint8_t length)
+{
+    uint8_t crc = 0xff;
+    for (uint8_t i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xe0 : crc >> 1;
+        }
+    }
+    return 0xff - crc;
+}
@@ -0,0 +1,153 @@
+//---------------------------------------------------------------------------------------------
+//
+// Simulated Quectel modem for the benchmark sketch.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+//---------------------------------------------------------------------------------------------
+//
+// Answers the subset of the UG96 AT command set used by the library, with
+// a configurable response latency and a byte rate that emulates the UART
+// link speed. Socket data sent with +QISEND/+QSSLSEND is echoed back, so
+// both directions of a connection can be measured without a server. UDP
+// datagrams are echoed back from 10.0.0.1:5683, and MQTT messages published
+// to the subscribed topic are delivered back. Module files keep their first
+// SIMULATED_MODEM_FILE_SIZE bytes, later bytes read back as a test pattern.
+// After AT+CMUX the traffic is in GSM 07.10 basic mode frames. The channels
+// share one command interpreter, but each keeps its own command line, and
+// replies go back on the channel of the command.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SimulatedModem_h__
+#define __SimulatedModem_h__
+#include <Arduino.h>
+
+#define SIMULATED_MODEM_RX_SIZE     2048
+#define SIMULATED_MODEM_LINE_SIZE   128
+#define SIMULATED_MODEM_DATAGRAMS   8
+#define SIMULATED_MODEM_FILES       4
+#define SIMULATED_MODEM_FILE_SIZE   1024
+#define SIMULATED_MODEM_CHANNELS    4
+#define SIMULATED_MODEM_FRAME_SIZE  127
+
+class SimulatedModem : public HardwareSerial
+{
+public:
+    SimulatedModem();
+
+    // Delay between the end of a command and the first byte of the reply
+    void setLinkLatency(uint32_t milliseconds);
+    // Emulated UART rate, 10 bits per byte
+    void setBaudRate(uint32_t baudRate);
+
+    // The library always opens the port at 115200, the emulated rate is
+    // controlled with setBaudRate() instead.
+    void begin(unsigned long baudRate);
+    void begin(unsigned long baudRate, uint16_t config);
+    void end();
+    int available();
+    int peek();
+    int read();
+    void flush();
+    int availableForWrite();
+    size_t write(uint8_t value);
+    using Print::write;
+    operator bool()
+    {
+        return true;
+    }
+
+private:
+    enum class InputMode : uint8_t
+    {
+        Command = 0,
+        SocketData,
+        SslData,
+        UdpData,
+        MqttData,
+        FileData,
+        UploadData
+    };
+
+    struct File
+    {
+        char name[24];              // With the volume, empty when unused
+        uint32_t size;
+        uint32_t position;
+        uint8_t data[SIMULATED_MODEM_FILE_SIZE];
+    };
+
+    void processCommand();
+    bool processConfig();
+    bool processFile();
+    File* findFile(const char* name);
+    File* fileByHandle(unsigned long handle);
+    void reply(const char* text);
+    void replyData(const char* header, uint32_t length);
+    void queueByte(uint8_t value);
+    void release();
+    uint32_t byteTime();
+    void input(uint8_t value);
+    void muxReceive(uint8_t value);
+    void muxFrame();
+    void muxSend(uint8_t dlci, uint8_t control, const uint8_t* data, uint8_t length);
+    void muxFlush();
+    static uint8_t muxFcs(const uint8_t* data, uint8_t length);
+
+    uint32_t _latency;
+    uint32_t _baudRate;
+    bool _echo;
+    bool _pbDonePending;
+    bool _connected;
+    uint16_t _activeContexts;      // Bit per context ID
+    // Stored AT+QCFG radio settings, as the module prints them
+    char _scanSequence[12];
+    char _scanMode[4];
+    char _iotMode[4];
+    char _bands[64];
+    char _urcPort[16];
+    uint8_t _cregMode;
+    uint8_t _cgregMode;
+    bool _skipLinefeed;
+    InputMode _inputMode;
+    uint32_t _dataRemaining;
+    uint32_t _dataLength;
+    uint32_t _socketUnread;
+    uint32_t _sslUnread;
+    bool _udpOpen;
+    uint16_t _datagrams[SIMULATED_MODEM_DATAGRAMS];
+    uint8_t _datagramCount;
+    bool _mqttOpen;
+    bool _mqttConnected;
+    char _mqttTopic[32];
+    char _mqttPublishTopic[32];
+    uint16_t _mqttPublishId;
+    // Length of the message in receive buffer 0, or -1
+    int32_t _mqttStored;
+    File _files[SIMULATED_MODEM_FILES];
+    File* _writeFile;
+    uint32_t _txBusyUntil;
+    uint32_t _rxNextByteAt;
+    char _line[SIMULATED_MODEM_LINE_SIZE];
+    uint16_t _lineLength;
+    uint8_t _rx[SIMULATED_MODEM_RX_SIZE];
+    uint16_t _rxHead;          // Next byte to read
+    uint16_t _rxReleased;      // Bytes visible to the reader
+    uint16_t _rxQueued;        // Bytes queued, including not yet released
+    // CMUX
+    bool _mux;
+    bool _muxRaw;              // Queue frame bytes as they are
+    uint8_t _muxChannel;       // Of the command being answered
+    bool _muxFlag;             // Opening flag seen
+    uint8_t _muxIn[SIMULATED_MODEM_FRAME_SIZE + 6];
+    uint8_t _muxInLength;
+    uint8_t _muxOut[SIMULATED_MODEM_FRAME_SIZE];
+    uint8_t _muxOutLength;
+    char _muxLines[SIMULATED_MODEM_CHANNELS][SIMULATED_MODEM_LINE_SIZE];
+    uint8_t _muxLineLengths[SIMULATED_MODEM_CHANNELS];
+};
+
+#endif
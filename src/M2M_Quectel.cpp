@@ -12,10 +12,85 @@
 #include <Arduino.h>
 #include "M2M_Quectel.h"
 
-QuectelCellular::QuectelCellular(int8_t powerPin, int8_t statusPin)
+// The first entry is used until the module has been identified
+static const QuectelModuleProfile moduleProfiles[] =
+{
+    {
+        QuectelModule::UG96, "UG96",
+        QT_FEATURE_SSL | QT_FEATURE_URC_PORT | QT_FEATURE_MQTT | QT_FEATURE_SD_CARD,
+        1460, 1500, 1500, 30
+    },
+    {
+        QuectelModule::BG96, "BG96",
+        QT_FEATURE_SSL | QT_FEATURE_EPS | QT_FEATURE_URC_CONFIG | QT_FEATURE_RAT_CONFIG | QT_FEATURE_PSM | QT_FEATURE_MQTT,
+        1460, 1500, 1500, 30
+    },
+    {
+        QuectelModule::M95, "M95",
+        QT_FEATURE_LEGACY_TCPIP,
+        1460, 1500, 1024, 75
+    }
+};
+
+// Indexed by RegistrationDomain
+static const char* const registrationCommands[QT_REGISTRATION_DOMAINS] = { "CREG", "CGREG", "CEREG" };
+// Indexed by StorageVolume, as used by AT+QFLDS
+static const char* const volumeNames[] = { "RAM", "UFS", "SD" };
+
+static bool parseAddress(const char* text, IPAddress& address)
+{
+    // Also accepts the closing quote of a quoted address
+    unsigned int a, b, c, d;
+    char end = '"';
+    if (sscanf(text, "%u.%u.%u.%u%c", &a, &b, &c, &d, &end) < 4 || end != '"' ||
+        a > 255 || b > 255 || c > 255 || d > 255)
+    {
+        return false;
+    }
+    address = IPAddress(a, b, c, d);
+    return true;
+}
+
+QuectelCellular::QuectelCellular(int8_t powerPin, int8_t statusPin, int8_t dtrPin, int8_t wakeupPin)
 {
     _powerPin = powerPin;
     _statusPin = statusPin;
+    _dtrPin = dtrPin;
+    _wakeupPin = wakeupPin;
+    _transport = nullptr;
+    _baudRate = 115200;
+    _cmux = nullptr;
+#ifdef M2M_QUECTEL_THREADS
+    _ioInterval = QT_IO_THREAD_INTERVAL;
+#endif
+    _logger = nullptr;
+    watchdogcallback = nullptr;
+    registrationcallback = nullptr;
+    mqttcallback = nullptr;
+    _encryption = TlsEncryption::None;
+    _moduleType = QuectelModule::UG96;
+    _profile = &moduleProfiles[0];
+    _firmwareVersion[0] = 0;
+    _readLength = 0;
+    _readStart = 0;
+    resetStats();
+    resetReplyTimers();
+    for (uint8_t i = 0; i < QT_COMMAND_FAMILIES; i++)
+    {
+        _retryPolicies[i].attempts = QT_RETRY_ATTEMPTS;
+        _retryPolicies[i].backoff = QT_RETRY_BACKOFF;
+    }
+    clearDnsCache();
+    clearFileCache();
+    for (uint8_t i = 0; i < QT_OPEN_FILES; i++)
+    {
+        _openFiles[i].handle = NOT_A_FILE_HANDLE;
+    }
+    for (uint8_t i = 0; i < QT_TLS_HOSTS; i++)
+    {
+        _tlsConfigs[i] = nullptr;
+    }
+    clearSslContexts();
 
     if (_powerPin != NOT_A_PIN)
     {
@@ -26,13 +101,68 @@ QuectelCellular::QuectelCellular(int8_t powerPin, int8_t statusPin)
     {
         pinMode(_statusPin, INPUT);
     }
+    if (_dtrPin != NOT_A_PIN)
+    {
+        // Low keeps the module awake
+        pinMode(_dtrPin, OUTPUT);
+        digitalWrite(_dtrPin, LOW);
+    }
+    if (_wakeupPin != NOT_A_PIN)
+    {
+        pinMode(_wakeupPin, OUTPUT);
+        digitalWrite(_wakeupPin, HIGH);
+    }
 }
 
 
-bool QuectelCellular::begin(Uart* uart)
+bool QuectelCellular::begin(HardwareSerial* uart, bool allowWarmStart)
 {
-    _uart = uart;
-    _uart->begin(115200);
+    QT_LOCK();
+    _uartTransport.setUart(uart);
+    return begin(&_uartTransport, allowWarmStart);
+}
+
+bool QuectelCellular::begin(QuectelTransport* transport, bool allowWarmStart)
+{
+    QT_LOCK();
+    _transport = transport;
+    _baudRate = 115200;
+    _cmux = nullptr;
+    if (!_transport->begin(_baudRate))
+    {
+        QT_ERROR("Transport failed");
+        return false;
+    }
+    _registrationUrcs = false;
+    _urcLength = 0;
+    _socketState = SocketState::Closed;
+    _socketIdle = false;
+    _host[0] = 0;
+    _udpOpen = false;
+    _mqttConfigured = false;
+    memset(_contextStates, 0, sizeof(_contextStates));
+    _mqttConnected = false;
+    // RAM: files are gone if the module restarted, and so are the handles
+    // and SSL context settings
+    clearFileCache();
+    for (uint8_t i = 0; i < QT_OPEN_FILES; i++)
+    {
+        _openFiles[i].handle = NOT_A_FILE_HANDLE;
+    }
+    clearSslContexts();
+    if (_dtrPin != NOT_A_PIN)
+    {
+        digitalWrite(_dtrPin, LOW);
+    }
+
+    _warmStarted = allowWarmStart && tryWarmStart();
+    if (_warmStarted)
+    {
+        QT_DEBUG("Warm start, reusing registered module");
+        _powerState = PowerState::Active;
+        callWatchdog();
+        return true;
+    }
 
     QT_DEBUG("Powering off module");
     setPower(false);
@@ -41,8 +171,17 @@ bool QuectelCellular::begin(Uart* uart)
 
     // Disable echo
     sendAndCheckReply("ATE0", _OK, 1000);
-    // Set verbose error messages
-    sendAndCheckReply("AT+CMEE=2", _OK, 1000);
+    // Numeric error codes, as parsed by checkResult() and the statistics
+    sendAndCheckReply("AT+CMEE=1", _OK, 1000);
+
+    // Identify the module before anything model specific is sent
+    if (!readModuleInfo())
+    {
+        return false;
+    }
+    enableUrcPort();
+    // Before the module starts scanning for the network
+    applyRadioConfig();
 
     QT_DEBUG("Checking SIM card");
     if (!getSimPresent())
@@ -71,94 +210,173 @@ bool QuectelCellular::begin(Uart* uart)
 		QT_DEBUG("Failed waiting for phonebook initialization");
     }
 
-    // Wait for network registration
+    // Wait for network registration, reported by URCs
     QT_DEBUG("Waiting for network registration");
-    timeout = 60000;
-    NetworkRegistrationState state;
-    while (timeout > 0)
+    enableRegistrationUrcs();
+    uint32_t start = millis();
+    while (_networkState != NetworkRegistrationState::Registered &&
+           _networkState != NetworkRegistrationState::Roaming)
     {
-        state = getNetworkRegistration();
-        switch (state)
+        if (millis() - start > 60000)
         {
-            case NetworkRegistrationState::NotRegistered:
-                QT_DEBUG("Not registered");
-                break;
-            case NetworkRegistrationState::Registered:
-                QT_DEBUG("Registered");
-                break;
-            case NetworkRegistrationState::Searching:
-                QT_DEBUG("Searching");
-                break;
-            case NetworkRegistrationState::Denied:
-                QT_DEBUG("Denied");
-                break;
-            case NetworkRegistrationState::Unknown:
-                QT_DEBUG("Unknown");
-                break;
-            case NetworkRegistrationState::Roaming:
-                QT_DEBUG("Roaming");
-                break;
+            QT_ERROR("Network registration failed");
+            return false;
         }
+        processUrcs();
         callWatchdog();
-        delay(500);
-        timeout -= 500;
-        if (state == NetworkRegistrationState::Registered ||
-           state == NetworkRegistrationState::Roaming)
-        {
-            break;
-        }
+        delay(10);
     }
-    if (timeout <= 0)
+    if (_radioConfig.preferLastRat &&
+        readNetworkInfo())
     {
-        QT_ERROR("Network registration failed");
-        return false;
+        preferRadioAccess(_radioAccess);
     }
+    callWatchdog();
+    return true;
+}
 
-    if (sendAndWaitForReply("ATI", 1000, 5))
+bool QuectelCellular::getWarmStarted()
+{
+    QT_LOCK();
+    return _warmStarted;
+}
+
+bool QuectelCellular::setBaudRate(uint32_t baudRate)
+{
+    QT_LOCK();
+    if (!_transport->supportsBaudRate(baudRate))
     {
-		// response is:
-		// Quectel
-		// UG96
-		// Revision: UG96LNAR02A06E1G
-        //
-        // OK
+        QT_ERROR("Transport baud rate not supported");
+        return false;
+    }
+    // The OK comes at the old rate
+    sprintf(_buffer, "AT+IPR=%lu", (unsigned long)baudRate);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        return false;
+    }
+    if (!_transport->setBaudRate(baudRate))
+    {
+        // The module is at the new rate, there is no way back from here
+        QT_ERROR("Transport baud rate not set");
+        return false;
+    }
+    _baudRate = baudRate;
+    return waitForUart(1000);
+}
 
-        const char linefeed[] = "\n";
-        char * token = strtok(_buffer, linefeed);
-        if (token == nullptr ||
-            strcmp(token, "Quectel") != 0)
-        {
-            QT_ERROR("Not a Quectel module");
-            return false;
-        }
-        token = strtok(nullptr, linefeed);
-        if (token == nullptr)
+bool QuectelCellular::setFlowControl(bool enabled)
+{
+    QT_LOCK();
+    // A transport without flow control is always without it
+    bool supported = _transport->supportsFlowControl();
+    if (enabled && !supported)
+    {
+        QT_ERROR("Transport flow control not supported");
+        return false;
+    }
+    // RTS/CTS both ways
+    if (!sendAndCheckReply(enabled ? "AT+IFC=2,2" : "AT+IFC=0,0", _OK, 1000))
+    {
+        return false;
+    }
+    if (supported && !_transport->setFlowControl(enabled))
+    {
+        QT_ERROR("Transport flow control not set");
+        if (enabled)
         {
-            QT_ERROR("Parse error");
-            return false;
+            // Put the module back, it still takes commands without RTS
+            sendAndCheckReply("AT+IFC=0,0", _OK, 1000);
         }
-		if (strcmp(token, "UG96"))
-		{
-			_moduleType = QuectelModule::UG96;
-		}
-        token = strtok(nullptr, linefeed);
-        if (strlen(token) > 10)
+        return false;
+    }
+    return true;
+}
+
+bool QuectelCellular::startCmux(QuectelCmux* mux, uint8_t channels)
+{
+    QT_LOCK();
+    // AT+CMUX=0,0,5,127
+    // OK
+    //
+    // Basic mode, UIH frames, the current baud rate and N1
+    static const uint32_t portSpeeds[] =
+    {
+        9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600
+    };
+    if (_cmux != nullptr)
+    {
+        return true;
+    }
+    uint8_t portSpeed = 5;
+    for (uint8_t i = 0; i < sizeof(portSpeeds) / sizeof(portSpeeds[0]); i++)
+    {
+        if (portSpeeds[i] == _baudRate)
         {
-            strcpy(_firmwareVersion, token + 10);
+            portSpeed = i + 1;
         }
     }
-    callWatchdog();
+    sprintf(_buffer, "AT+CMUX=0,0,%i,%i", portSpeed, QT_CMUX_FRAME_SIZE);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        QT_ERROR("CMUX not supported");
+        return false;
+    }
+    if (!mux->begin(_transport, channels))
+    {
+        // The module would stay multiplexing and ignore AT commands
+        QT_ERROR("CMUX channels not opened");
+        QuectelCmux::close(_transport);
+        waitForUart(1000);
+        return false;
+    }
+    _cmux = mux;
+    _transport = mux->getChannel(1);
+    // Each channel has its own settings
+    sendAndCheckReply("ATE0", _OK, 1000);
+    sendAndCheckReply("AT+CMEE=1", _OK, 1000);
     return true;
 }
 
+bool QuectelCellular::stopCmux()
+{
+    QT_LOCK();
+    if (_cmux == nullptr)
+    {
+        return true;
+    }
+    _transport = _cmux->getTransport();
+    _cmux->end();
+    _cmux = nullptr;
+    return waitForUart(1000);
+}
+
+bool QuectelCellular::attach(QuectelTransport* transport)
+{
+    QT_LOCK();
+    _transport = transport;
+    if (!_transport->begin(_baudRate) ||
+        !waitForUart(1000))
+    {
+        QT_ERROR("No module on transport");
+        return false;
+    }
+    sendAndCheckReply("ATE0", _OK, 1000);
+    sendAndCheckReply("AT+CMEE=1", _OK, 1000);
+    _powerState = PowerState::Active;
+    return readModuleInfo();
+}
+
 const char* QuectelCellular::getFirmwareVersion()
 {
+    QT_LOCK();
 	return _firmwareVersion;
 }
 
 uint8_t QuectelCellular::getIMEI(char* buffer)
 {
-    if (sendAndWaitForReply("AT+GSN"))
+    QT_LOCK();
+    if (sendAndWaitForReply("AT+GSN", 1000, 3))
     {
         strncpy(buffer, _buffer, 15);
         buffer[15] = 0;
@@ -169,6 +387,7 @@ uint8_t QuectelCellular::getIMEI(char* buffer)
 
 void QuectelCellular::setEncryption(TlsEncryption enc)
 {
+    QT_LOCK();
     _encryption = enc;
 }
 
@@ -178,16 +397,35 @@ void QuectelCellular::setEncryption(TlsEncryption enc)
 //
 void QuectelCellular::setLogger(Logger* logger)
 {
+    QT_LOCK();
 	_logger = logger;
 }
 
+void QuectelCellular::setTrafficRecorder(QuectelTrafficRecorder* recorder)
+{
+    QT_LOCK();
+    _recorder = recorder;
+}
+
+void QuectelCellular::flushLog()
+{
+    QT_LOCK();
+#ifdef M2M_QUECTEL_DEFERRED_LOG
+    if (_logger != nullptr)
+    {
+        _logRing.flush(_logger);
+    }
+#endif
+}
+
 bool QuectelCellular::getSimPresent()
 {
+    QT_LOCK();
     // Reply is:
     // +QSIMSTAT: 0,1
     //
     // OK
-    if (sendAndWaitForReply("AT+QSIMSTAT?"))
+    if (sendAndWaitForReply("AT+QSIMSTAT?", 1000, 3))
     {
         const char delimiter[] = ",";
         char* token = strtok(_buffer, delimiter);
@@ -202,6 +440,7 @@ bool QuectelCellular::getSimPresent()
 
 const char* QuectelCellular::getModuleType()
 {
+    QT_LOCK();
     switch (_moduleType)
     {
         case QuectelModule::UG96:
@@ -215,8 +454,15 @@ const char* QuectelCellular::getModuleType()
     }
 }
 
+const QuectelModuleProfile& QuectelCellular::getModuleProfile()
+{
+    QT_LOCK();
+    return *_profile;
+}
+
 uint8_t QuectelCellular::getOperatorName(char* buffer)
 {
+    QT_LOCK();
     // Reply is:
     // +COPS: 0,0,"Telenor SE",6
     //
@@ -244,6 +490,7 @@ uint8_t QuectelCellular::getOperatorName(char* buffer)
 
 uint8_t QuectelCellular::getRSSI()
 {
+    QT_LOCK();
     // Reply is:
     // +CSQ: 14,2
     //
@@ -266,6 +513,7 @@ uint8_t QuectelCellular::getRSSI()
 
 uint8_t QuectelCellular::getSIMCCID(char* buffer)
 {
+    QT_LOCK();
     char delim[] = " \n";
     // +QCCID: 898600220909A0206023
     //
@@ -286,6 +534,7 @@ uint8_t QuectelCellular::getSIMCCID(char* buffer)
 
 uint8_t QuectelCellular::getSIMIMSI(char* buffer)
 {
+    QT_LOCK();
     char delim[] = "\n";
     // 240080007440698
     //
@@ -305,6 +554,13 @@ uint8_t QuectelCellular::getSIMIMSI(char* buffer)
 
 NetworkRegistrationState QuectelCellular::getNetworkRegistration()
 {
+    QT_LOCK();
+    if (_registrationUrcs)
+    {
+        // Kept up to date by URCs, no need to ask the module
+        processUrcs();
+        return _networkState;
+    }
     if (sendAndWaitForReply("AT+CREG?", 1000, 3))
     {
         const char delimiter[] = ",";
@@ -323,6 +579,7 @@ NetworkRegistrationState QuectelCellular::getNetworkRegistration()
 
 double QuectelCellular::getVoltage()
 {
+    QT_LOCK();
     if (sendAndWaitForReply("AT+CBC", 1000, 3))
     {
         const char delimiter[] = ",";
@@ -342,947 +599,4043 @@ double QuectelCellular::getVoltage()
     return 0;
 }
 
+void QuectelCellular::setRadioConfig(const QuectelRadioConfig& config)
+{
+    QT_LOCK();
+    _radioConfig = config;
+}
+
+RadioAccess QuectelCellular::getRadioAccess()
+{
+    QT_LOCK();
+    readNetworkInfo();
+    return _radioAccess;
+}
+
+uint16_t QuectelCellular::getBand()
+{
+    QT_LOCK();
+    readNetworkInfo();
+    return _band;
+}
+
 bool QuectelCellular::connectNetwork(const char* apn, const char* userId, const char* password)
 {
-    // First set up PDP context
-    sprintf(_buffer, "AT+QICSGP=1,1,\"%s\",\"%s\",\"%s\",1", apn, userId, password);
+    QT_LOCK();
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
+    {
+        // Multiple connections, received data is buffered until read with
+        // +QIRD. Both can only be set before the context is registered.
+        sendAndCheckReply("AT+QIMUX=1", _OK, 1000);
+        sendAndCheckReply("AT+QINDI=1", _OK, 1000);
+        sprintf(_buffer, "AT+QICSGP=1,\"%s\",\"%s\",\"%s\"", apn, userId, password);
+    }
+    else
+    {
+        return configureContext(1, apn, userId, password) &&
+               activateContext(1);
+    }
     if (!sendAndCheckReply(_buffer, _OK, 1000))
     {
         QT_ERROR("Failed to setup PDP context");
         return false;
     }
     callWatchdog();
+    sendAndCheckReply("AT+QIREGAPP", _OK, 1000);
+    callWatchdog();
     // Activate PDP context
-    if (!sendAndCheckReply("AT+QIACT=1", _OK, 30000))
+    if (!sendAndCheckReply("AT+QIACT", _OK, 30000) &&
+        !getContextActive(1))
     {
         QT_ERROR("Failed to activate PDP context");
         return false;
     }
+    _contextStates[0] = ContextState::Active;
     return true;
 }
 
 bool QuectelCellular::disconnectNetwork()
 {
-    if (!sendAndCheckReply("AT+QIDEACT=1", _OK, 30000))
+    QT_LOCK();
+    // AT+QIDEACT
+    // DEACT OK
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
     {
-        QT_ERROR("Failed to deactivate PDP context");
-        return false;
+        if (!sendAndCheckReply("AT+QIDEACT", "DEACT OK", 30000))
+        {
+            QT_ERROR("Failed to deactivate PDP context");
+            return false;
+        }
+        _contextStates[0] = ContextState::Inactive;
+        return true;
     }
-    return true;
+    return deactivateContext(1);
 }
 
-// HTTP client interface
-bool QuectelCellular::httpGet(const char* url, const char* fileName)
+bool QuectelCellular::configureContext(uint8_t contextId, const char* apn, const char* userId, const char* password)
 {
-    int status;
-    int size;
-    int result;
-
-    // (Uses PDP context 2)
-    // -> AT+QHTTPCFG="contextid",2
-    // <- OK
-    // -> AT+QHTTPURL=23,80
-    // <- CONNECT
-    // -> http://www.sina.com.cn
-    // <- OK
-    // -> AT+QHTTPGET=80
-    // <- OK
-    // <- +QHTTPGET: 0,200,631871
-    // -> AT+QHTTPREADFILE="RAM:1.bin",60,2
-    // <- OK
-    // <- +QHTTPREADFILE
-    bool ssl = strstr(url, "https://") != nullptr;
-
-    if (!sendAndCheckReply("AT+QHTTPCFG=\"contextid\",1", _OK, 10000))
+    QT_LOCK();
+    // AT+QICSGP=1,1,"internet","","",1
+    // OK
+    if (contextId < 1 || contextId > QT_PDP_CONTEXTS ||
+        (contextId != 1 && hasFeature(QT_FEATURE_LEGACY_TCPIP)))
     {
-        QT_ERROR("Failed to activate PDP context");
+        QT_ERROR("PDP context %i not supported", contextId);
         return false;
     }
-
-    if (ssl)
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
     {
-        QT_TRACE("Enabling SSL support");
-        if (!sendAndCheckReply("AT+QHTTPCFG=\"sslctxid\",1", _OK, 10000))
-        {
-            QT_ERROR("Failed to activate SSL context ID");
-            return false;
-        }
-        if (!activateSsl())
-        {
-            return false;
-        }
+        return connectNetwork(apn, userId, password);
     }
-
-    sprintf(_buffer, "AT+QHTTPURL=%i,30", strlen(url));
-    if (!sendAndCheckReply(_buffer, "CONNECT", 2000))
+    sprintf(_buffer, "AT+QICSGP=%i,1,\"%s\",\"%s\",\"%s\",1", contextId, apn, userId, password);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
     {
-        QT_ERROR("Failed to activate URL");
+        QT_ERROR("Failed to setup PDP context");
         return false;
     }
-    if (!sendAndCheckReply(url, "OK", 2000))
+    callWatchdog();
+    return true;
+}
+
+bool QuectelCellular::activateContext(uint8_t contextId)
+{
+    QT_LOCK();
+    // AT+QIACT=1
+    // OK
+    if (contextId < 1 || contextId > QT_PDP_CONTEXTS)
     {
-        QT_ERROR("Failed to send URL");
         return false;
     }
-    if (!sendAndWaitForReply("AT+QHTTPGET=60", 60000, 3))
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
     {
-        QT_ERROR("Failed to send request");
-        return false;
+        // Activated by connectNetwork()
+        return contextId == 1 && _contextStates[0] == ContextState::Active;
     }
-    const char qHttpGet[] = "+QHTTPGET: ";
-    char * token = strtok(_buffer, qHttpGet);
-    if (!token)
+    sprintf(_buffer, "AT+QIACT=%i", contextId);
+    if (!sendAndCheckReply(_buffer, _OK, 30000) &&
+        !getContextActive(contextId))
     {
-        QT_ERROR("Failed to receive data");
+        QT_ERROR("Failed to activate PDP context %i", contextId);
+        _contextStates[contextId - 1] = ContextState::Inactive;
         return false;
     }
-    const char delimiter[] = ",";
-    token = strtok(nullptr, delimiter);
-    token = strtok(nullptr, delimiter);
-    if (!token)
+    _contextStates[contextId - 1] = ContextState::Active;
+    return true;
+}
+
+bool QuectelCellular::deactivateContext(uint8_t contextId)
+{
+    QT_LOCK();
+    // AT+QIDEACT=1
+    // OK
+    if (contextId < 1 || contextId > QT_PDP_CONTEXTS)
     {
-        QT_ERROR("Failed to receive data");
         return false;
     }
-    status = atoi(token);
-    token = strtok(nullptr, delimiter);
-    size = atoi(token);
-    QT_COM_DEBUG("HTTP status code: %i, size: %i", status, size);
-
-    sprintf(_buffer, "AT+QHTTPREADFILE=\"RAM:%s\",60,1", fileName);
-    if (!sendAndWaitForReply(_buffer, 60000, 3))
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
     {
-        QT_ERROR("Failed to read response");
-        return false;
+        return contextId == 1 && disconnectNetwork();
     }
-    const char qReadFile[] = "+QHTTPREADFILE: ";
-    token = strtok(_buffer, qReadFile);
-    if (!token)
+    sprintf(_buffer, "AT+QIDEACT=%i", contextId);
+    if (!sendAndCheckReply(_buffer, _OK, 30000))
     {
-        QT_ERROR("Failed to save response");
+        QT_ERROR("Failed to deactivate PDP context %i", contextId);
         return false;
     }
-    token = strtok(nullptr, delimiter);
-    result = atoi(token);
-    QT_COM_DEBUG("HTTP read response result: %i", result);
-    if (result != 0)
+    // The module closes the sockets of the context
+    if (_openContext == contextId && _socketState == SocketState::Open)
     {
-        QT_ERROR("Failed to save response, error %i", result);
-        return false;
+        _socketState = SocketState::Closing;
+    }
+    if (_udpContext == contextId)
+    {
+        _udpOpen = false;
     }
+    _contextStates[contextId - 1] = ContextState::Inactive;
     return true;
 }
 
-///////////////////////////////////////////////////////////
-//
-// TCP client interface
-//
-int QuectelCellular::connect(IPAddress ip, uint16_t port)
+ContextState QuectelCellular::getContextState(uint8_t contextId)
 {
-    sprintf(_buffer, "%i.%i.%i.%i", ip[0], ip[1], ip[2], ip[3]);
-    return connect(_buffer, port);
+    QT_LOCK();
+    if (contextId < 1 || contextId > QT_PDP_CONTEXTS)
+    {
+        return ContextState::Unknown;
+    }
+    return _contextStates[contextId - 1];
 }
 
-int QuectelCellular::connect(IPAddress ip, uint16_t port, TlsEncryption encryption)
+void QuectelCellular::setSocketContext(uint8_t contextId)
 {
-    _encryption = encryption;
-    return connect(ip, port);
+    QT_LOCK();
+    _socketContext = contextId;
 }
 
-int QuectelCellular::connect(const char *host, uint16_t port, TlsEncryption encryption) {
-    _encryption = encryption;
-    return connect(host, port);
+void QuectelCellular::setHttpContext(uint8_t contextId)
+{
+    QT_LOCK();
+    _httpContext = contextId;
 }
 
-int QuectelCellular::connect(const char *host, uint16_t port)
+bool QuectelCellular::reactivateContext(uint8_t contextId)
 {
-    if (useEncryption())
+    // After +QIURC: "pdpdeact" the context is deactivated before it is
+    // activated again
+    if (getContextState(contextId) != ContextState::Lost)
     {
-        if (!activateSsl())
-        {
-            return false;
-        }
+        return true;
     }
-
-	sprintf(_buffer, "AT+QCFG=\"urc/port\",0,\"uart1\"");
-    if (!sendAndCheckReply(_buffer, _OK))
+    QT_DEBUG("Reactivating PDP context %i", contextId);
+    if (!deactivateContext(contextId) ||
+        !activateContext(contextId))
     {
-        QT_ERROR("Could not remove urc messages");
+        _contextStates[contextId - 1] = ContextState::Lost;
         return false;
     }
+    return true;
+}
 
-    // AT+QIOPEN=1,1,"TCP","220.180.239.201",8713,0,0
-    sprintf(_command, "+Q%sOPEN", useEncryption() ? _SSL_PREFIX : _INET_PREFIX);
-    if (useEncryption())
-    {
-        sprintf(_buffer, "AT%s=1,1,1,\"%s\",%i,0", _command, host, port);
-    }
-    else
-    {
-        sprintf(_buffer, "AT%s=1,1,\"TCP\",\"%s\",%i,0,0", _command, host, port);
-    }
-    if (!sendAndCheckReply(_buffer, _OK))
+void QuectelCellular::reactivateContexts()
+{
+    if ((int32_t)(millis() - _contextRetryAt) < 0)
     {
-        QT_ERROR("Connection failed");
-        return false;
+        return;
     }
-
-    // Now we are waiting for connect
-    // +QIOPEN: 1,0
-    uint32_t expireTime = millis() + 30 * 1000;
-    while (true)            // TODO: Timout
+    for (uint8_t i = 1; i <= QT_PDP_CONTEXTS; i++)
     {
-        callWatchdog();
-        if (readReply(500, 1) &&
-            strstr(_buffer, _command))
-        {
-            char* token = strtok(_buffer, " ");
-            token = strtok(nullptr, ",");
-
-            if (*token != '1')
-            {
-                QT_ERROR("Connection failed, %i, '%c'", strlen(_buffer), token);
-                return false;
-            }
-            QT_DEBUG("Connection open");
-            return true;
-        }
-        if (millis() > expireTime)
+        if (!reactivateContext(i))
         {
-                QT_ERROR("Connection timeout");
-                return false;
+            _contextRetryAt = millis() + QT_PDP_RETRY_INTERVAL;
         }
     }
-    QT_TRACE(_buffer);
-    return false;
-}
-
-size_t QuectelCellular::write(uint8_t value)
-{
-    return write(&value, 1);
 }
 
-size_t QuectelCellular::write(const uint8_t *buf, size_t size)
+void QuectelCellular::contextLost(uint8_t contextId)
 {
-    // TODO: Max 1460 bytes can be sent in one +QISEND session
-    // Add a loop
-    sprintf(_command, "+Q%sSEND", useEncryption() ? _SSL_PREFIX : _INET_PREFIX);
-    sprintf(_buffer, "AT%s=1,%i", _command, size);
-    if (!sendAndWaitFor(_buffer, "> ", 5000))
+    if (contextId < 1 || contextId > QT_PDP_CONTEXTS)
     {
-        QT_ERROR("%s handshake error, %s", _command, _buffer);
-        return 0;
+        return;
     }
-   	QT_COM_TRACE_START(" -> ");
-    QT_COM_TRACE_BUFFER(buf, size);
-    QT_COM_TRACE_END("");
-    _uart->write(buf, size);
-    if (readReply(5000, 1) &&
-        strstr(_buffer, "SEND OK"))
+    QT_DEBUG("PDP context %i deactivated by the network", contextId);
+    // Only contexts in use are brought back
+    ContextState& state = _contextStates[contextId - 1];
+    if (state != ContextState::Lost)
     {
-        return size;
+        state = state == ContextState::Active ? ContextState::Lost : ContextState::Inactive;
     }
-    QT_ERROR("Send failed");
-    return 0;
-}
-
-int QuectelCellular::available()
-{
-    if (useEncryption())
+    if (_openContext == contextId && _socketState == SocketState::Open)
     {
-        if (sslLength > 0)
-        {
-            return sslLength;
-        }
-        sprintf(_buffer, "AT+QSSLRECV=1,%i", sizeof(_buffer) - 36);
-        if (sendAndWaitForReply(_buffer, 1000, 3))
-        {
-            char* recvToken = strstr(_buffer, "+QSSLRECV: ");
-			recvToken += 11;
-
-            /* Get length of data */
-            char* lfToken = strstr(recvToken, "\n");
-			uint32_t llen = lfToken - recvToken;
-
-			char numberStr[llen];
-			strncpy(numberStr, recvToken, llen);
-			numberStr[llen] = '\0';
-
-			sslLength = atoi(numberStr);
-
-			if (sslLength > 0)
-			{
-                //set start of data to after the last new line
-                char* data = lfToken + 1;
-
-                //The check below is because sometimes a URC-message gets through and ruins everything because it includes 2 more lines that we don't expect
-                //First cut off the message so we only check the first 30 characters
-
-                //get first 30 characters
-                char subbuff[31];
-                memcpy( subbuff, _buffer, 30 );
-                subbuff[30] = '\0';
-
-                //A bad message can at a maximum look like this: +QSSLURC: "recv",1<LF><LF>+QSSLRECV: [number]<LF>
-                //but sometimes only part of it is included, example: v",1<LF><LF>+ QSSLRECV:[number]<LF>
-                //i check for 2 new lines before +QSSLRECV because if there only is 1 then the data will still be read
-                if(strstr(subbuff, "\n\n+QSSLRE") != nullptr) {
-                    if(readReply(1000, 2)) {
-                        data = _buffer;
-                    }
-                    else {
-                        QT_ERROR("Could not get data after URC-interrupt");
-
-                        sslLength = 0;
-                    }
-                }
-
-				memcpy(_readBuffer, data, sslLength);
-			}
-			QT_TRACE("available sslLength: %i", sslLength);
-			return sslLength;
-        }
+        _socketState = SocketState::Closing;
     }
-    else
+    if (_udpContext == contextId)
     {
-        sprintf(_buffer, "AT+QIRD=1,0");
-        if (sendAndWaitForReply(_buffer, 1000, 3))
-        {
-            const char delimiter[] = ",";
-            char * token = strtok(_buffer, delimiter);
-            if (token)
-            {
-                token = strtok(nullptr, delimiter);
-                if (token)
-                {
-                    token = strtok(nullptr, delimiter);
-                    if (token)
-                    {
-                        char* ptr;
-                        uint16_t unread = strtol(token, &ptr, 10);
-                        QT_COM_TRACE("Available: %i", unread);
-                        return unread;
-                    }
-                }
-            }
-        }
+        _udpOpen = false;
     }
-    QT_COM_ERROR("Failed to read response");
-    return 0;
+    _contextRetryAt = millis();
 }
 
-int QuectelCellular::read()
+// HTTP client interface
+bool QuectelCellular::httpGet(const char* url, const char* fileName)
 {
-    uint8_t buffer[2];
-    read(buffer, 1);
-    return buffer[0];
-}
+    QT_LOCK();
+    int status;
+    int size;
+    int result;
 
-int QuectelCellular::read(uint8_t *buf, size_t size)
-{
-    if (size == 0)
+    // (Uses the context from setHttpContext())
+    // -> AT+QHTTPCFG="contextid",1
+    // <- OK
+    // -> AT+QHTTPURL=23,80
+    // <- CONNECT
+    // -> http://www.sina.com.cn
+    // <- OK
+    // -> AT+QHTTPGET=80
+    // <- OK
+    // <- +QHTTPGET: 0,200,631871
+    // -> AT+QHTTPREADFILE="RAM:1.bin",60,2
+    // <- OK
+    // <- +QHTTPREADFILE
+    bool ssl = strstr(url, "https://") != nullptr;
+
+    if (!reactivateContext(_httpContext))
     {
-        return 0;
+        return false;
     }
-    if (useEncryption())
+    sprintf(_buffer, "AT+QHTTPCFG=\"contextid\",%i", _httpContext);
+    if (!sendAndCheckReply(_buffer, _OK, 10000))
     {
-        uint32_t length = size > sslLength ? sslLength : size;
-        QT_COM_TRACE("Data len: %i", length);
-        memcpy(buf, _readBuffer, length);
-        buf[length] = '\0';
-        QT_COM_TRACE_START(" <- ");
-        QT_COM_TRACE_ASCII(buf, length);
-        QT_COM_TRACE_END("");
-        sslLength -= length;
-        QT_COM_TRACE("Remaining len: %i", sslLength);
-        if (sslLength > 0)
-        {
-            QT_COM_TRACE("Move %i, %i", length, sslLength);
-            memcpy(_readBuffer, _readBuffer + length, sslLength);
-        }
-        return length;
+        QT_ERROR("Failed to activate PDP context");
+        return false;
     }
-    else
+
+    if (ssl)
     {
-        sprintf(_buffer, "AT+QIRD=1,%i", size);
-        if (sendAndWaitForReply(_buffer, 1000, 1) &&
-            strstr(_buffer, "+QIRD:"))
+        QT_TRACE("Enabling SSL support");
+        // The host is between "https://" and the port or path
+        char host[QT_HOST_LENGTH];
+        const char* start = strstr(url, "https://") + 8;
+        uint8_t length = strcspn(start, ":/?");
+        if (length >= sizeof(host))
         {
-            // +QIRD: <len>
-            // <data>
-            //
-            // OK
-            char* token = strtok(_buffer, " ");
-            token = strtok(nullptr, "\n");
-            char* ptr;
-            uint16_t length = strtol(token, &ptr, 10);
-            QT_COM_TRACE("Data len: %i", length);
-
-            _uart->readBytes(buf, length);
-            buf[length] = '\0';
-            QT_COM_TRACE_START(" <- ");
-            QT_COM_TRACE_ASCII(_buffer, size);
-            QT_COM_TRACE_END("");
-            return length;
+            length = 0;
+        }
+        memcpy(host, start, length);
+        host[length] = 0;
+        // activateSsl() picks TLS 1.2 when no encryption is set, that must
+        // not carry over to the next connect()
+        TlsEncryption encryption = _encryption;
+        int8_t context = activateSsl(host);
+        _encryption = encryption;
+        if (context < 0)
+        {
+            return false;
+        }
+        sprintf(_buffer, "AT+QHTTPCFG=\"sslctxid\",%i", context);
+        if (!sendAndCheckReply(_buffer, _OK, 10000))
+        {
+            QT_ERROR("Failed to activate SSL context ID");
+            return false;
         }
     }
-    return 0;
-}
-
-int QuectelCellular::peek()
-{
-    // Not supported
-    return 0;
-}
 
-void QuectelCellular::flush()
-{
-    while (_uart->available())
+    sprintf(_buffer, "AT+QHTTPURL=%i,30", strlen(url));
+    if (!sendAndCheckReply(_buffer, "CONNECT", 2000))
     {
-        _uart->read();
+        QT_ERROR("Failed to activate URL");
+        return false;
     }
-}
-
-void QuectelCellular::stop()
-{
-    // AT+QICLOSE=1,10
-    sprintf(_command, "+Q%sCLOSE", useEncryption() ? _SSL_PREFIX : _INET_PREFIX);
-    sprintf(_buffer, "AT%s=1,10", _command);
-    if (!sendAndCheckReply(_buffer, _OK, 10000))
+    if (!sendAndCheckReply(url, "OK", 2000))
     {
-        QT_ERROR("Failed to close connection");
+        QT_ERROR("Failed to send URL");
+        return false;
     }
-    uint32_t timeout = millis() + 20000;
-    while (millis() < timeout)
+    if (!sendAndWaitForReply("AT+QHTTPGET=60", 60000, 3))
     {
-        sprintf(_command, "AT+Q%sSTATE=1,1", useEncryption() ? _SSL_PREFIX : _INET_PREFIX);
-        sendAndWaitForReply(_command, 1000, 3);
-        if (_buffer[0] == 'O' && _buffer[1] == 'K')
-        {
-            QT_TRACE("Disconnected");
-            return;
-        }
-        callWatchdog();
-        delay(500);
+        QT_ERROR("Failed to send request");
+        return false;
     }
-}
-
-uint8_t QuectelCellular::connected()
-{
-    // Response is:
-    // +QISTATE: 1,"TCP","54.225.64.197",80,4097,5,1,1,0,"uart1"
-    //
-    // OK
-    //
-    //NOTE ON SSL:
-    //UG96 has a bug where it returns instead of qsslstate on qsslstate requests
-    //to mitigate this we have changed occurances of _command to QISTATE
-
-    sprintf(_command, "Q%sSTATE", useEncryption() ? _SSL_PREFIX : _INET_PREFIX);
-    sprintf(_buffer, "AT+%s=1,1", _command);
-    if (sendAndWaitForReply(_buffer, 1000, 3) &&
-        strstr(_buffer, "QISTATE"))
+    const char qHttpGet[] = "+QHTTPGET: ";
+    char * token = strtok(_buffer, qHttpGet);
+    if (!token)
     {
-        char* tokenStart = strstr(_buffer, "QISTATE");
-        tokenStart = &_buffer[tokenStart - _buffer];
-
-        char* token = strtok(tokenStart, ",");
-        token = strtok(nullptr, ",");
-        token = strtok(nullptr, ",");
-        token = strtok(nullptr, ",");
-        token = strtok(nullptr, ",");
-        token = strtok(nullptr, ",");
-
-        QT_COM_TRACE("Socket State: %s, Connected: %s", token, strcmp(token, "3") == 0 ? "true" : "false");
-
-        return strcmp(token, "3") == 0;
+        QT_ERROR("Failed to receive data");
+        return false;
     }
-    return false;
-}
-
-bool QuectelCellular::activateSsl()
-{
-	if(!useEncryption()) {
-		_encryption = TlsEncryption::Tls12; //Set to Tls12 if no other encryption is specified
-	}
+    const char delimiter[] = ",";
+    token = strtok(nullptr, delimiter);
+    token = strtok(nullptr, delimiter);
+    if (!token)
+    {
+        QT_ERROR("Failed to receive data");
+        return false;
+    }
+    status = atoi(token);
+    token = strtok(nullptr, delimiter);
+    size = atoi(token);
+    QT_COM_DEBUG("HTTP status code: %i, size: %i", status, size);
+    // Only logged, unused when the log is compiled out
+    (void)status;
+    (void)size;
 
-    sprintf(_command, "AT+QSSLCFG=\"sslversion\",1,%i", (uint8_t)_encryption);
-    if (!sendAndCheckReply(_command, _OK, 10000))    // Set TLS
+    char name[QT_FILE_NAME_LENGTH];
+    if (getFullFileName(name, fileName))
     {
-        QT_ERROR("Failed to set TLS version");
+        setFileEntry(name, true, QT_FILE_SIZE_UNKNOWN);
+    }
+    sprintf(_buffer, "AT+QHTTPREADFILE=\"%s%s\",60,1", getVolumePrefix(fileName), fileName);
+    if (!sendAndWaitForReply(_buffer, 60000, 3))
+    {
+        QT_ERROR("Failed to read response");
         return false;
     }
-    if (!sendAndCheckReply("AT+QSSLCFG=\"ciphersuite\",1,\"0xFFFF\"", _OK, 10000))  // Allow all
+    const char qReadFile[] = "+QHTTPREADFILE: ";
+    token = strtok(_buffer, qReadFile);
+    if (!token)
     {
-        QT_ERROR("Failed to set cipher suites");
+        QT_ERROR("Failed to save response");
         return false;
     }
-    if (!sendAndCheckReply("AT+QSSLCFG=\"seclevel\",1,0", _OK, 10000))
+    token = strtok(nullptr, delimiter);
+    result = atoi(token);
+    QT_COM_DEBUG("HTTP read response result: %i", result);
+    if (result != 0)
     {
-        QT_ERROR("Failed to set security level");
+        QT_ERROR("Failed to save response, error %i", result);
         return false;
     }
     return true;
 }
 
-bool QuectelCellular::useEncryption()
-{
-    return _encryption != TlsEncryption::None;
-}
-
 ///////////////////////////////////////////////////////////
 //
-// File client interface
+// DNS
 //
-FILE_HANDLE QuectelCellular::openFile(const char* fileName, bool overWrite)
+bool QuectelCellular::setDnsServers(const char* primary, const char* secondary)
 {
-    // AT+QFOPEN="RAM:file.ext",0
-    // +QFOPEN:3000
-    //
+    QT_LOCK();
+    // AT+QIDNSCFG=1,"8.8.8.8","8.8.4.4"
     // OK
-    sprintf(_buffer,"AT+QFOPEN=\"RAM:%s\",%i", fileName, overWrite ? 1 : 0);
-    if (!sendAndWaitForReply(_buffer, 1000, 3))
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
     {
-        QT_ERROR("Timeout opening file");
-        return NOT_A_FILE_HANDLE;
+        sprintf(_buffer, "AT+QIDNSCFG=\"%s\"", primary);
     }
-    char* token = strtok(_buffer, "+QFOPEN: ");
-    if (token)
+    else
     {
-        uint32_t result = atoi(token);
-        return result;
+        sprintf(_buffer, "AT+QIDNSCFG=%i,\"%s\"", _socketContext, primary);
+    }
+    if (secondary != nullptr)
+    {
+        sprintf(_buffer + strlen(_buffer), ",\"%s\"", secondary);
+    }
+    if (!sendAndCheckReply(_buffer, _OK))
+    {
+        QT_ERROR("Failed to set DNS servers");
+        return false;
     }
-    return NOT_A_FILE_HANDLE;
+    clearDnsCache();
+    return true;
 }
 
-bool QuectelCellular::readFile(FILE_HANDLE fileHandle, uint8_t* buffer, uint32_t length)
+bool QuectelCellular::resolve(const char* host, IPAddress& address)
 {
-    // AT+QFREAD=3000,10
-    // CONNECT
-    // Read data
-    //
+    QT_LOCK();
+    DnsCacheEntry* entry = findDnsEntry(host);
+    if (entry != nullptr)
+    {
+        QT_DEBUG("DNS cache hit for %s", host);
+        address = entry->address;
+        return true;
+    }
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
+    {
+        QT_ERROR("DNS lookup not supported by %s", _profile->name);
+        return false;
+    }
+
+    // AT+QIDNSGIP=1,"www.example.com"
+    // OK
+    //
+    // +QIURC: "dnsgip",0,1,600
+    // +QIURC: "dnsgip","93.184.216.34"
+    _dnsError = -1;
+    _dnsPending = 0;
+    _dnsResolved = false;
+    sprintf(_buffer, "AT+QIDNSGIP=%i,\"%s\"", _socketContext, host);
+    if (!sendAndCheckReply(_buffer, _OK))
+    {
+        QT_ERROR("DNS lookup failed");
+        return false;
+    }
+    uint32_t start = millis();
+    while (!_dnsResolved &&
+           (_dnsError < 0 || (_dnsError == 0 && _dnsPending > 0)))
+    {
+        if (millis() - start > QT_DNS_TIMEOUT * 1000UL)
+        {
+            QT_ERROR("DNS lookup timeout");
+            return false;
+        }
+        callWatchdog();
+        processUrcs();
+        delay(1);
+    }
+    if (!_dnsResolved)
+    {
+        QT_ERROR("DNS lookup failed, error %i", _dnsError);
+        return false;
+    }
+    QT_DEBUG("%s resolved, TTL %lu", host, (unsigned long)_dnsTtl);
+    addDnsEntry(host, _dnsAddress, _dnsTtl);
+    address = _dnsAddress;
+    return true;
+}
+
+void QuectelCellular::clearDnsCache()
+{
+    QT_LOCK();
+    for (uint8_t i = 0; i < QT_DNS_CACHE_SIZE; i++)
+    {
+        _dnsCache[i].host[0] = 0;
+    }
+}
+
+DnsCacheEntry* QuectelCellular::findDnsEntry(const char* host)
+{
+    uint32_t now = millis();
+    for (uint8_t i = 0; i < QT_DNS_CACHE_SIZE; i++)
+    {
+        DnsCacheEntry& entry = _dnsCache[i];
+        if (entry.host[0] == 0)
+        {
+            continue;
+        }
+        if ((int32_t)(entry.expires - now) <= 0)
+        {
+            entry.host[0] = 0;
+            continue;
+        }
+        if (strcasecmp(entry.host, host) == 0)
+        {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+void QuectelCellular::addDnsEntry(const char* host, const IPAddress& address, uint32_t ttl)
+{
+    if (ttl == 0 || strlen(host) >= QT_DNS_HOST_LENGTH)
+    {
+        return;
+    }
+    if (ttl > QT_DNS_MAX_TTL)
+    {
+        ttl = QT_DNS_MAX_TTL;
+    }
+    // A free entry, otherwise the one closest to expiring. findDnsEntry()
+    // has already freed the expired ones.
+    uint32_t now = millis();
+    DnsCacheEntry* entry = &_dnsCache[0];
+    for (uint8_t i = 0; i < QT_DNS_CACHE_SIZE; i++)
+    {
+        if (_dnsCache[i].host[0] == 0)
+        {
+            entry = &_dnsCache[i];
+            break;
+        }
+        if (_dnsCache[i].expires - now < entry->expires - now)
+        {
+            entry = &_dnsCache[i];
+        }
+    }
+    strcpy(entry->host, host);
+    entry->address = address;
+    entry->expires = now + ttl * 1000UL;
+}
+
+///////////////////////////////////////////////////////////
+//
+// TCP client interface
+//
+int QuectelCellular::connect(IPAddress ip, uint16_t port)
+{
+    QT_LOCK();
+    char address[16];
+    sprintf(address, "%i.%i.%i.%i", ip[0], ip[1], ip[2], ip[3]);
+    return connect(address, port);
+}
+
+int QuectelCellular::connect(IPAddress ip, uint16_t port, TlsEncryption encryption)
+{
+    QT_LOCK();
+    _encryption = encryption;
+    return connect(ip, port);
+}
+
+int QuectelCellular::connect(const char *host, uint16_t port, TlsEncryption encryption) {
+    QT_LOCK();
+    _encryption = encryption;
+    return connect(host, port);
+}
+
+int QuectelCellular::connect(const char *host, uint16_t port)
+{
+    QT_LOCK();
+    // Picks up a remote close of an idle socket
+    processUrcs();
+    if (_socketState == SocketState::Open &&
+        _port == port &&
+        _socketEncryption == _encryption &&
+        _openContext == _socketContext &&
+        strcmp(_host, host) == 0)
+    {
+        QT_DEBUG("Reusing connection");
+        _socketIdle = false;
+        return true;
+    }
+    if (_socketState != SocketState::Closed)
+    {
+        closeSocket();
+    }
+    if (strlen(host) < sizeof(_host))
+    {
+        strcpy(_host, host);
+    }
+    else
+    {
+        _host[0] = 0;
+    }
+    _port = port;
+    _socketEncryption = _encryption;
+    _openContext = _socketContext;
+    return openConnection(host, port);
+}
+
+int QuectelCellular::openConnection(const char* host, uint16_t port)
+{
+    IPAddress ip;
+    if (_socketEncryption != TlsEncryption::None ||
+        hasFeature(QT_FEATURE_LEGACY_TCPIP) ||
+        parseAddress(host, ip))
+    {
+        return openSocket(host, port);
+    }
+    if (!resolve(host, ip))
+    {
+        return false;
+    }
+    char address[16];
+    sprintf(address, "%i.%i.%i.%i", ip[0], ip[1], ip[2], ip[3]);
+    if (openSocket(address, port))
+    {
+        return true;
+    }
+    // The cached address may be stale, look it up again next time
+    DnsCacheEntry* entry = findDnsEntry(host);
+    if (entry != nullptr)
+    {
+        entry->host[0] = 0;
+    }
+    return false;
+}
+
+int QuectelCellular::openSocket(const char* host, uint16_t port)
+{
+    int8_t context = 0;
+    // The client socket is replaced, and so is its context
+    _socketSslContext = -1;
+    if (_socketEncryption != TlsEncryption::None)
+    {
+        if (!hasFeature(QT_FEATURE_SSL))
+        {
+            QT_ERROR("SSL not supported by %s", _profile->name);
+            return false;
+        }
+        context = activateSsl(host);
+        if (context < 0)
+        {
+            return false;
+        }
+        _socketSslContext = context;
+    }
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
+    {
+        return connectLegacy(host, port);
+    }
+    if (!reactivateContext(_openContext))
+    {
+        return false;
+    }
+
+    // AT+QIOPEN=<contextID>,1,"TCP","220.180.239.201",8713,0,0
+    // AT+QSSLOPEN=<contextID>,<sslctxID>,1,"host",443,0
+    _socketState = SocketState::Closing;
+    sprintf(_command, "+Q%sOPEN", _socketEncryption != TlsEncryption::None ? _SSL_PREFIX : _INET_PREFIX);
+    if (_socketEncryption != TlsEncryption::None)
+    {
+        sprintf(_buffer, "AT%s=%i,%i,1,\"%s\",%i,0", _command, _openContext, context, host, port);
+    }
+    else
+    {
+        sprintf(_buffer, "AT%s=%i,1,\"TCP\",\"%s\",%i,0,0", _command, _openContext, host, port);
+    }
+    if (!sendAndCheckReply(_buffer, _OK))
+    {
+        QT_ERROR("Connection failed");
+        return false;
+    }
+    if (!waitForOpen(QT_CLIENT_SOCKET))
+    {
+        return false;
+    }
+    QT_DEBUG("Connection open");
+    _socketState = SocketState::Open;
+    _lastConnectionCheck = millis();
+    return true;
+}
+
+bool QuectelCellular::waitForOpen(uint8_t connectId)
+{
+    // Waits for the result of the open command in _command
+    // +QIOPEN: <connectID>,<err>
+    char prefix[20];
+    sprintf(prefix, "%s: %i,", _command, connectId);
+    return waitForResult(prefix, _profile->openTimeout * 1000UL);
+}
+
+bool QuectelCellular::waitForResult(const char* prefix, uint32_t timeout)
+{
+    // Waits for a result line starting with prefix, followed by 0 for
+    // success. The line is left in _buffer.
+#ifdef M2M_QUECTEL_THREADS
+    if (_mqttOpening)
+    {
+        return waitForResultUnlocked(prefix, timeout);
+    }
+#endif
+    uint32_t start = millis();
+    while (true)
+    {
+        callWatchdog();
+        char* token;
+        if (readReply(500, 1) &&
+            (token = strstr(_buffer, prefix)) != nullptr)
+        {
+            int error = atoi(token + strlen(prefix));
+            if (error != 0)
+            {
+                QT_ERROR("%s error %i", prefix, error);
+                return false;
+            }
+            return true;
+        }
+        if (millis() - start > timeout)
+        {
+            QT_ERROR("%s timeout", prefix);
+            return false;
+        }
+    }
+}
+
+#ifdef M2M_QUECTEL_THREADS
+bool QuectelCellular::waitForResultUnlocked(const char* prefix, uint32_t timeout)
+{
+    // The lock is released between polls. A command of another thread may
+    // read the result, handleUrc() keeps it in _awaitedLine. That command
+    // also overwrites _buffer and _command, the caller gets them back.
+    char command[sizeof(_command)];
+    strcpy(command, prefix);
+    strcpy(_awaitedPrefix, command);
+    _awaitedLine[0] = 0;
+    uint32_t start = millis();
+    while (_awaitedLine[0] == 0 &&
+           millis() - start <= timeout)
+    {
+        _mutex.unlock();
+        delay(_ioInterval);
+        _mutex.lock();
+        callWatchdog();
+        processUrcs();
+    }
+    _awaitedPrefix[0] = 0;
+    strcpy(_command, command);
+    if (_awaitedLine[0] == 0)
+    {
+        QT_ERROR("%s timeout", command);
+        return false;
+    }
+    strcpy(_buffer, _awaitedLine);
+    int error = atoi(_buffer + strlen(command));
+    if (error != 0)
+    {
+        QT_ERROR("%s error %i", command, error);
+        return false;
+    }
+    return true;
+}
+#endif
+
+void QuectelCellular::waitForMqttOpen()
+{
+#ifdef M2M_QUECTEL_THREADS
+    // loop() may be reconnecting with the lock released, its commands and
+    // the MQTT state are left alone until it is done
+    while (_mqttOpening)
+    {
+        _mutex.unlock();
+        delay(1);
+        _mutex.lock();
+    }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UDP
+//
+bool QuectelCellular::beginUdp(uint16_t localPort, uint8_t contextId)
+{
+    QT_LOCK();
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
+    {
+        QT_ERROR("UDP not supported by %s", _profile->name);
+        return false;
+    }
+    if (_udpOpen || _warmStarted)
+    {
+        // May also be left open by the session before a warm start
+        endUdp();
+    }
+    if (!reactivateContext(contextId))
+    {
+        return false;
+    }
+    // AT+QIOPEN=1,2,"UDP SERVICE","127.0.0.1",0,5683,0
+    // OK
+    //
+    // +QIOPEN: 2,0
+    _udpContext = contextId;
+    strcpy(_command, "+QIOPEN");
+    sprintf(_buffer, "AT+QIOPEN=%i,%i,\"UDP SERVICE\",\"127.0.0.1\",0,%u,0", contextId, QT_UDP_SOCKET, localPort);
+    if (!sendAndCheckReply(_buffer, _OK) ||
+        !waitForOpen(QT_UDP_SOCKET))
+    {
+        QT_ERROR("Failed to open UDP socket");
+        return false;
+    }
+    _udpOpen = true;
+    _udpPending = false;
+    _udpQueueLength = 0;
+    return true;
+}
+
+void QuectelCellular::endUdp()
+{
+    QT_LOCK();
+    // AT+QICLOSE=2
+    // OK
+    sprintf(_buffer, "AT+QICLOSE=%i", QT_UDP_SOCKET);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        QT_ERROR("Failed to close UDP socket");
+    }
+    _udpOpen = false;
+    _udpPending = false;
+    _udpQueueLength = 0;
+}
+
+bool QuectelCellular::sendTo(IPAddress ip, uint16_t port, const uint8_t* data, size_t length)
+{
+    QT_LOCK();
+    if (!_udpOpen)
+    {
+        QT_ERROR("UDP socket not open");
+        return false;
+    }
+    if (length == 0 ||
+        length > _profile->maxSendSize)
+    {
+        QT_ERROR("Invalid datagram length %u", (unsigned int)length);
+        return false;
+    }
+    // AT+QISEND=2,5,"10.0.0.1",5683
+    // > <data>
+    // SEND OK
+    sprintf(_buffer, "AT+QISEND=%i,%u,\"%i.%i.%i.%i\",%u", QT_UDP_SOCKET, (unsigned int)length,
+        ip[0], ip[1], ip[2], ip[3], port);
+    if (!sendAndWaitFor(_buffer, "> ", 5000))
+    {
+        QT_ERROR("+QISEND handshake error, %s", _buffer);
+        return false;
+    }
+    QT_COM_TRACE_START(" -> ");
+    QT_COM_TRACE_BUFFER(data, length);
+    QT_COM_TRACE_END("");
+    uartWrite(data, length);
+    if (!readReply(5000, 1) ||
+        !strstr(_buffer, "SEND OK"))
+    {
+        QT_ERROR("Send failed");
+        return false;
+    }
+    _stats.socketBytesOut[QT_UDP_SOCKET] += length;
+    return true;
+}
+
+void QuectelCellular::setUdpQueue(uint8_t* buffer, uint16_t size)
+{
+    QT_LOCK();
+    // Datagrams still queued are dropped with the old buffer
+    _udpQueue = buffer;
+    _udpQueueSize = buffer != nullptr ? size : 0;
+    _udpQueueLength = 0;
+}
+
+bool QuectelCellular::queueTo(IPAddress ip, uint16_t port, const uint8_t* data, size_t length)
+{
+    QT_LOCK();
+    if (_udpQueue == nullptr)
+    {
+        return sendTo(ip, port, data, length);
+    }
+    if (length == 0 ||
+        length > _profile->maxSendSize ||
+        QT_UDP_HEADER_SIZE + length > _udpQueueSize)
+    {
+        QT_ERROR("Invalid datagram length %u", (unsigned int)length);
+        return false;
+    }
+    if (_udpQueueLength + QT_UDP_HEADER_SIZE + length > _udpQueueSize)
+    {
+        flushUdp();
+        if (_udpQueueLength > 0)
+        {
+            return false;
+        }
+    }
+    // Address, port and length, then the datagram
+    uint8_t* record = _udpQueue + _udpQueueLength;
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        record[i] = ip[i];
+    }
+    record[4] = port >> 8;
+    record[5] = port & 0xff;
+    record[6] = length >> 8;
+    record[7] = length & 0xff;
+    memcpy(record + QT_UDP_HEADER_SIZE, data, length);
+    _udpQueueLength += QT_UDP_HEADER_SIZE + length;
+    return true;
+}
+
+uint8_t QuectelCellular::flushUdp()
+{
+    QT_LOCK();
+    uint8_t count = 0;
+    uint16_t offset = 0;
+    while (offset < _udpQueueLength)
+    {
+        const uint8_t* record = _udpQueue + offset;
+        uint16_t port = (record[4] << 8) | record[5];
+        uint16_t length = (record[6] << 8) | record[7];
+        if (!sendTo(IPAddress(record[0], record[1], record[2], record[3]), port,
+                    record + QT_UDP_HEADER_SIZE, length))
+        {
+            break;
+        }
+        offset += QT_UDP_HEADER_SIZE + length;
+        count++;
+    }
+    // Keep what could not be sent
+    if (offset > 0)
+    {
+        memmove(_udpQueue, _udpQueue + offset, _udpQueueLength - offset);
+        _udpQueueLength -= offset;
+    }
+    return count;
+}
+
+int QuectelCellular::receiveFrom(uint8_t* buffer, size_t size, IPAddress& ip, uint16_t& port)
+{
+    QT_LOCK();
+    processUrcs();
+    if (!_udpOpen ||
+        !_udpPending)
+    {
+        return 0;
+    }
+    // AT+QIRD=2
+    // +QIRD: 5,"10.0.0.1",5683
+    // <data>
+    //
+    // OK
+    sprintf(_buffer, "AT+QIRD=%i", QT_UDP_SOCKET);
+    if (!sendAndWaitForReply(_buffer, 1000, 1))
+    {
+        return 0;
+    }
+    unsigned int length, a, b, c, d, remotePort;
+    if (sscanf(_buffer, "+QIRD: %u,\"%u.%u.%u.%u\",%u", &length, &a, &b, &c, &d, &remotePort) != 6 ||
+        length == 0)
+    {
+        // +QIRD: 0 when all is read, followed by OK
+        if (strstr(_buffer, "+QIRD:"))
+        {
+            readReply(1000, 1);
+        }
+        _udpPending = false;
+        return 0;
+    }
+    size_t stored = length < size ? length : size;
+    uartReadBytes(buffer, stored, 1000);
+    // The rest of a datagram that does not fit is dropped
+    for (size_t dropped = stored; dropped < length; dropped++)
+    {
+        uint8_t value;
+        uartReadBytes(&value, 1, 1000);
+    }
+    QT_COM_TRACE_START(" <- ");
+    QT_COM_TRACE_BUFFER(buffer, stored);
+    QT_COM_TRACE_END("");
+    readReply(1000, 1);
+    _stats.socketBytesIn[QT_UDP_SOCKET] += length;
+    ip = IPAddress(a, b, c, d);
+    port = remotePort;
+    return stored;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// MQTT
+//
+bool QuectelCellular::mqttConnect(const QuectelMqttConfig& config)
+{
+    QT_LOCK();
+    waitForMqttOpen();
+    if (!hasFeature(QT_FEATURE_MQTT))
+    {
+        QT_ERROR("MQTT not supported by %s", _profile->name);
+        return false;
+    }
+    if (_mqttWanted)
+    {
+        mqttDisconnect();
+    }
+    _mqttConfig = config;
+    _mqttConfigured = false;
+    _mqttWanted = true;
+    for (uint8_t i = 0; i < QT_MQTT_SUBSCRIPTIONS; i++)
+    {
+        _mqttTopics[i] = nullptr;
+    }
+    return mqttOpen();
+}
+
+void QuectelCellular::mqttDisconnect()
+{
+    QT_LOCK();
+    waitForMqttOpen();
+    _mqttWanted = false;
+    if (!_mqttConnected)
+    {
+        mqttClose();
+        return;
+    }
+    // AT+QMTDISC=0
+    // OK
+    //
+    // +QMTDISC: 0,0
+    sprintf(_buffer, "AT+QMTDISC=%i", QT_MQTT_CLIENT);
+    sprintf(_command, "+QMTDISC: %i,", QT_MQTT_CLIENT);
+    if (!sendAndCheckReply(_buffer, _OK) ||
+        !waitForResult(_command, QT_MQTT_TIMEOUT * 1000UL))
+    {
+        mqttClose();
+    }
+    mqttLost();
+}
+
+bool QuectelCellular::mqttConnected()
+{
+    QT_LOCK();
+    processUrcs();
+    return _mqttConnected;
+}
+
+bool QuectelCellular::mqttPublish(const char* topic, const uint8_t* payload, size_t length, uint8_t qos, bool retain)
+{
+    QT_LOCK();
+    waitForMqttOpen();
+    processUrcs();
+    if (!_mqttConnected &&
+        !(_mqttWanted && mqttOpen()))
+    {
+        QT_ERROR("MQTT not connected");
+        return false;
+    }
+    if (length > _profile->maxSendSize)
+    {
+        QT_ERROR("Invalid message length %i", length);
+        return false;
+    }
+
+    // QoS 0 messages have no ID. Otherwise wait for a free in flight slot,
+    // which is taken before sending as the result may come at any time.
+    uint16_t id = 0;
+    int8_t slot = -1;
+    if (qos > 0)
+    {
+        uint32_t start = millis();
+        while (true)
+        {
+            for (uint8_t i = 0; i < QT_MQTT_MAX_IN_FLIGHT && slot < 0; i++)
+            {
+                if (_mqttInFlight[i] == 0)
+                {
+                    slot = i;
+                }
+            }
+            if (slot >= 0)
+            {
+                break;
+            }
+            if (!_mqttConnected ||
+                millis() - start > QT_MQTT_TIMEOUT * 1000UL)
+            {
+                QT_ERROR("No MQTT acknowledgement");
+                return false;
+            }
+            callWatchdog();
+            processUrcs();
+            delay(1);
+        }
+        id = _mqttNextId++;
+        if (_mqttNextId == 0)
+        {
+            _mqttNextId = 1;
+        }
+        _mqttInFlight[slot] = id;
+    }
+
+    // AT+QMTPUB=0,1,1,0,"sensors/temp",5
+    // > <payload>
+    // OK
+    //
+    // +QMTPUB: 0,1,0
+    sprintf(_buffer, "AT+QMTPUB=%i,%u,%u,%i,\"%s\",%u", QT_MQTT_CLIENT, id, qos, retain ? 1 : 0, topic, (unsigned int)length);
+    if (!sendAndWaitFor(_buffer, "> ", 5000))
+    {
+        QT_ERROR("+QMTPUB handshake error, %s", _buffer);
+    }
+    else
+    {
+        QT_COM_TRACE_START(" -> ");
+        QT_COM_TRACE_BUFFER(payload, length);
+        QT_COM_TRACE_END("");
+        uartWrite(payload, length);
+        if (readReply(5000, 1) &&
+            strstr(_buffer, _OK))
+        {
+            return true;
+        }
+        QT_ERROR("Publish failed");
+    }
+    if (slot >= 0 &&
+        _mqttInFlight[slot] == id)
+    {
+        _mqttInFlight[slot] = 0;
+    }
+    _mqttFailures++;
+    return false;
+}
+
+bool QuectelCellular::mqttSubscribe(const char* topic, uint8_t qos)
+{
+    QT_LOCK();
+    waitForMqttOpen();
+    if (!mqttSendSubscribe(topic, qos))
+    {
+        return false;
+    }
+    int8_t free = -1;
+    for (uint8_t i = 0; i < QT_MQTT_SUBSCRIPTIONS; i++)
+    {
+        if (_mqttTopics[i] != nullptr &&
+            strcmp(_mqttTopics[i], topic) == 0)
+        {
+            _mqttTopicQos[i] = qos;
+            return true;
+        }
+        if (_mqttTopics[i] == nullptr &&
+            free < 0)
+        {
+            free = i;
+        }
+    }
+    if (free < 0)
+    {
+        QT_ERROR("%s will not be restored after a reconnect", topic);
+        return true;
+    }
+    _mqttTopics[free] = topic;
+    _mqttTopicQos[free] = qos;
+    return true;
+}
+
+bool QuectelCellular::mqttUnsubscribe(const char* topic)
+{
+    QT_LOCK();
+    waitForMqttOpen();
+    for (uint8_t i = 0; i < QT_MQTT_SUBSCRIPTIONS; i++)
+    {
+        if (_mqttTopics[i] != nullptr &&
+            strcmp(_mqttTopics[i], topic) == 0)
+        {
+            _mqttTopics[i] = nullptr;
+        }
+    }
+    if (!_mqttConnected)
+    {
+        return false;
+    }
+    // AT+QMTUNS=0,2,"sensors/cmd"
+    // OK
+    //
+    // +QMTUNS: 0,2,0
+    uint16_t id = _mqttNextId++;
+    if (_mqttNextId == 0)
+    {
+        _mqttNextId = 1;
+    }
+    sprintf(_buffer, "AT+QMTUNS=%i,%u,\"%s\"", QT_MQTT_CLIENT, id, topic);
+    sprintf(_command, "+QMTUNS: %i,%u,", QT_MQTT_CLIENT, id);
+    return sendAndCheckReply(_buffer, _OK) &&
+           waitForResult(_command, QT_MQTT_TIMEOUT * 1000UL);
+}
+
+uint8_t QuectelCellular::getMqttPending()
+{
+    QT_LOCK();
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < QT_MQTT_MAX_IN_FLIGHT; i++)
+    {
+        if (_mqttInFlight[i] != 0)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+uint32_t QuectelCellular::getMqttFailures()
+{
+    QT_LOCK();
+    return _mqttFailures;
+}
+
+bool QuectelCellular::mqttFlush(uint32_t timeout)
+{
+    QT_LOCK();
+    waitForMqttOpen();
+    uint32_t start = millis();
+    while (getMqttPending() > 0)
+    {
+        if (millis() - start > timeout)
+        {
+            return false;
+        }
+        callWatchdog();
+        processUrcs();
+        delay(1);
+    }
+    return true;
+}
+
+bool QuectelCellular::mqttConfigure()
+{
+    // The settings are kept by the module until it restarts, so they are
+    // only sent by the first connect, not by reconnects
+    // AT+QMTCFG="version",0,4
+    // OK
+    bool tls = _mqttConfig.encryption != TlsEncryption::None;
+    int8_t context = 0;
+    _mqttSslContext = -1;
+    if (tls)
+    {
+        TlsEncryption encryption = _encryption;
+        _encryption = _mqttConfig.encryption;
+        context = activateSsl(_mqttConfig.host);
+        _encryption = encryption;
+        if (context < 0)
+        {
+            return false;
+        }
+        _mqttSslContext = context;
+    }
+    // Messages are kept by the module until read, the read reply includes
+    // the payload length
+    const char* format[] =
+    {
+        "AT+QMTCFG=\"version\",%i,4",
+        "AT+QMTCFG=\"keepalive\",%i,%u",
+        "AT+QMTCFG=\"session\",%i,%u",
+        "AT+QMTCFG=\"recv/mode\",%i,1,1",
+        "AT+QMTCFG=\"pdpcid\",%i,%u",
+        "AT+QMTCFG=\"ssl\",%i,%u,%u"
+    };
+    unsigned int values[] =
+    {
+        0,
+        _mqttConfig.keepAlive,
+        _mqttConfig.cleanSession ? 1U : 0U,
+        0,
+        _mqttConfig.contextId,
+        tls ? 1U : 0U
+    };
+    for (uint8_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        // Only the last format uses the SSL context
+        sprintf(_buffer, format[i], QT_MQTT_CLIENT, values[i], context);
+        if (!sendAndCheckReply(_buffer, _OK))
+        {
+            QT_ERROR("MQTT configuration failed");
+            return false;
+        }
+    }
+    _mqttConfigured = true;
+    return true;
+}
+
+bool QuectelCellular::mqttOpen()
+{
+    _mqttRetryAt = millis() + QT_MQTT_RETRY_INTERVAL;
+    if (!_mqttConfigured &&
+        !mqttConfigure())
+    {
+        return false;
+    }
+
+    // The client may still be connected from before a warm start
+    // +QMTCONN: 0,3
+    sprintf(_command, "+QMTCONN: %i,3", QT_MQTT_CLIENT);
+    if (sendAndWaitFor("AT+QMTCONN?", _OK, 1000) &&
+        strstr(_buffer, _command))
+    {
+        QT_DEBUG("MQTT already connected");
+        _mqttConnected = true;
+        return true;
+    }
+    mqttClose();
+
+    // AT+QMTOPEN=0,"broker.example.com",1883
+    // OK
+    //
+    // +QMTOPEN: 0,0
+    sprintf(_buffer, "AT+QMTOPEN=%i,\"%s\",%u", QT_MQTT_CLIENT, _mqttConfig.host, _mqttConfig.port);
+    sprintf(_command, "+QMTOPEN: %i,", QT_MQTT_CLIENT);
+    if (!sendAndCheckReply(_buffer, _OK) ||
+        !waitForResult(_command, QT_MQTT_TIMEOUT * 1000UL))
+    {
+        QT_ERROR("MQTT open failed");
+        return false;
+    }
+
+    // AT+QMTCONN=0,"client","user","password"
+    // OK
+    //
+    // +QMTCONN: 0,0,0
+    int length = sprintf(_buffer, "AT+QMTCONN=%i,\"%s\"", QT_MQTT_CLIENT, _mqttConfig.clientId);
+    if (_mqttConfig.userName != nullptr)
+    {
+        sprintf(_buffer + length, ",\"%s\",\"%s\"", _mqttConfig.userName,
+            _mqttConfig.password != nullptr ? _mqttConfig.password : "");
+    }
+    sprintf(_command, "+QMTCONN: %i,", QT_MQTT_CLIENT);
+    if (!sendAndCheckReply(_buffer, _OK) ||
+        !waitForResult(_command, QT_MQTT_TIMEOUT * 1000UL))
+    {
+        QT_ERROR("MQTT connect failed");
+        mqttClose();
+        return false;
+    }
+    // +QMTCONN: 0,<result>,<ret_code>, the CONNACK return code
+    char* code = strchr(strstr(_buffer, _command) + strlen(_command), ',');
+    if (code != nullptr &&
+        atoi(code + 1) != 0)
+    {
+        QT_ERROR("MQTT connection refused, %i", atoi(code + 1));
+        mqttClose();
+        return false;
+    }
+    QT_DEBUG("MQTT connected");
+    _mqttConnected = true;
+
+    for (uint8_t i = 0; i < QT_MQTT_SUBSCRIPTIONS; i++)
+    {
+        if (_mqttTopics[i] != nullptr)
+        {
+            mqttSendSubscribe(_mqttTopics[i], _mqttTopicQos[i]);
+        }
+    }
+    return true;
+}
+
+void QuectelCellular::mqttClose()
+{
+    // AT+QMTCLOSE=0
+    // OK
+    //
+    // +QMTCLOSE: 0,0
+    //
+    // ERROR when the client is not open
+    sprintf(_buffer, "AT+QMTCLOSE=%i", QT_MQTT_CLIENT);
+    sprintf(_command, "+QMTCLOSE: %i,", QT_MQTT_CLIENT);
+    if (sendAndCheckReply(_buffer, _OK))
+    {
+        waitForResult(_command, QT_MQTT_TIMEOUT * 1000UL);
+    }
+    _mqttConnected = false;
+}
+
+bool QuectelCellular::mqttSendSubscribe(const char* topic, uint8_t qos)
+{
+    if (!_mqttConnected)
+    {
+        QT_ERROR("MQTT not connected");
+        return false;
+    }
+    // AT+QMTSUB=0,1,"sensors/cmd",1
+    // OK
+    //
+    // +QMTSUB: 0,1,0,1
+    uint16_t id = _mqttNextId++;
+    if (_mqttNextId == 0)
+    {
+        _mqttNextId = 1;
+    }
+    sprintf(_buffer, "AT+QMTSUB=%i,%u,\"%s\",%u", QT_MQTT_CLIENT, id, topic, qos);
+    sprintf(_command, "+QMTSUB: %i,%u,", QT_MQTT_CLIENT, id);
+    if (!sendAndCheckReply(_buffer, _OK) ||
+        !waitForResult(_command, QT_MQTT_TIMEOUT * 1000UL))
+    {
+        QT_ERROR("Failed to subscribe to %s", topic);
+        return false;
+    }
+    // The granted QoS, 128 when refused
+    char* granted = strrchr(_buffer, ',');
+    if (granted != nullptr &&
+        atoi(granted + 1) == 128)
+    {
+        QT_ERROR("Subscription to %s refused", topic);
+        return false;
+    }
+    return true;
+}
+
+void QuectelCellular::mqttLost()
+{
+    // Publishes in flight are not resent by the module
+    for (uint8_t i = 0; i < QT_MQTT_MAX_IN_FLIGHT; i++)
+    {
+        if (_mqttInFlight[i] != 0)
+        {
+            _mqttInFlight[i] = 0;
+            _mqttFailures++;
+        }
+    }
+    _mqttConnected = false;
+    _mqttReceived = 0;
+}
+
+bool QuectelCellular::readMqttMessage(uint8_t recvId)
+{
+    // AT+QMTRECV=0,1
+    // +QMTRECV: 0,12,"sensors/cmd",5,"hello"
+    //
+    // OK
+    //
+    // The header is read up to the opening quote of the payload, which may
+    // hold any byte and is read by its length
+    flush();
+    sprintf(_buffer, "AT+QMTRECV=%i,%i", QT_MQTT_CLIENT, recvId);
+    QT_COM_TRACE(" -> %s", _buffer);
+    uint32_t start = millis();
+    uartWriteLine(_buffer);
+    uint16_t index = 0;
+    uint8_t fields = 0;
+    bool quoted = false;
+    while (true)
+    {
+        if (millis() - start > 1000)
+        {
+            QT_ERROR("MQTT receive timeout");
+            recordReply(CommandFamily::Status, start, false);
+            return false;
+        }
+        if (!_transport->available())
+        {
+            delay(1);
+            continue;
+        }
+        char c = uartRead();
+        if (c == '\r')
+        {
+            continue;
+        }
+        if (c == '\n')
+        {
+            _buffer[index] = 0;
+            if (strcmp(_buffer, _OK) == 0 ||
+                strstr(_buffer, _ERROR))
+            {
+                // Nothing stored
+                recordReply(CommandFamily::Status, start, true);
+                return false;
+            }
+            if (index > 0)
+            {
+                handleUrc(_buffer);
+            }
+            index = 0;
+            fields = 0;
+            quoted = false;
+            continue;
+        }
+        if (index < sizeof(_buffer) - 1)
+        {
+            _buffer[index++] = c;
+        }
+        if (c == '"')
+        {
+            quoted = !quoted;
+            if (quoted && fields == 4)
+            {
+                break;
+            }
+        }
+        else if (c == ',' && !quoted)
+        {
+            fields++;
+        }
+    }
+    recordReply(CommandFamily::Status, start, true);
+    _buffer[index] = 0;
+    QT_COM_TRACE(" <- %s", _buffer);
+
+    // +QMTRECV: 0,12,"sensors/cmd",5,"
+    char* topic = strchr(_buffer, '"');
+    char* end = topic != nullptr ? strstr(topic + 1, "\",") : nullptr;
+    size_t length = end != nullptr ? atoi(end + 2) : 0;
+    size_t topicLength = end != nullptr ? end - topic - 1 : 0;
+    size_t stored = 0;
+    if (end != nullptr &&
+        topicLength < _mqttMessageSize)
+    {
+        memcpy(_mqttMessage, topic + 1, topicLength);
+        _mqttMessage[topicLength] = 0;
+        size_t room = _mqttMessageSize - topicLength - 1;
+        stored = length < room ? length : room;
+        uartReadBytes(_mqttMessage + topicLength + 1, stored, 1000);
+    }
+    // The part that does not fit is dropped
+    for (size_t i = stored; i < length; i++)
+    {
+        uint8_t value;
+        uartReadBytes(&value, 1, 1000);
+    }
+    // Closing quote, then OK
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        if (!readReply(1000, 1) ||
+            strstr(_buffer, _OK))
+        {
+            break;
+        }
+    }
+    if (end == nullptr)
+    {
+        QT_ERROR("Invalid MQTT message");
+        return false;
+    }
+    if (mqttcallback == nullptr)
+    {
+        // Nobody to pass it to, dropped
+        return true;
+    }
+    if (topicLength >= _mqttMessageSize)
+    {
+        QT_ERROR("MQTT topic too long");
+        return false;
+    }
+    if (stored < length)
+    {
+        QT_ERROR("MQTT message truncated, %u bytes", (unsigned int)length);
+    }
+    mqttcallback(_mqttMessage, (const uint8_t*)_mqttMessage + topicLength + 1, stored);
+    return true;
+}
+
+int QuectelCellular::connectLegacy(const char* host, uint16_t port)
+{
+    // AT+QIDNSIP=1
+    // OK
+    // AT+QIOPEN=1,"TCP","www.example.com","80"
+    // OK
+    //
+    // 1, CONNECT OK
+    unsigned int a, b, c, d;
+    bool address = sscanf(host, "%u.%u.%u.%u", &a, &b, &c, &d) == 4;
+    sprintf(_buffer, "AT+QIDNSIP=%i", address ? 0 : 1);
+    if (!sendAndCheckReply(_buffer, _OK))
+    {
+        QT_ERROR("Failed to set address type");
+        return false;
+    }
+    _socketState = SocketState::Closing;
+    sprintf(_buffer, "AT+QIOPEN=%i,\"TCP\",\"%s\",\"%u\"", QT_CLIENT_SOCKET, host, port);
+    if (!sendAndCheckReply(_buffer, _OK))
+    {
+        QT_ERROR("Connection failed");
+        return false;
+    }
+    uint32_t expireTime = millis() + _profile->openTimeout * 1000UL;
+    while (millis() < expireTime)
+    {
+        callWatchdog();
+        if (readReply(500, 1))
+        {
+            if (strstr(_buffer, "CONNECT OK") ||
+                strstr(_buffer, "ALREADY CONNECT"))
+            {
+                QT_DEBUG("Connection open");
+                _socketState = SocketState::Open;
+                _lastConnectionCheck = millis();
+                return true;
+            }
+            if (strstr(_buffer, "CONNECT FAIL"))
+            {
+                QT_ERROR("Connection failed");
+                return false;
+            }
+        }
+    }
+    QT_ERROR("Connection timeout");
+    return false;
+}
+
+size_t QuectelCellular::write(uint8_t value)
+{
+    QT_LOCK();
+    return write(&value, 1);
+}
+
+size_t QuectelCellular::write(const uint8_t *buf, size_t size)
+{
+    QT_LOCK();
+    // Picks up a remote close since the last command
+    processUrcs();
+    if (_socketState != SocketState::Open &&
+        !reconnect())
+    {
+        return 0;
+    }
+
+    // At most maxSendSize bytes can be sent in one +QISEND session
+    size_t sent = 0;
+    bool reconnected = false;
+    while (sent < size)
+    {
+        size_t chunk = size - sent;
+        if (chunk > _profile->maxSendSize)
+        {
+            chunk = _profile->maxSendSize;
+        }
+        sprintf(_command, "+Q%sSEND", _socketEncryption != TlsEncryption::None ? _SSL_PREFIX : _INET_PREFIX);
+        sprintf(_buffer, "AT%s=1,%u", _command, (unsigned int)chunk);
+        if (!sendAndWaitFor(_buffer, "> ", 5000))
+        {
+            // The socket may have died without a URC. Only safe to retry
+            // before anything was sent on it.
+            if (sent == 0 && !reconnected)
+            {
+                reconnected = true;
+                if (reconnect())
+                {
+                    continue;
+                }
+            }
+            QT_ERROR("%s handshake error, %s", _command, _buffer);
+            return sent;
+        }
+        QT_COM_TRACE_START(" -> ");
+        QT_COM_TRACE_BUFFER(buf + sent, chunk);
+        QT_COM_TRACE_END("");
+        uartWrite(buf + sent, chunk);
+        if (!readReply(5000, 1) ||
+            !strstr(_buffer, "SEND OK"))
+        {
+            QT_ERROR("Send failed");
+            return sent;
+        }
+        _stats.socketBytesOut[QT_CLIENT_SOCKET] += chunk;
+        sent += chunk;
+        // SEND OK proves the socket is up
+        _lastConnectionCheck = millis();
+    }
+    return sent;
+}
+
+int QuectelCellular::available()
+{
+    QT_LOCK();
+    if (_readLength > 0)
+    {
+        return _readLength;
+    }
+    if (_socketEncryption != TlsEncryption::None ||
+        hasFeature(QT_FEATURE_LEGACY_TCPIP))
+    {
+        // There is no query for the unread count, so the data is read into
+        // _readBuffer and served from there
+        return fillReadBuffer();
+    }
+    sprintf(_buffer, "AT+QIRD=%i,0", QT_CLIENT_SOCKET);
+    if (sendAndWaitForReply(_buffer, 1000, 3))
+    {
+        const char delimiter[] = ",";
+        char * token = strtok(_buffer, delimiter);
+        if (token)
+        {
+            token = strtok(nullptr, delimiter);
+            if (token)
+            {
+                token = strtok(nullptr, delimiter);
+                if (token)
+                {
+                    char* ptr;
+                    uint16_t unread = strtol(token, &ptr, 10);
+                    QT_COM_TRACE("Available: %i", unread);
+                    return unread;
+                }
+            }
+        }
+    }
+    QT_COM_ERROR("Failed to read response");
+    return 0;
+}
+
+int QuectelCellular::read()
+{
+    QT_LOCK();
+    uint8_t value;
+    return read(&value, 1) == 1 ? value : -1;
+}
+
+int QuectelCellular::read(uint8_t *buf, size_t size)
+{
+    QT_LOCK();
+    if (size == 0)
+    {
+        return 0;
+    }
+    if (_readLength == 0 &&
+        _socketEncryption == TlsEncryption::None &&
+        !hasFeature(QT_FEATURE_LEGACY_TCPIP))
+    {
+        // Nothing buffered, read straight into buf
+        if (size > _profile->maxReadSize)
+        {
+            size = _profile->maxReadSize;
+        }
+        sprintf(_buffer, "AT+QIRD=%i,%u", QT_CLIENT_SOCKET, (unsigned int)size);
+        if (sendAndWaitForReply(_buffer, 1000, 1) &&
+            strstr(_buffer, "+QIRD:"))
+        {
+            // +QIRD: <len>
+            // <data>
+            //
+            // OK
+            char* token = strtok(_buffer, " ");
+            token = strtok(nullptr, "\n");
+            char* ptr;
+            uint16_t length = strtol(token, &ptr, 10);
+            if (length > size)
+            {
+                length = size;
+            }
+            QT_COM_TRACE("Data len: %i", length);
+
+            length = uartReadBytes(buf, length, 1000);
+            QT_COM_TRACE_START(" <- ");
+            QT_COM_TRACE_ASCII(buf, length);
+            QT_COM_TRACE_END("");
+            // Consume the trailing OK so it is not taken as the reply
+            // to the next command
+            readReply(1000, 1);
+            _stats.socketBytesIn[QT_CLIENT_SOCKET] += length;
+            return length;
+        }
+        return 0;
+    }
+    const uint8_t* data;
+    size_t length = peekSpan(data);
+    if (length > size)
+    {
+        length = size;
+    }
+    memcpy(buf, data, length);
+    consume(length);
+    return length;
+}
+
+int QuectelCellular::peek()
+{
+    QT_LOCK();
+    const uint8_t* data;
+    return peekSpan(data) > 0 ? *data : -1;
+}
+
+size_t QuectelCellular::peekSpan(const uint8_t*& data)
+{
+    QT_LOCK();
+    if (_readLength == 0)
+    {
+        fillReadBuffer();
+    }
+    data = _readBuffer + _readStart;
+    return _readLength;
+}
+
+void QuectelCellular::consume(size_t length)
+{
+    QT_LOCK();
+    if (length >= _readLength)
+    {
+        _readLength = 0;
+        _readStart = 0;
+        return;
+    }
+    _readStart += length;
+    _readLength -= length;
+}
+
+uint16_t QuectelCellular::fillReadBuffer()
+{
+    // The data follows the length line and is read by its length, straight
+    // into _readBuffer
+    //
+    // AT+QSSLRECV=1,256      AT+QIRD=1,256       AT+QIRD=0,1,1,256 (M95)
+    // +QSSLRECV: 5           +QIRD: 5            +QIRD: 10.7.157.1:80,TCP,5
+    // <data>                 <data>              <data>
+    //
+    // OK                     OK                  OK
+    _readStart = 0;
+    _readLength = 0;
+    uint16_t size = sizeof(_readBuffer) < _profile->maxReadSize ? sizeof(_readBuffer) : _profile->maxReadSize;
+    const char* prefix = "+QIRD:";
+    if (_socketEncryption != TlsEncryption::None)
+    {
+        prefix = "+QSSLRECV:";
+        sprintf(_buffer, "AT+QSSLRECV=%i,%i", QT_CLIENT_SOCKET, size);
+    }
+    else if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
+    {
+        sprintf(_buffer, "AT+QIRD=0,1,%i,%i", QT_CLIENT_SOCKET, size);
+    }
+    else
+    {
+        sprintf(_buffer, "AT+QIRD=%i,%i", QT_CLIENT_SOCKET, size);
+    }
+    if (!sendAndWaitForReply(_buffer, 1000, 1))
+    {
+        QT_COM_ERROR("Failed to read response");
+        return 0;
+    }
+    char* token = strstr(_buffer, prefix);
+    if (token == nullptr)
+    {
+        // Only OK, no data, or an error
+        return 0;
+    }
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
+    {
+        token = strrchr(token, ',');
+    }
+    else
+    {
+        token += strlen(prefix);
+    }
+    uint16_t length = token != nullptr ? atoi(token + 1) : 0;
+    if (length > size)
+    {
+        length = size;
+    }
+    _readLength = uartReadBytes(_readBuffer, length, 1000);
+    readReply(1000, 1);
+    _stats.socketBytesIn[QT_CLIENT_SOCKET] += _readLength;
+    QT_COM_TRACE("Available: %i", _readLength);
+    return _readLength;
+}
+
+void QuectelCellular::flush()
+{
+    QT_LOCK();
+    processUrcs();
+}
+
+void QuectelCellular::stop()
+{
+    QT_LOCK();
+    _readLength = 0;
+    _readStart = 0;
+    if (_idleTimeout > 0 &&
+        _socketState == SocketState::Open)
+    {
+        _socketIdle = true;
+        _idleSince = millis();
+        return;
+    }
+    closeSocket();
+    _host[0] = 0;
+}
+
+void QuectelCellular::setIdleTimeout(uint32_t milliseconds)
+{
+    QT_LOCK();
+    _idleTimeout = milliseconds;
+}
+
+bool QuectelCellular::setKeepAlive(bool enable, uint8_t idleMinutes, uint8_t intervalSeconds, uint8_t probes)
+{
+    QT_LOCK();
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
+    {
+        QT_ERROR("TCP keepalive not supported by %s", _profile->name);
+        return false;
+    }
+    // AT+QICFG="tcp/keepalive",1,2,30,3
+    // OK
+    if (enable)
+    {
+        sprintf(_buffer, "AT+QICFG=\"tcp/keepalive\",1,%u,%u,%u", idleMinutes, intervalSeconds, probes);
+    }
+    else
+    {
+        strcpy(_buffer, "AT+QICFG=\"tcp/keepalive\",0");
+    }
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        QT_ERROR("Failed to set TCP keepalive");
+        return false;
+    }
+    return true;
+}
+
+bool QuectelCellular::reconnect()
+{
+    if (_host[0] == 0)
+    {
+        QT_ERROR("Not connected");
+        return false;
+    }
+    QT_DEBUG("Reconnecting to %s", _host);
+    closeSocket();
+    _encryption = _socketEncryption;
+    return openConnection(_host, _port);
+}
+
+void QuectelCellular::closeSocket()
+{
+    _readLength = 0;
+    _readStart = 0;
+    _socketIdle = false;
+    if (_socketState == SocketState::Closed)
+    {
+        return;
+    }
+    _socketState = SocketState::Closed;
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
+    {
+        // AT+QICLOSE=1
+        // 1, CLOSE OK
+        sprintf(_buffer, "AT+QICLOSE=%i", QT_CLIENT_SOCKET);
+        if (!sendAndCheckReply(_buffer, "CLOSE OK", 10000))
+        {
+            QT_ERROR("Failed to close connection");
+        }
+        return;
+    }
+
+    // AT+QICLOSE=1,10
+    // OK
+    //
+    // The reply comes when the socket is closed, forcibly after the timeout
+    sprintf(_command, "+Q%sCLOSE", _socketEncryption != TlsEncryption::None ? _SSL_PREFIX : _INET_PREFIX);
+    sprintf(_buffer, "AT%s=%i,10", _command, QT_CLIENT_SOCKET);
+    if (!sendAndCheckReply(_buffer, _OK, 11000))
+    {
+        QT_ERROR("Failed to close connection");
+    }
+}
+
+uint8_t QuectelCellular::connected()
+{
+    QT_LOCK();
+    processUrcs();
+    if (_socketState == SocketState::Open &&
+        _connectionCheckInterval > 0 &&
+        millis() - _lastConnectionCheck >= _connectionCheckInterval)
+    {
+        checkConnection();
+    }
+    // Data read before a remote close can still be read
+    return (_socketState == SocketState::Open && !_socketIdle) || _readLength > 0;
+}
+
+bool QuectelCellular::checkConnection()
+{
+    QT_LOCK();
+    _lastConnectionCheck = millis();
+    if (_socketState == SocketState::Closed)
+    {
+        return false;
+    }
+    bool open = false;
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
+    {
+        // OK
+        //
+        // +QISTATE: 0,"TCP","","","INITIAL"
+        // +QISTATE: 1,"TCP","54.225.64.197","80","CONNECTED"
+        // ...
+        // +QISTATE: 5,"TCP","","","INITIAL"
+        //
+        // OK
+        if (!sendAndWaitFor("AT+QISTATE", "+QISTATE: 5", 1000))
+        {
+            return _socketState == SocketState::Open;
+        }
+        sprintf(_command, "+QISTATE: %i,", QT_CLIENT_SOCKET);
+        char* line = strstr(_buffer, _command);
+        char* end = line != nullptr ? strchr(line, '\n') : nullptr;
+        if (end != nullptr)
+        {
+            *end = 0;
+        }
+        open = line != nullptr && strstr(line, "\"CONNECTED\"") != nullptr;
+        // The rest of the last line, then OK, is not left for the next
+        // command to trip over
+        for (uint8_t i = 0; i < 3; i++)
+        {
+            if (!readReply(1000, 1) ||
+                strstr(_buffer, _OK))
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        // AT+QISTATE=1,1
+        // +QISTATE: 1,"TCP","54.225.64.197",80,4097,2,1,1,0,"uart1"
+        //
+        // OK
+        //
+        // Only OK when the socket is closed. The UG96 answers +QSSLSTATE
+        // queries with +QISTATE lines, so any STATE line is accepted.
+        sprintf(_buffer, "AT+Q%sSTATE=1,%i", _socketEncryption != TlsEncryption::None ? _SSL_PREFIX : _INET_PREFIX, QT_CLIENT_SOCKET);
+        if (!sendAndWaitFor(_buffer, _OK, 1000))
+        {
+            return _socketState == SocketState::Open;
+        }
+        char* field = strstr(_buffer, "STATE: ");
+        // <socket_state> is the sixth field, 2 = connected
+        for (uint8_t i = 0; i < 5 && field != nullptr; i++)
+        {
+            field = strchr(field + 1, ',');
+        }
+        open = field != nullptr && atoi(field + 1) == 2;
+    }
+    QT_COM_TRACE("Socket connected: %s", open ? "true" : "false");
+    if (open)
+    {
+        _socketState = SocketState::Open;
+    }
+    else if (_socketState == SocketState::Open)
+    {
+        _socketState = SocketState::Closing;
+    }
+    return open;
+}
+
+void QuectelCellular::setConnectionCheckInterval(uint32_t milliseconds)
+{
+    QT_LOCK();
+    _connectionCheckInterval = milliseconds;
+}
+
+bool QuectelCellular::setTlsConfig(const QuectelTlsConfig& config)
+{
+    QT_LOCK();
+    int8_t slot = -1;
+    for (uint8_t i = 0; i < QT_TLS_HOSTS; i++)
+    {
+        const QuectelTlsConfig* entry = _tlsConfigs[i];
+        if (entry != nullptr &&
+            (entry->host == config.host ||
+             (entry->host != nullptr && config.host != nullptr && strcasecmp(entry->host, config.host) == 0)))
+        {
+            slot = i;
+            break;
+        }
+        if (entry == nullptr && slot < 0)
+        {
+            slot = i;
+        }
+    }
+    if (slot < 0)
+    {
+        QT_ERROR("No room for TLS settings");
+        return false;
+    }
+    // Contexts set up with the replaced settings are set up again
+    for (uint8_t i = 0; i < QT_SSL_CONTEXTS; i++)
+    {
+        if (_sslContexts[i].config == _tlsConfigs[slot] && _tlsConfigs[slot] != nullptr)
+        {
+            _sslContexts[i].configured = false;
+        }
+    }
+    _tlsConfigs[slot] = &config;
+    return true;
+}
+
+// FNV-1a, for telling stored certificates apart
+static uint32_t hashData(const uint8_t* data, uint32_t length)
+{
+    uint32_t hash = 2166136261UL;
+    for (uint32_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619UL;
+    }
+    return hash;
+}
+
+bool QuectelCellular::uploadCertificate(const char* fileName, const uint8_t* data, uint32_t length)
+{
+    QT_LOCK();
+    // The hash of the stored certificate is kept in "<name>.sum", so one
+    // renewed with the same length is told apart without reading it back
+    char hashName[QT_FILE_NAME_LENGTH];
+    if (snprintf(hashName, sizeof(hashName), "%s.sum", fileName) >= (int)sizeof(hashName))
+    {
+        QT_ERROR("Certificate name too long: %s", fileName);
+        return false;
+    }
+    uint32_t hash = hashData(data, length);
+    uint8_t stored[4];
+    uint32_t size = getFileSize(fileName);
+    if (size == length && getFileSize(hashName) == sizeof(stored) &&
+        downloadFile(hashName, stored, sizeof(stored)) &&
+        (stored[0] | stored[1] << 8 | (uint32_t)stored[2] << 16 | (uint32_t)stored[3] << 24) == hash)
+    {
+        QT_DEBUG("Certificate %s already stored", fileName);
+        return true;
+    }
+    // The hash goes first and comes back last, a reset in between leaves
+    // the certificate to be uploaded again
+    if (getFileSize(hashName) != QT_FILE_SIZE_UNKNOWN && !deleteFile(hashName))
+    {
+        return false;
+    }
+    if (size != QT_FILE_SIZE_UNKNOWN && !deleteFile(fileName))
+    {
+        return false;
+    }
+    if (!uploadFile(fileName, data, length))
+    {
+        return false;
+    }
+    stored[0] = hash;
+    stored[1] = hash >> 8;
+    stored[2] = hash >> 16;
+    stored[3] = hash >> 24;
+    return uploadFile(hashName, stored, sizeof(stored));
+}
+
+void QuectelCellular::clearSslContexts()
+{
+    QT_LOCK();
+    memset(_sslContexts, 0, sizeof(_sslContexts));
+    _socketSslContext = -1;
+    _mqttSslContext = -1;
+    // MQTT reconnects set up their context again
+    _mqttConfigured = false;
+}
+
+const QuectelTlsConfig* QuectelCellular::findTlsConfig(const char* host)
+{
+    const QuectelTlsConfig* defaults = nullptr;
+    for (uint8_t i = 0; i < QT_TLS_HOSTS; i++)
+    {
+        const QuectelTlsConfig* entry = _tlsConfigs[i];
+        if (entry == nullptr)
+        {
+            continue;
+        }
+        if (entry->host == nullptr)
+        {
+            defaults = entry;
+        }
+        else if (host != nullptr && strcasecmp(entry->host, host) == 0)
+        {
+            return entry;
+        }
+    }
+    return defaults;
+}
+
+int8_t QuectelCellular::activateSsl(const char* host)
+{
+    // Returns the SSL context for host, set up unless an earlier
+    // connection already did, or -1
+	if(!useEncryption()) {
+		_encryption = TlsEncryption::Tls12; //Set to Tls12 if no other encryption is specified
+	}
+    const QuectelTlsConfig* config = findTlsConfig(host);
+    TlsEncryption version = config != nullptr ? config->version : _encryption;
+
+    // The context already set up with the same settings, or else an unused
+    // or the least recently used one. Those bound to the TLS socket and to
+    // MQTT, which reconnects with it, are never set up again.
+    int8_t context = -1;
+    for (uint8_t i = 0; i < QT_SSL_CONTEXTS; i++)
+    {
+        SslContextEntry& entry = _sslContexts[i];
+        if (entry.configured && entry.config == config && entry.version == version)
+        {
+            QT_DEBUG("Reusing SSL context %i", i);
+            entry.lastUsed = millis();
+            return i;
+        }
+        if (i == _socketSslContext || i == _mqttSslContext)
+        {
+            continue;
+        }
+        if (context < 0)
+        {
+            context = i;
+            continue;
+        }
+        SslContextEntry& oldest = _sslContexts[context];
+        if (oldest.configured &&
+            (!entry.configured || (int32_t)(entry.lastUsed - oldest.lastUsed) < 0))
+        {
+            context = i;
+        }
+    }
+    if (context < 0)
+    {
+        QT_ERROR("No free SSL context");
+        return -1;
+    }
+    SslContextEntry& entry = _sslContexts[context];
+    entry.configured = false;
+    if (!configureSslContext(context, config, version))
+    {
+        return -1;
+    }
+    entry.config = config;
+    entry.version = version;
+    entry.lastUsed = millis();
+    entry.configured = true;
+    return context;
+}
+
+bool QuectelCellular::configureSslContext(uint8_t context, const QuectelTlsConfig* config, TlsEncryption version)
+{
+    // AT+QSSLCFG="sslversion",1,3
+    // OK
+    //
+    // 0 SSL 3.0, 1 TLS 1.0, 2 TLS 1.1, 3 TLS 1.2, 4 all of them
+    uint8_t sslVersion;
+    switch (version)
+    {
+        case TlsEncryption::Ssl30:
+            sslVersion = 0;
+            break;
+        case TlsEncryption::Tls10:
+            sslVersion = 1;
+            break;
+        case TlsEncryption::Tls11:
+            sslVersion = 2;
+            break;
+        case TlsEncryption::All:
+            sslVersion = 4;
+            break;
+        default:
+            sslVersion = 3;
+            break;
+    }
+    QT_DEBUG("Setting up SSL context %i", context);
+    sprintf(_buffer, "AT+QSSLCFG=\"sslversion\",%i,%i", context, sslVersion);
+    if (!sendAndCheckReply(_buffer, _OK, 10000))    // Set TLS
+    {
+        QT_ERROR("Failed to set TLS version");
+        return false;
+    }
+    // Without settings all cipher suites are allowed and the server is not
+    // verified
+    sprintf(_buffer, "AT+QSSLCFG=\"ciphersuite\",%i,\"%s\"", context,
+        config != nullptr && config->cipherSuite != nullptr ? config->cipherSuite : "0xFFFF");
+    if (!sendAndCheckReply(_buffer, _OK, 10000))
+    {
+        QT_ERROR("Failed to set cipher suites");
+        return false;
+    }
+    sprintf(_buffer, "AT+QSSLCFG=\"seclevel\",%i,%i", context,
+        config != nullptr ? (uint8_t)config->verify : 0);
+    if (!sendAndCheckReply(_buffer, _OK, 10000))
+    {
+        QT_ERROR("Failed to set security level");
+        return false;
+    }
+    if (config == nullptr)
+    {
+        return true;
+    }
+
+    // AT+QSSLCFG="cacert",1,"UFS:cacert.pem"
+    const char* certificates[] = { "cacert", "clientcert", "clientkey" };
+    const char* files[] = { config->caCert, config->clientCert, config->clientKey };
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        if (files[i] == nullptr)
+        {
+            continue;
+        }
+        sprintf(_buffer, "AT+QSSLCFG=\"%s\",%i,\"%s%s\"", certificates[i], context, getVolumePrefix(files[i]), files[i]);
+        if (!sendAndCheckReply(_buffer, _OK, 10000))
+        {
+            QT_ERROR("Failed to set %s", certificates[i]);
+            return false;
+        }
+    }
+
+    // Firmware without these answers ERROR, the connection works without
+    if (config->sni)
+    {
+        sprintf(_buffer, "AT+QSSLCFG=\"sni\",%i,1", context);
+        if (!sendAndCheckReply(_buffer, _OK, 10000))
+        {
+            QT_DEBUG("SNI not supported");
+        }
+    }
+    if (config->sessionReuse)
+    {
+        sprintf(_buffer, "AT+QSSLCFG=\"session_cache\",%i,1", context);
+        if (!sendAndCheckReply(_buffer, _OK, 10000))
+        {
+            QT_DEBUG("TLS session resumption not supported");
+        }
+    }
+    return true;
+}
+
+bool QuectelCellular::useEncryption()
+{
+    return _encryption != TlsEncryption::None;
+}
+
+///////////////////////////////////////////////////////////
+//
+// File client interface
+//
+FILE_HANDLE QuectelCellular::openFile(const char* fileName, bool overWrite)
+{
+    QT_LOCK();
+    // AT+QFOPEN="RAM:file.ext",0
+    // +QFOPEN:3000
+    //
+    // OK
+    sprintf(_buffer,"AT+QFOPEN=\"%s%s\",%i", getVolumePrefix(fileName), fileName, overWrite ? 1 : 0);
+    if (!sendAndWaitForReply(_buffer, 1000, 3))
+    {
+        QT_ERROR("Timeout opening file");
+        return NOT_A_FILE_HANDLE;
+    }
+    char* token = strstr(_buffer, "+QFOPEN:");
+    if (!token)
+    {
+        QT_ERROR("Failed to open file: %s", _buffer);
+        return NOT_A_FILE_HANDLE;
+    }
+    FILE_HANDLE result = strtoul(token + 8, nullptr, 10);
+
+    // The module creates missing files
+    char name[QT_FILE_NAME_LENGTH];
+    OpenFileEntry* file = findOpenFile(NOT_A_FILE_HANDLE);
+    if (!getFullFileName(name, fileName) || file == nullptr)
+    {
+        // Writes through untracked handles could not update the cache
+        QT_DEBUG("File %s not cached", fileName);
+        clearFileCache();
+        return result;
+    }
+    uint32_t size = QT_FILE_SIZE_UNKNOWN;
+    FileCacheEntry* entry = findFileEntry(name);
+    if (overWrite || (entry != nullptr && !entry->exists))
+    {
+        size = 0;
+    }
+    else if (entry != nullptr)
+    {
+        size = entry->size;
+    }
+    setFileEntry(name, true, size);
+    file->handle = result;
+    strcpy(file->name, name);
+    file->position = 0;
+    return result;
+}
+
+bool QuectelCellular::readFile(FILE_HANDLE fileHandle, uint8_t* buffer, uint32_t length)
+{
+    QT_LOCK();
+    // AT+QFREAD=3000,10
+    // CONNECT
+    // Read data
+    //
+    // OK
+
+    // Read in chunks the module delivers in one +QFREAD
+    while (length > _profile->maxFileReadSize)
+    {
+        if (!readFile(fileHandle, buffer, _profile->maxFileReadSize))
+        {
+            return false;
+        }
+        buffer += _profile->maxFileReadSize;
+        length -= _profile->maxFileReadSize;
+    }
+    // The recovery below seeks relative to the current position, which is
+    // not tracked through reads
+    OpenFileEntry* file = findOpenFile(fileHandle);
+    if (file != nullptr)
+    {
+        file->position = QT_FILE_SIZE_UNKNOWN;
+    }
+    sprintf(_buffer, "AT+QFREAD=%li,%lu", fileHandle, length);
+    if (!sendAndCheckReply(_buffer, _CONNECT, 1000))
+    {
+        QT_ERROR("Timeout for read command");
+        return false;
+    }
+    const char *err_reply = "\r\n+CME ERROR: 4nn\r\n"; // 4[0,1][0-9]
+    const char *ok_reply = "\r\nOK\r\n";
+    int err;
+    uint32_t t = uartReadBytes(buffer, length, 50);
+
+    if (t < length)
+    {
+	if (t >= 6 && memcmp(buffer+t-6, ok_reply, 6) == 0)
+	{
+	    // This can happen if length >= 1506 and we only get 1500B
+	    QT_DEBUG("Only got %dB. Recursing", t-6);
+	    _stats.retries++;
+	    seekFileCur(fileHandle, -(length - (t-6)));
+	    return readFile(fileHandle, buffer+t-6, length - (t-6));
+	}
+	if (t >= 19 && memcmp(buffer+t-19, err_reply, 15) == 0)
+	{
+	    // This should be what mostly happen if there is an error, with t = 19
+	    if (sscanf((const char*)buffer+t-19, "\r\n+CME ERROR: %d\r\n", &err) == 1)
+		QT_ERROR("CME ERROR: %d", err);
+	    QT_ERROR("Read failed after %d bytes", t-19);
+	    return false;
+	}
+	// This should never happen
+	QT_ERROR("Unknown error. %dB read",	t);
+
+	QT_COM_TRACE_START("Ending bytes: [");
+	if (t <= 19)
+	    QT_COM_TRACE_BUFFER(buffer, t);
+	else
+	    QT_COM_TRACE_BUFFER(buffer+t-19, 19);
+	QT_COM_TRACE_END("]");
+	return false;
+    }
+
+    // If we use readReply() we cannot always know if the last two
+    // bytes in 'buffer' is data belonging to the file or if they are
+    // part of the reply, as readReply does not give the leading \r\n
+    // from the reply in '_buffer'. So we read the full reply into
+    // '_buffer', beginning with six characters.
+    int r = uartReadBytes(_buffer, 6, 1000);
+
+    // 1. Handle the usual case, were everything works as it should
+    // and we get a reply of 6 bytes containing the ok_reply string.
+    if (r == 6 && memcmp(_buffer, ok_reply, 6) == 0)
+    {
+	QT_DEBUG("Read OK");
+	return true;
+    }
+
+    // 2. Handle the case when we didn't get the whole string of bytes
+    // and a part, or all, of the ok_reply string is in buffer.
+    if (r < 6
+      && memcmp(buffer+length-(6-r), ok_reply, 6-r) == 0
+      && memcmp(_buffer, ok_reply+(6-r), r) == 0)
+    {
+	// This happen when 1500 < length < 1506 and we only get 1500B
+	QT_DEBUG("Only got %dB. Recursing", length-(6-r));
+	_stats.retries++;
+	seekFileCur(fileHandle, -(6-r));
+	return readFile(fileHandle, buffer+length-(6-r), 6-r);
+    }
+
+    // All other cases are some kind of failures.
+    if (r == 6) // There could be more bytes to read
+    {
+	r += uartReadBytes(_buffer+r, sizeof(_buffer) - r, 1000);
+    }
+
+    if (r <= 19) // A CME ERROR is 19 bytes long
+    {
+	// When we get almost all the bytes and then an error
+	memmove(_buffer + (19-r), _buffer, r);
+	memcpy(_buffer, buffer+length-(19-r), 19-r);
+	_buffer[r] = '\0';
+	if (sscanf(_buffer, "\r\n+CME ERROR: %d\r\n", &err) == 1)
+	{
+	    QT_ERROR("Read failed after %d bytes.", length-(19-r));
+	    QT_ERROR("CME ERROR: %d", err);
+	}
+	else
+	{
+	    QT_ERROR("Unknown error. Total %dB read", t+r);
+	    QT_COM_TRACE_START("Ending bytes: [");
+	    QT_COM_TRACE_BUFFER(_buffer, 19);
+	    QT_COM_TRACE_END("]");
+	}
+	return false;
+    }
+
+    // This should never happen
+    QT_ERROR("Unknown error. Total %dB read", t+r);
+    QT_COM_TRACE_START("Ending bytes: [");
+    QT_COM_TRACE_BUFFER(_buffer + r - 19, 19);
+    QT_COM_TRACE_END("]");
+    return false;
+}
+
+bool QuectelCellular::writeFile(FILE_HANDLE fileHandle, const uint8_t* buffer, uint32_t length)
+{
+    QT_LOCK();
+    // AT+QFWRITE=3000,10
+    // CONNECT
+    // write 10 bytes
+    // +QFWRITE: 10,10
+    //
+    // OK
+    sprintf(_buffer, "AT+QFWRITE=%li,%lu", fileHandle, length);
+    if (sendAndCheckReply(_buffer, _CONNECT, 1000))
+    {
+        uartWrite(buffer, length);
+        if (!readReply(1000, 3))
+        {
+            QT_ERROR("No reply after write");
+            return false;
+        }
+        char* token = strstr(_buffer, "+QFWRITE:");
+        if (token == nullptr)
+        {
+            return false;
+        }
+        // <written_length>,<total_length>
+        unsigned long written;
+        unsigned long total;
+        OpenFileEntry* file = findOpenFile(fileHandle);
+        if (file == nullptr ||
+            sscanf(token + 9, "%lu,%lu", &written, &total) != 2)
+        {
+            clearFileCache();
+            return true;
+        }
+        setFileEntry(file->name, true, total);
+        if (file->position != QT_FILE_SIZE_UNKNOWN)
+        {
+            file->position += written;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool QuectelCellular::seekFile(FILE_HANDLE fileHandle, uint32_t length)
+{
+    QT_LOCK();
+    // AT+QFSEEK=3000,0,0
+    // OK
+    OpenFileEntry* file = findOpenFile(fileHandle);
+    sprintf(_buffer,"AT+QFSEEK=%li,%lu,0", fileHandle, length);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        QT_ERROR("Seek error: %s", _buffer);
+        if (file != nullptr)
+        {
+            file->position = QT_FILE_SIZE_UNKNOWN;
+        }
+        return false;
+    }
+    if (file != nullptr)
+    {
+        file->position = length;
+    }
+    return checkResult();
+}
+
+bool QuectelCellular::seekFileCur(FILE_HANDLE fileHandle, int32_t length)
+{
+    QT_LOCK();
+    // AT+QFSEEK=3000,0,0
+    // OK
+    OpenFileEntry* file = findOpenFile(fileHandle);
+    sprintf(_buffer,"AT+QFSEEK=%li,%li,1", fileHandle, length);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        QT_ERROR("Seek error: %s", _buffer);
+        if (file != nullptr)
+        {
+            file->position = QT_FILE_SIZE_UNKNOWN;
+        }
+        return false;
+    }
+    if (file != nullptr && file->position != QT_FILE_SIZE_UNKNOWN)
+    {
+        file->position += length;
+    }
+    return checkResult();
+}
+
+uint32_t QuectelCellular::getFilePosition(FILE_HANDLE fileHandle)
+{
+    QT_LOCK();
+    // AT+QFPOSITION=3000
+    // +QFPOSITION: 123
+    //
+    // OK
+    sprintf(_buffer, "AT+QFPOSITION=%li", fileHandle);
+    if (!sendAndWaitForReply(_buffer, 1000, 3))
+    {
+        QT_ERROR("File position error: %s", _buffer);
+        return -1;
+    }
+    char* token = strtok(_buffer, "+QFPOSITION: ");
+    if (!token)
+    {
+        QT_ERROR("Get position error: %s", _buffer);
+        return -1;
+    }
+    uint32_t result = atoi(token);
+    return result;
+}
+
+bool QuectelCellular::truncateFile(FILE_HANDLE fileHandle)
+{
+    QT_LOCK();
+    // AT+QFTUCAT=3000
+    // OK
+    sprintf(_buffer, "AT+QFTUCAT=%li", fileHandle);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        QT_ERROR("Timeout deleting file: %s", _buffer);
+        return false;
+    }
+    // The file now ends at the current position
+    OpenFileEntry* file = findOpenFile(fileHandle);
+    if (file == nullptr)
+    {
+        clearFileCache();
+    }
+    else
+    {
+        setFileEntry(file->name, true, file->position);
+    }
+    return checkResult();
+}
+
+bool QuectelCellular::closeFile(FILE_HANDLE fileHandle)
+{
+    QT_LOCK();
+    // AT+QFCLOSE=3000
+    // OK
+    OpenFileEntry* file = findOpenFile(fileHandle);
+    if (file != nullptr)
+    {
+        file->handle = NOT_A_FILE_HANDLE;
+    }
+    sprintf(_buffer, "AT+QFCLOSE=%li", fileHandle);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        QT_ERROR("Timeout closing file: %s", _buffer);
+        return false;
+    }
+    return checkResult();
+}
+
+bool QuectelCellular::uploadFile(const char* fileName, const uint8_t* buffer, uint32_t length)
+{
+    QT_LOCK();
+    // AT+QFUPL="RAM:test1.txt",10
+    // CONNECT
+    // <data>
+    // +QFUPL:300,B34A
+    char name[QT_FILE_NAME_LENGTH];
+    bool cached = getFullFileName(name, fileName);
+    sprintf(_buffer, "AT+QFUPL=\"%s%s\",%lu", getVolumePrefix(fileName), fileName, (unsigned long)length);
+    if (!sendAndCheckReply(_buffer, _CONNECT, 1000))
+    {
+        QT_ERROR("No response to upload command: %s", _buffer);
+        return false;
+    }
+    uartWrite(buffer, length);
+    // +QFUPL: <upload_size>,<checksum>, or +CME ERROR
+    if (!readReply(1000, 1))
+    {
+        QT_ERROR("No reponse after upload");
+    }
+    if (strstr(_buffer, "+QFUPL:") == nullptr)
+    {
+        QT_ERROR("Upload failed: %s", _buffer);
+        if (cached)
+        {
+            setFileEntry(name, true, QT_FILE_SIZE_UNKNOWN);
+        }
+        return false;
+    }
+    if (cached)
+    {
+        setFileEntry(name, true, length);
+    }
+    // The trailing OK, so it is not taken as the reply to the next command
+    readReply(1000, 1);
+    return true;
+}
+
+bool QuectelCellular::downloadFile(const char* fileName, uint8_t* buffer, uint32_t length)
+{
+    QT_LOCK();
+    // AT+QFDWL="RAM:test.txt"
+    // CONNECT
+    // <read data>
+    // +QFDWL: 10,613e
+    //
     // OK
-    sprintf(_buffer, "AT+QFREAD=%li,%lu", fileHandle, length);
+    //
+    // The whole file is sent, so its size must be known to find the end
+    // of the data
+    uint32_t size = getFileSize(fileName);
+    if (size == QT_FILE_SIZE_UNKNOWN || size > length)
+    {
+        QT_ERROR("Cannot download %s, %lu bytes", fileName, (unsigned long)size);
+        return false;
+    }
+    sprintf(_buffer, "AT+QFDWL=\"%s%s\"", getVolumePrefix(fileName), fileName);
     if (!sendAndCheckReply(_buffer, _CONNECT, 1000))
     {
-        QT_ERROR("Timeout for read command");
+        QT_ERROR("No response to download command: %s", _buffer);
+        return false;
+    }
+    if (uartReadBytes(buffer, size, 1000) < size)
+    {
+        QT_ERROR("Download of %s incomplete", fileName);
+        return false;
+    }
+    if (!readReply(1000, 1))
+    {
+        QT_ERROR("No reponse after download");
+    }
+    if (strstr(_buffer, "+QFDWL:") == nullptr)
+    {
+        return false;
+    }
+    // The trailing OK
+    readReply(1000, 1);
+    return true;
+}
+
+uint32_t QuectelCellular::getFileSize(const char* fileName)
+{
+    QT_LOCK();
+    uint32_t size;
+    getFileSize(fileName, size);
+    return size;
+}
+
+bool QuectelCellular::getFileSize(const char* fileName, uint32_t& size)
+{
+    QT_LOCK();
+    // AT+QFLST="RAM:file.txt"
+    // +QFLST: "RAM:file.txt",734
+    //
+    // OK
+    char name[QT_FILE_NAME_LENGTH];
+    bool cached = getFullFileName(name, fileName);
+    FileCacheEntry* entry = cached ? findFileEntry(name) : nullptr;
+    size = QT_FILE_SIZE_UNKNOWN;
+    if (entry != nullptr && (!entry->exists || entry->size != QT_FILE_SIZE_UNKNOWN))
+    {
+        if (entry->exists)
+        {
+            size = entry->size;
+        }
+        return true;
+    }
+    sprintf(_buffer, "AT+QFLST=\"%s%s\"", getVolumePrefix(fileName), fileName);
+    bool replied = sendAndWaitFor(_buffer, _OK, 1000);
+    char* token = strstr(_buffer, "+QFLST:");
+    if (token != nullptr)
+    {
+        token = strstr(token, "\",");
+    }
+    if (token == nullptr)
+    {
+        // +CME ERROR: 405 or just OK when there is no such file
+        if (replied || strstr(_buffer, "ERROR: 405") != nullptr)
+        {
+            QT_DEBUG("No file %s", fileName);
+            if (cached)
+            {
+                setFileEntry(name, false, 0);
+            }
+            return true;
+        }
+        QT_ERROR("Get file size error: %s", _buffer);
+        return false;
+    }
+    size = strtoul(token + 2, nullptr, 10);
+    if (cached)
+    {
+        setFileEntry(name, true, size);
+    }
+    return true;
+}
+
+bool QuectelCellular::fileExists(const char* fileName)
+{
+    QT_LOCK();
+    char name[QT_FILE_NAME_LENGTH];
+    FileCacheEntry* entry = getFullFileName(name, fileName) ? findFileEntry(name) : nullptr;
+    if (entry != nullptr)
+    {
+        return entry->exists;
+    }
+    return getFileSize(fileName) != QT_FILE_SIZE_UNKNOWN;
+}
+
+bool QuectelCellular::deleteFile(const char* fileName)
+{
+    QT_LOCK();
+    // AT+QFDEL="RAM:file.txt"
+    // OK
+    sprintf(_buffer, "AT+QFDEL=\"%s%s\"", getVolumePrefix(fileName), fileName);
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        QT_ERROR("Timeout deleting file: %s", _buffer);
+        return false;
+    }
+    char name[QT_FILE_NAME_LENGTH];
+    if (strchr(fileName, '*') != nullptr)
+    {
+        clearFileCache();
+    }
+    else if (getFullFileName(name, fileName))
+    {
+        setFileEntry(name, false, 0);
+    }
+    return checkResult();
+}
+
+bool QuectelCellular::setVolume(StorageVolume volume)
+{
+    QT_LOCK();
+    if (volume == StorageVolume::Sd && !hasFeature(QT_FEATURE_SD_CARD))
+    {
+        QT_ERROR("SD card not supported by %s", _profile->name);
+        return false;
+    }
+    _volume = volume;
+    return true;
+}
+
+StorageVolume QuectelCellular::getVolume()
+{
+    QT_LOCK();
+    return _volume;
+}
+
+int16_t QuectelCellular::listFiles(QuectelFileInfo* files, uint16_t maxFiles, const char* pattern)
+{
+    QT_LOCK();
+    // AT+QFLST="RAM:*"
+    // +QFLST: "RAM:a.txt",734
+    // +QFLST: "RAM:b.bin",4096
+    //
+    // OK
+    const char* prefix = getVolumePrefix(pattern);
+    sprintf(_buffer, "AT+QFLST=\"%s%s\"", prefix, pattern);
+    if (!sendAndWaitForReply(_buffer, 1000, 1))
+    {
+        QT_ERROR("No response to list command");
+        return -1;
+    }
+    int16_t count = 0;
+    char* token;
+    while ((token = strstr(_buffer, "+QFLST: \"")) != nullptr)
+    {
+        char* name = token + 9;
+        char* end = strchr(name, '"');
+        if (end == nullptr)
+        {
+            break;
+        }
+        *end = 0;
+        uint32_t size = strtoul(end + 2, nullptr, 10);
+        // The UG96 leaves out the volume for UFS: files
+        char* colon = strchr(name, ':');
+        if (colon != nullptr)
+        {
+            name = colon + 1;
+        }
+        if (count < maxFiles)
+        {
+            strncpy(files[count].name, name, QT_FILE_NAME_LENGTH - 1);
+            files[count].name[QT_FILE_NAME_LENGTH - 1] = 0;
+            files[count].size = size;
+        }
+        count++;
+
+        char fullName[QT_FILE_NAME_LENGTH];
+        if (strlen(prefix) + strlen(name) < QT_FILE_NAME_LENGTH)
+        {
+            sprintf(fullName, "%s%s", prefix, name);
+            setFileEntry(fullName, true, size);
+        }
+        if (!readReply(1000, 1))
+        {
+            break;
+        }
+    }
+    return count;
+}
+
+bool QuectelCellular::getStorageSpace(StorageVolume volume, uint32_t& freeBytes, uint32_t& totalBytes)
+{
+    QT_LOCK();
+    // AT+QFLDS="UFS"
+    // +QFLDS: 1048576,2097152
+    //
+    // OK
+    sprintf(_buffer, "AT+QFLDS=\"%s\"", volumeNames[(uint8_t)volume]);
+    if (!sendAndWaitFor(_buffer, _OK, 1000))
+    {
+        QT_ERROR("Storage space error: %s", _buffer);
+        return false;
+    }
+    unsigned long available;
+    unsigned long total;
+    char* token = strstr(_buffer, "+QFLDS:");
+    if (token == nullptr ||
+        sscanf(token + 7, "%lu,%lu", &available, &total) != 2)
+    {
+        QT_ERROR("Storage space error: %s", _buffer);
+        return false;
+    }
+    freeBytes = available;
+    totalBytes = total;
+    return true;
+}
+
+void QuectelCellular::clearFileCache()
+{
+    QT_LOCK();
+    for (uint8_t i = 0; i < QT_FILE_CACHE_SIZE; i++)
+    {
+        _fileCache[i].name[0] = 0;
+    }
+}
+
+const char* QuectelCellular::getVolumePrefix(const char* fileName)
+{
+    static const char* const prefixes[] = { "RAM:", "UFS:", "SD:" };
+    // Names that carry their own volume are used as they are
+    if (strchr(fileName, ':') != nullptr)
+    {
+        return "";
+    }
+    return prefixes[(uint8_t)_volume];
+}
+
+bool QuectelCellular::getFullFileName(char* name, const char* fileName)
+{
+    const char* prefix = getVolumePrefix(fileName);
+    if (strlen(prefix) + strlen(fileName) >= QT_FILE_NAME_LENGTH)
+    {
+        return false;
+    }
+    sprintf(name, "%s%s", prefix, fileName);
+    return true;
+}
+
+FileCacheEntry* QuectelCellular::findFileEntry(const char* name)
+{
+    for (uint8_t i = 0; i < QT_FILE_CACHE_SIZE; i++)
+    {
+        if (_fileCache[i].name[0] != 0 &&
+            strcmp(_fileCache[i].name, name) == 0)
+        {
+            return &_fileCache[i];
+        }
+    }
+    return nullptr;
+}
+
+void QuectelCellular::setFileEntry(const char* name, bool exists, uint32_t size)
+{
+    FileCacheEntry* entry = findFileEntry(name);
+    if (entry == nullptr)
+    {
+        // Replaced round robin
+        entry = &_fileCache[_fileCacheNext];
+        _fileCacheNext = (_fileCacheNext + 1) % QT_FILE_CACHE_SIZE;
+        strcpy(entry->name, name);
+    }
+    entry->exists = exists;
+    entry->size = size;
+}
+
+OpenFileEntry* QuectelCellular::findOpenFile(FILE_HANDLE fileHandle)
+{
+    for (uint8_t i = 0; i < QT_OPEN_FILES; i++)
+    {
+        if (_openFiles[i].handle == fileHandle)
+        {
+            return &_openFiles[i];
+        }
+    }
+    return nullptr;
+}
+
+// Private
+
+bool QuectelCellular::setPower(bool state)
+{
+    QT_LOCK();
+    uint32_t timeout;
+	QT_DEBUG("setPower: %i", state);
+    if (state == true)
+    {
+        if (_powerPin != NOT_A_PIN)
+        {
+            digitalWrite(_powerPin, LOW);
+            delay(300);
+            digitalWrite(_powerPin, HIGH);
+        }
+
+        QT_TRACE_START("Waiting for module");
+        while (!getStatus())
+        {
+            QT_TRACE_PART(".");
+            callWatchdog();
+            delay(500);
+        }
+        QT_TRACE_END("");
+
+        QT_DEBUG("Open communications");
+        int32_t timeout = 7000;
+        while (timeout > 0)
+        {
+            flush();
+            if (sendAndCheckReply(_AT, "AT", 1000))
+            {
+                QT_COM_TRACE("GOT AT");
+                break;
+            }
+            callWatchdog();
+            delay(500);
+            timeout -= 500;
+        }
+
+        if (timeout <= 0)
+        {
+            QT_ERROR("Failed to initialize cellular module");
+            return false;
+        }
+        _powerState = PowerState::Active;
+    }
+    else
+    {
+        _powerState = PowerState::Off;
+        // Nothing to reactivate once the module is off
+        memset(_contextStates, 0, sizeof(_contextStates));
+        if (!getStatus())
+        {
+            QT_COM_TRACE("Module already off");
+            return true;
+        }
+        QT_DEBUG("Powering down module");
+        // First check if already awake
+        timeout = 5000;
+        while (timeout > 0)
+        {
+            flush();
+            if (sendAndCheckReply(_AT, "OK", 1000))
+            {
+                QT_COM_TRACE("GOT AT");
+                break;
+            }
+            if (sendAndCheckReply(_AT, "OK", 1000))
+            {
+                QT_COM_TRACE("GOT OK");
+                break;
+            }
+            callWatchdog();
+            delay(500);
+            timeout -= 500;
+        }
+        sendAndCheckReply("ATE0", _OK, 1000);
+
+		if (hasFeature(QT_FEATURE_URC_PORT) &&
+		    !sendAndCheckReply("AT+QCFG=\"urc/port\",1,\"uart1\"", _OK))
+		{
+			// Not fatal, the module may not have been identified yet
+			QT_DEBUG("Could not start urc messages");
+		}
+
+        if (!sendAndCheckReply("AT+QPOWD=1", _OK, 10000))
+        {
+            return false;
+        }
+        timeout = millis() + 60000;  // max 60 seconds for a shutdown
+        while (timeout > millis())
+        {
+            // +QIURC: "pdpdeact" is handled by readReply()
+            if (readReply(1000, 1))
+            {
+                if (strstr(_buffer, "POWERED DOWN"))
+                {
+                    QT_DEBUG("Module powered down");
+                    break;
+                }
+            }
+            callWatchdog();
+        }
+        return false;
+    }
+    return true;
+}
+
+bool QuectelCellular::tryWarmStart()
+{
+    // After an MCU only reset the module is usually still powered, registered
+    // and has its PDP context active. Only reuse it if all three hold.
+    if (!getStatus())
+    {
+        return false;
+    }
+    QT_DEBUG("Checking for running module");
+    // The MCU may have been reset while the module was multiplexing
+    QuectelCmux::close(_transport);
+    if (!waitForUart(900))
+    {
         return false;
     }
-    const char *err_reply = "\r\n+CME ERROR: 4nn\r\n"; // 4[0,1][0-9]
-    const char *ok_reply = "\r\nOK\r\n";
-    int err;
-    _uart->setTimeout(50);
-    uint32_t t = _uart->readBytes(buffer, length);
 
-    if (t < length)
+    // Disable echo
+    sendAndCheckReply("ATE0", _OK, 1000);
+    // Numeric error codes, as parsed by checkResult() and the statistics
+    sendAndCheckReply("AT+CMEE=1", _OK, 1000);
+
+    if (!readModuleInfo())
     {
-	if (t >= 6 && memcmp(buffer+t-6, ok_reply, 6) == 0)
-	{
-	    // This can happen if length >= 1506 and we only get 1500B
-	    QT_DEBUG("Only got %dB. Recursing", t-6);
-	    seekFileCur(fileHandle, -(length - (t-6)));
-	    return readFile(fileHandle, buffer+t-6, length - (t-6));
-	}
-	if (t >= 19 && memcmp(buffer+t-19, err_reply, 15) == 0)
-	{
-	    // This should be what mostly happen if there is an error, with t = 19
-	    if (sscanf((const char*)buffer+t-19, "\r\n+CME ERROR: %d\r\n", &err) == 1)
-		QT_ERROR("CME ERROR: %d", err);
-	    QT_ERROR("Read failed after %d bytes", t-19);
-	    return false;
-	}
-	// This should never happen
-	QT_ERROR("Unknown error. %dB read",	t);
+        return false;
+    }
+    enableUrcPort();
 
-	QT_COM_TRACE_START("Ending bytes: [");
-	if (t <= 19)
-	    QT_COM_TRACE_BUFFER(buffer, t);
-	else
-	    QT_COM_TRACE_BUFFER(buffer+t-19, 19);
-	QT_COM_TRACE_END("]");
-	return false;
+    enableRegistrationUrcs();
+    if (_networkState != NetworkRegistrationState::Registered &&
+        _networkState != NetworkRegistrationState::Roaming)
+    {
+        QT_DEBUG("Module not registered, cold start");
+        return false;
+    }
+    if (!getContextActive(1))
+    {
+        QT_DEBUG("PDP context not active, cold start");
+        return false;
     }
 
-    // If we use readReply() we cannot always know if the last two
-    // bytes in 'buffer' is data belonging to the file or if they are
-    // part of the reply, as readReply does not give the leading \r\n
-    // from the reply in '_buffer'. So we read the full reply into
-    // '_buffer', beginning with six characters.
-    _uart->setTimeout(1000);
-    int r = _uart->readBytes(_buffer, 6);
+    // The client socket may have been left open by the previous session
+    sprintf(_buffer, "AT+QICLOSE=%i", QT_CLIENT_SOCKET);
+    sendAndCheckReply(_buffer, _OK, 1000);
+    if (hasFeature(QT_FEATURE_SSL))
+    {
+        sprintf(_buffer, "AT+QSSLCLOSE=%i", QT_CLIENT_SOCKET);
+        sendAndCheckReply(_buffer, _OK, 1000);
+    }
+    return true;
+}
 
-    // 1. Handle the usual case, were everything works as it should
-    // and we get a reply of 6 bytes containing the ok_reply string.
-    if (r == 6 && memcmp(_buffer, ok_reply, 6) == 0)
+bool QuectelCellular::getContextActive(uint8_t contextId)
+{
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP))
     {
-	QT_DEBUG("Read OK");
-	return true;
+        // OK
+        //
+        // STATE: IP STATUS
+        if (!sendAndWaitForReply("AT+QISTAT", 1000, 3) ||
+            !strstr(_buffer, "STATE:"))
+        {
+            return false;
+        }
+        return strstr(_buffer, "IP INITIAL") == nullptr &&
+               strstr(_buffer, "IP START") == nullptr &&
+               strstr(_buffer, "IP CONFIG") == nullptr &&
+               strstr(_buffer, "IP IND") == nullptr &&
+               strstr(_buffer, "PDP DEACT") == nullptr;
+    }
+    // +QIACT: 1,1,1,"10.7.157.1"
+    //
+    // OK
+    if (!sendAndWaitFor("AT+QIACT?", _OK, 1000))
+    {
+        return false;
+    }
+    // The reply lists all active contexts
+    char prefix[16];
+    for (uint8_t i = 1; i <= QT_PDP_CONTEXTS; i++)
+    {
+        sprintf(prefix, "+QIACT: %i,1", i);
+        _contextStates[i - 1] = strstr(_buffer, prefix) ? ContextState::Active : ContextState::Inactive;
     }
+    sprintf(prefix, "+QIACT: %i,1", contextId);
+    return strstr(_buffer, prefix) != nullptr;
+}
 
-    // 2. Handle the case when we didn't get the whole string of bytes
-    // and a part, or all, of the ok_reply string is in buffer.
-    if (r < 6
-      && memcmp(buffer+length-(6-r), ok_reply, 6-r) == 0
-      && memcmp(_buffer, ok_reply+(6-r), r) == 0)
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Unsolicited result codes
+//
+void QuectelCellular::enableUrcPort()
+{
+    // URCs are handled on the UART. The module keeps the setting, so it is
+    // only written when it differs.
+    if (hasFeature(QT_FEATURE_URC_PORT))
     {
-	// This happen when 1500 < length < 1506 and we only get 1500B
-	QT_DEBUG("Only got %dB. Recursing", length-(6-r));
-	seekFileCur(fileHandle, -(6-r));
-	return readFile(fileHandle, buffer+length-(6-r), 6-r);
+        // +QCFG: "urc/port",1,"uart1"
+        setModuleConfig("urc/port", "1,\"uart1\"");
+    }
+    else if (hasFeature(QT_FEATURE_URC_CONFIG))
+    {
+        // +QURCCFG: "urcport","uart1"
+        if (!sendAndWaitForReply("AT+QURCCFG=\"urcport\"", 1000, 3) ||
+            !strstr(_buffer, "\"uart1\""))
+        {
+            sendAndCheckReply("AT+QURCCFG=\"urcport\",\"uart1\"", _OK, 1000);
+        }
     }
+}
 
-    // All other cases are some kind of failures.
-    if (r == 6) // There could be more bytes to read
+void QuectelCellular::enableRegistrationUrcs()
+{
+    // Registration is reported per domain: CREG circuit switched, CGREG
+    // packet switched on GSM/UMTS and CEREG on LTE, LTE-M and NB-IoT.
+    // A domain the module does not support stays Unknown.
+    for (uint8_t i = 0; i < QT_REGISTRATION_DOMAINS; i++)
     {
-	r += _uart->readBytes(_buffer+r, sizeof(_buffer) - r);
+        _registration[i] = NetworkRegistrationState::Unknown;
+        if (i == (uint8_t)RegistrationDomain::Eps &&
+            !hasFeature(QT_FEATURE_EPS))
+        {
+            continue;
+        }
+        sprintf(_command, "AT+%s=2", registrationCommands[i]);
+        if (!sendAndCheckReply(_command, _OK, 1000))
+        {
+            continue;
+        }
+        // The URC only reports changes, so read the current state
+        // +CREG: 2,1,"1A2B","01234567",7
+        //
+        // OK
+        sprintf(_command, "AT+%s?", registrationCommands[i]);
+        int state;
+        if (sendAndWaitForReply(_command, 1000, 3) &&
+            sscanf(_buffer, "%*[^:]: %*d,%d", &state) == 1)
+        {
+            _registration[i] = state <= (int)NetworkRegistrationState::Roaming ?
+                (NetworkRegistrationState)state : NetworkRegistrationState::Unknown;
+        }
     }
+    _registrationUrcs = true;
+    updateRegistration();
+}
 
-    if (r <= 19) // A CME ERROR is 19 bytes long
+void QuectelCellular::processUrcs()
+{
+    // Handles URCs received between commands, anything else is discarded.
+    // A line that has started is given QT_URC_LINE_TIMEOUT ms to complete.
+    uint32_t start = millis();
+    while (_transport->available() ||
+           (_urcLength > 0 && millis() - start < QT_URC_LINE_TIMEOUT))
     {
-	// When we get almost all the bytes and then an error
-	memmove(_buffer + (19-r), _buffer, r);
-	memcpy(_buffer, buffer+length-(19-r), 19-r);
-	_buffer[r] = '\0';
-	if (sscanf(_buffer, "\r\n+CME ERROR: %d\r\n", &err) == 1)
-	{
-	    QT_ERROR("Read failed after %d bytes.", length-(19-r));
-	    QT_ERROR("CME ERROR: %d", err);
-	}
-	else
-	{
-	    QT_ERROR("Unknown error. Total %dB read", t+r);
-	    QT_COM_TRACE_START("Ending bytes: [");
-	    QT_COM_TRACE_BUFFER(_buffer, 19);
-	    QT_COM_TRACE_END("]");
-	}
-	return false;
+        if (!_transport->available())
+        {
+            delay(1);
+            continue;
+        }
+        char c = uartRead();
+        if (c == '\r')
+        {
+            continue;
+        }
+        if (c == '\n')
+        {
+            if (_urcLength > 0)
+            {
+                _urcBuffer[_urcLength] = 0;
+                _urcLength = 0;
+                handleUrc(_urcBuffer);
+            }
+            continue;
+        }
+        if (_urcLength < sizeof(_urcBuffer) - 1)
+        {
+            _urcBuffer[_urcLength++] = c;
+        }
     }
+    _urcLength = 0;
+}
 
-    // This should never happen
-    QT_ERROR("Unknown error. Total %dB read", t+r);
-    QT_COM_TRACE_START("Ending bytes: [");
-    QT_COM_TRACE_BUFFER(_buffer + r - 19, 19);
-    QT_COM_TRACE_END("]");
+bool QuectelCellular::handleUrc(const char* line)
+{
+    int id;
+#ifdef M2M_QUECTEL_THREADS
+    if (_awaitedPrefix[0] != 0 &&
+        strncmp(line, _awaitedPrefix, strlen(_awaitedPrefix)) == 0)
+    {
+        strncpy(_awaitedLine, line, sizeof(_awaitedLine) - 1);
+        _awaitedLine[sizeof(_awaitedLine) - 1] = 0;
+        return true;
+    }
+#endif
+    // 1, CLOSED
+    if (hasFeature(QT_FEATURE_LEGACY_TCPIP) &&
+        isdigit(line[0]) &&
+        strcmp(line + 1, ", CLOSED") == 0)
+    {
+        if (line[0] - '0' == QT_CLIENT_SOCKET &&
+            _socketState == SocketState::Open)
+        {
+            QT_DEBUG("Connection closed by remote");
+            _socketState = SocketState::Closing;
+        }
+        return true;
+    }
+    if (line[0] != '+')
+    {
+        return false;
+    }
+    if (strncmp(line, "+QMT", 4) == 0)
+    {
+        int client;
+        int value;
+        int result;
+        char end;
+        // +QMTRECV: 0,<recv_id>, a message is waiting
+        if (sscanf(line, "+QMTRECV: %i,%i%c", &client, &value, &end) == 2)
+        {
+            if (value >= 0 && value < 8)
+            {
+                _mqttReceived |= 1 << value;
+            }
+            return true;
+        }
+        // +QMTPUB: 0,<msgid>,<result>, 0 = sent, 1 = retransmitting
+        if (sscanf(line, "+QMTPUB: %i,%i,%i", &client, &value, &result) == 3)
+        {
+            for (uint8_t i = 0; i < QT_MQTT_MAX_IN_FLIGHT && value != 0; i++)
+            {
+                if (_mqttInFlight[i] == value &&
+                    result != 1)
+                {
+                    _mqttInFlight[i] = 0;
+                    if (result != 0)
+                    {
+                        _mqttFailures++;
+                    }
+                }
+            }
+            return true;
+        }
+        // +QMTSTAT: 0,<err>, the connection is closed
+        if (sscanf(line, "+QMTSTAT: %i,%i", &client, &value) == 2)
+        {
+            QT_DEBUG("MQTT connection lost, %i", value);
+            mqttLost();
+            return true;
+        }
+        // +QMTRECV: 0,12,"topic","payload" outside the buffer mode
+        if (strncmp(line, "+QMTRECV:", 9) == 0)
+        {
+            return true;
+        }
+    }
+    // +QIURC: "recv",2
+    if (sscanf(line, "+QIURC: \"recv\",%i", &id) == 1 &&
+        id == QT_UDP_SOCKET)
+    {
+        _udpPending = true;
+        return true;
+    }
+    // +QIURC: "closed",1
+    if (sscanf(line, "+QIURC: \"closed\",%i", &id) == 1 ||
+        sscanf(line, "+QSSLURC: \"closed\",%i", &id) == 1)
+    {
+        if (id == QT_CLIENT_SOCKET &&
+            _socketState == SocketState::Open)
+        {
+            QT_DEBUG("Connection closed by remote");
+            _socketState = SocketState::Closing;
+        }
+        return true;
+    }
+    // +QIURC: "pdpdeact",1
+    if (sscanf(line, "+QIURC: \"pdpdeact\",%i", &id) == 1)
+    {
+        contextLost(id);
+        return true;
+    }
+    if (strncmp(line, "+QIURC: \"dnsgip\",", 17) == 0)
+    {
+        const char* value = line + 17;
+        if (*value == '"')
+        {
+            // +QIURC: "dnsgip","93.184.216.34"
+            IPAddress address;
+            if (!_dnsResolved && parseAddress(value + 1, address))
+            {
+                _dnsAddress = address;
+                _dnsResolved = true;
+            }
+            if (_dnsPending > 0)
+            {
+                _dnsPending--;
+            }
+        }
+        else
+        {
+            // +QIURC: "dnsgip",<err>,<IP_count>,<DNS_ttl>
+            unsigned int count = 0;
+            unsigned long ttl = 0;
+            int error = -1;
+            sscanf(value, "%i,%u,%lu", &error, &count, &ttl);
+            _dnsError = error < 0 ? 0x7fff : error;
+            _dnsPending = count;
+            _dnsTtl = ttl;
+        }
+        return true;
+    }
+    if (strncmp(line, "+QIURC: ", 8) == 0 ||
+        strncmp(line, "+QSSLURC: ", 10) == 0)
+    {
+        // "recv" is read with +QIRD/+QSSLRECV when available() polls
+        QT_DEBUG("URC %s", line);
+        return true;
+    }
+    for (uint8_t i = 0; i < QT_REGISTRATION_DOMAINS; i++)
+    {
+        // +CREG: 1,"1A2B","01234567",7
+        uint8_t length = strlen(registrationCommands[i]);
+        if (strncmp(line + 1, registrationCommands[i], length) != 0 ||
+            line[length + 1] != ':')
+        {
+            continue;
+        }
+        const char* value = line + length + 2;
+        char* end;
+        long state = strtol(value, &end, 10);
+        // A query reply starts with <n>,<stat>, the URC with <stat>
+        if (end == value ||
+            (*end == ',' && isdigit(end[1])))
+        {
+            return false;
+        }
+        _registration[i] = state <= (long)NetworkRegistrationState::Roaming ?
+            (NetworkRegistrationState)state : NetworkRegistrationState::Unknown;
+        updateRegistration();
+        return true;
+    }
     return false;
 }
 
-bool QuectelCellular::writeFile(FILE_HANDLE fileHandle, const uint8_t* buffer, uint32_t length)
+void QuectelCellular::updateRegistration()
 {
-    // AT+QFWRITE=3000,10
-    // CONNECT
-    // write 10 bytes
-    // +QFWRITE(10,10)
-    sprintf(_buffer, "AT+QFWRITE=%li,%lu", fileHandle, length);
-    if (sendAndCheckReply(_buffer, _CONNECT, 1000))
+    // Combined over the domains, the best state wins
+    static const NetworkRegistrationState order[] =
+    {
+        NetworkRegistrationState::Registered,
+        NetworkRegistrationState::Roaming,
+        NetworkRegistrationState::Searching,
+        NetworkRegistrationState::Denied,
+        NetworkRegistrationState::NotRegistered
+    };
+    NetworkRegistrationState state = NetworkRegistrationState::Unknown;
+    for (uint8_t i = 0; i < sizeof(order) / sizeof(order[0]) && state == NetworkRegistrationState::Unknown; i++)
+    {
+        for (uint8_t j = 0; j < QT_REGISTRATION_DOMAINS; j++)
+        {
+            if (_registration[j] == order[i])
+            {
+                state = order[i];
+                break;
+            }
+        }
+    }
+    if (state == _networkState)
+    {
+        return;
+    }
+    _networkState = state;
+    _registrationChanged = true;
+    switch (state)
+    {
+        case NetworkRegistrationState::NotRegistered:
+            QT_DEBUG("Not registered");
+            break;
+        case NetworkRegistrationState::Registered:
+            QT_DEBUG("Registered");
+            break;
+        case NetworkRegistrationState::Searching:
+            QT_DEBUG("Searching");
+            break;
+        case NetworkRegistrationState::Denied:
+            QT_DEBUG("Denied");
+            break;
+        case NetworkRegistrationState::Unknown:
+            QT_DEBUG("Unknown");
+            break;
+        case NetworkRegistrationState::Roaming:
+            QT_DEBUG("Roaming");
+            break;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Radio configuration
+//
+static void formatBandMask(char* buffer, uint64_t mask)
+{
+    // Printed in two halves, as printf in newlib nano has no %llx
+    uint32_t high = mask >> 32;
+    if (high)
+    {
+        sprintf(buffer, "0x%lx%08lx", (unsigned long)high, (unsigned long)(uint32_t)mask);
+    }
+    else
+    {
+        sprintf(buffer, "0x%lx", (unsigned long)(uint32_t)mask);
+    }
+}
+
+bool QuectelCellular::applyRadioConfig()
+{
+    if (!hasFeature(QT_FEATURE_RAT_CONFIG))
     {
-        for (uint32_t i=0; i < length; i++)
-        {
-            _uart->write(buffer[i]);
-        }
-        if (!readReply(1000, 3))
+        return true;
+    }
+    char value[64];
+    bool result = true;
+    if (_radioConfig.scanSequence != nullptr)
+    {
+        // With preferLastRat the stored order may differ from the
+        // configured one, as long as it holds the same RATs
+        if (!_radioConfig.preferLastRat ||
+            !getModuleConfig("nwscanseq", value, sizeof(value)) ||
+            !sameScanSequence(value, _radioConfig.scanSequence))
         {
-            QT_ERROR("No reply after write");
-            return false;
+            result &= setModuleConfig("nwscanseq", _radioConfig.scanSequence, 1);
         }
-        return (strstr(_buffer, "+QFWRITE:") != nullptr);
     }
-    return false;
+    if (_radioConfig.scanMode != ScanMode::Unchanged)
+    {
+        sprintf(value, "%i", (uint8_t)_radioConfig.scanMode);
+        result &= setModuleConfig("nwscanmode", value, 1);
+    }
+    if (_radioConfig.iotMode != IotMode::Unchanged)
+    {
+        sprintf(value, "%i", (uint8_t)_radioConfig.iotMode);
+        result &= setModuleConfig("iotopmode", value, 1);
+    }
+    if (_radioConfig.gsmBands != 0 ||
+        _radioConfig.catM1Bands != 0 ||
+        _radioConfig.nbIotBands != 0)
+    {
+        // 0xf,0x400a0e189f,0xa0e189f
+        formatBandMask(value, _radioConfig.gsmBands);
+        strcat(value, ",");
+        formatBandMask(value + strlen(value), _radioConfig.catM1Bands);
+        strcat(value, ",");
+        formatBandMask(value + strlen(value), _radioConfig.nbIotBands);
+        result &= setModuleConfig("band", value, 1);
+    }
+    return result;
 }
 
-bool QuectelCellular::seekFile(FILE_HANDLE fileHandle, uint32_t length)
+bool QuectelCellular::preferRadioAccess(RadioAccess access)
 {
-    // AT+QFSEEK=3000,0,0
-    // OK
-    sprintf(_buffer,"AT+QFSEEK=%li,%lu,0", fileHandle, length);
-    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    char current[12];
+    if (access == RadioAccess::Auto ||
+        !hasFeature(QT_FEATURE_RAT_CONFIG) ||
+        !getModuleConfig("nwscanseq", current, sizeof(current)))
     {
-        QT_ERROR("Seek error: %s", _buffer);
         return false;
     }
-    return checkResult();
+    if (strcmp(current, "00") == 0)
+    {
+        // Automatic, which is the default order
+        strcpy(current, "020301");
+    }
+    // The preferred RAT first, then the rest in their current order
+    char sequence[12];
+    sprintf(sequence, "%02i", (uint8_t)access);
+    for (char* code = current; isdigit(code[0]) && isdigit(code[1]) && strlen(sequence) < 10; code += 2)
+    {
+        if (strncmp(code, sequence, 2) != 0)
+        {
+            strncat(sequence, code, 2);
+        }
+    }
+    if (strcmp(sequence, current) == 0)
+    {
+        return true;
+    }
+    // Takes effect on the next boot, the module is registered already
+    return setModuleConfig("nwscanseq", sequence, 0);
 }
 
-bool QuectelCellular::seekFileCur(FILE_HANDLE fileHandle, int32_t length)
+bool QuectelCellular::sameScanSequence(const char* a, const char* b)
 {
-    // AT+QFSEEK=3000,0,0
-    // OK
-    sprintf(_buffer,"AT+QFSEEK=%li,%li,1", fileHandle, length);
-    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    if (strlen(a) != strlen(b))
     {
-        QT_ERROR("Seek error: %s", _buffer);
         return false;
     }
-    return checkResult();
+    for (const char* code = a; code[0] && code[1]; code += 2)
+    {
+        const char* other = b;
+        while (other[0] && other[1] && strncmp(code, other, 2) != 0)
+        {
+            other += 2;
+        }
+        if (!other[0])
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
-uint32_t QuectelCellular::getFilePosition(FILE_HANDLE fileHandle)
+bool QuectelCellular::getModuleConfig(const char* name, char* value, size_t size)
 {
-    // AT+QFPOSITION=3000
-    // +QFPOSITION: 123
+    // AT+QCFG="nwscanmode"
+    // +QCFG: "nwscanmode",0
     //
     // OK
-    sprintf(_buffer, "AT+QFPOSITION=%li", fileHandle);
+    sprintf(_buffer, "AT+QCFG=\"%s\"", name);
     if (!sendAndWaitForReply(_buffer, 1000, 3))
     {
-        QT_ERROR("File position error: %s", _buffer);
-        return -1;
+        return false;
     }
-    char* token = strtok(_buffer, "+QFPOSITION: ");
-    if (!token)
+    char* current = strstr(_buffer, "\",");
+    if (current == nullptr)
     {
-        QT_ERROR("Get position error: %s", _buffer);
-        return -1;
+        return false;
     }
-    uint32_t result = atoi(token);
-    return result;
-}
-
-bool QuectelCellular::truncateFile(FILE_HANDLE fileHandle)
-{
-    // AT+QFTUCAT=3000
-    // OK
-    sprintf(_buffer, "AT+QFTUCAT=%li", fileHandle);
-    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    current += 2;
+    size_t length = strcspn(current, "\n");
+    if (length >= size)
     {
-        QT_ERROR("Timeout deleting file: %s", _buffer);
         return false;
     }
-    return checkResult();
+    memcpy(value, current, length);
+    value[length] = 0;
+    return true;
 }
 
-bool QuectelCellular::closeFile(FILE_HANDLE fileHandle)
+bool QuectelCellular::setModuleConfig(const char* name, const char* value, int8_t effect)
 {
-    // AT+QFCLOSE=3000
+    char current[64];
+    if (getModuleConfig(name, current, sizeof(current)) &&
+        strcasecmp(current, value) == 0)
+    {
+        QT_DEBUG("%s unchanged", name);
+        return true;
+    }
+    // AT+QCFG="nwscanmode",0,1
     // OK
-    sprintf(_buffer, "AT+QFCLOSE=%li", fileHandle);
+    sprintf(_buffer, "AT+QCFG=\"%s\",%s", name, value);
+    if (effect >= 0)
+    {
+        sprintf(_buffer + strlen(_buffer), ",%i", effect);
+    }
     if (!sendAndCheckReply(_buffer, _OK, 1000))
     {
-        QT_ERROR("Timeout closing file: %s", _buffer);
+        QT_ERROR("Failed to set %s", name);
         return false;
     }
-    return checkResult();
+    return true;
 }
 
-// TODO: Not tested
-bool QuectelCellular::uploadFile(const char* fileName, const uint8_t* buffer, uint32_t length)
+bool QuectelCellular::readNetworkInfo()
 {
-    // AT+QFUPL="RAM:test1.txt",10
-    // CONNECT
-    // <data>
-    // +QFUPL:300,B34A
-    sprintf(_buffer, "AT+QFUPL=\"RAM:%s\",%lu", fileName, length);
-    if (!sendAndWaitForReply(_buffer, 1000, 2))
+    // +QNWINFO: "CAT-M1","24008","LTE BAND 20",6300
+    //
+    // OK
+    _radioAccess = RadioAccess::Auto;
+    _band = 0;
+    char access[16];
+    char band[24];
+    if (!sendAndWaitForReply("AT+QNWINFO", 1000, 3) ||
+        !strstr(_buffer, "+QNWINFO:") ||
+        sscanf(strstr(_buffer, "+QNWINFO:"), "+QNWINFO: \"%15[^\"]\",\"%*[^\"]\",\"%23[^\"]\"", access, band) != 2)
     {
-        QT_ERROR("No response to upload command");
         return false;
     }
-    if (!strstr(_buffer, "CONNECT"))
+    if (strstr(access, "CAT-M") || strstr(access, "eMTC"))
     {
-        QT_ERROR(_buffer);
-        return false;
+        _radioAccess = RadioAccess::CatM1;
     }
-    for (uint32_t i = 0; i < length; i++)
+    else if (strstr(access, "NB"))
     {
-        _uart->print(buffer[i]);
+        _radioAccess = RadioAccess::NbIot;
     }
-    if (!readReply(1000, 2))
+    else if (strstr(access, "GSM") || strstr(access, "GPRS") || strstr(access, "EDGE"))
     {
-        QT_ERROR("No reponse after upload");
+        _radioAccess = RadioAccess::Gsm;
     }
-    return checkResult();
+    _band = atoi(band + strcspn(band, "0123456789"));
+    return true;
 }
 
-// TODO: Not tested
-bool QuectelCellular::downloadFile(const char* fileName, uint8_t* buffer, uint32_t length)
+bool QuectelCellular::readModuleInfo()
 {
-    // AT+QFDWL="RAM:test.txt"
-    // CONNECT
-    // <read data>
-    // +QFDWL: 10,613e
-    sprintf(_buffer, "AT+QFDWL=\"RAM:%s\",%lu", fileName, length);
-    if (!sendAndWaitForReply(_buffer, 1000, 2))
-    {
-        QT_ERROR("No response to download command");
-        return false;
-    }
-    if (!strstr(_buffer, "CONNECT"))
-    {
-        QT_ERROR(_buffer);
-        return false;
-    }
-    for (uint32_t i = 0; i < length; i++)
+    if (sendAndWaitForReply("ATI", 1000, 5))
     {
-        uint32_t timeout = 1000;
-        while (timeout--)
+		// response is:
+		// Quectel
+		// UG96
+		// Revision: UG96LNAR02A06E1G
+        //
+        // OK
+        //
+        // M95 answers Quectel_Ltd and Quectel_M95 on the first two lines
+
+        const char linefeed[] = "\n";
+        char * token = strtok(_buffer, linefeed);
+        if (token == nullptr ||
+            strncmp(token, "Quectel", 7) != 0)
+        {
+            QT_ERROR("Not a Quectel module");
+            return false;
+        }
+        token = strtok(nullptr, linefeed);
+        if (token == nullptr)
+        {
+            QT_ERROR("Parse error");
+            return false;
+        }
+        _profile = &moduleProfiles[0];
+        bool found = false;
+        for (uint8_t i = 0; i < sizeof(moduleProfiles) / sizeof(moduleProfiles[0]); i++)
         {
-            while (_uart->available())
+            if (strstr(token, moduleProfiles[i].name))
             {
-                buffer[i] = _uart->read();
+                _profile = &moduleProfiles[i];
+                found = true;
+                break;
             }
-            delay(1);
+        }
+        if (!found)
+        {
+            QT_INFO("Unknown module %s, using %s profile", token, _profile->name);
+        }
+        _moduleType = _profile->module;
+        token = strtok(nullptr, linefeed);
+        if (token != nullptr && strlen(token) > 10)
+        {
+            strcpy(_firmwareVersion, token + 10);
         }
     }
-    if (!readReply(1000, 2))
+    return true;
+}
+
+bool QuectelCellular::hasFeature(uint16_t feature)
+{
+    return (_profile->features & feature) != 0;
+}
+
+bool QuectelCellular::getStatus()
+{
+    QT_LOCK();
+    if (_statusPin == NOT_A_PIN)
     {
-        QT_ERROR("No reponse after download");
+        return true;
     }
-    return (strstr(_buffer, "+QFDWL:") != nullptr);
+    return digitalRead(_statusPin) == HIGH;
 }
 
-uint32_t QuectelCellular::getFileSize(const char* fileName)
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Power saving
+//
+static uint8_t encodeTimer(uint32_t seconds, const uint8_t* units, const uint32_t* unitSeconds, uint8_t count)
 {
-    // AT+QFLST:"RAM:file.txt"
-    // +QFLST:"RAM:file.txt"",734"
-    //
-    // OK
-    sprintf(_buffer, "AT+QFLST=\"RAM:%s\"", fileName);
-    if (!sendAndWaitForReply(_buffer, 1000, 2))
+    // 3 bit unit and 5 bit value, as in 3GPP TS 24.008 GPRS Timer 2 and 3
+    for (uint8_t i = 0; i < count; i++)
     {
-        QT_ERROR("Get file size error 1: %s", _buffer);
-        return -1;
+        if (seconds <= 31 * unitSeconds[i])
+        {
+            return (units[i] << 5) | ((seconds + unitSeconds[i] - 1) / unitSeconds[i]);
+        }
     }
-    char* token = strtok(_buffer, "+QFLST: ");
-    if (!token)
+    return (units[count - 1] << 5) | 31;
+}
+
+static uint8_t encodeEdrx(uint32_t milliseconds, const uint8_t* values, const uint32_t* cycles, uint8_t count)
+{
+    // The longest cycle not above milliseconds, the shortest if all are
+    uint8_t i = 0;
+    while (i + 1 < count && cycles[i + 1] <= milliseconds)
     {
-        QT_ERROR("Get file size error: %s", _buffer);
-        return -1;
+        i++;
     }
-    token = strtok(nullptr, ",");
-    token = strtok(nullptr, "\n");
-    uint32_t result = atoi(token);
-    return result;
+    return values[i];
 }
 
-bool QuectelCellular::deleteFile(const char* fileName)
+static void formatBits(char* buffer, uint8_t value, uint8_t bits)
 {
-    // AT+QFDEL:"RAM:file.txt"
-    // OK
-    sprintf(_buffer, "AT+QFDEL=\"RAM:%s\"", fileName);
-    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    for (uint8_t i = 0; i < bits; i++)
     {
-        QT_ERROR("Timeout deleting file: %s", _buffer);
-        return false;
+        buffer[i] = value & (1 << (bits - 1 - i)) ? '1' : '0';
     }
-    return checkResult();
+    buffer[bits] = 0;
 }
 
-// Private
-
-bool QuectelCellular::setPower(bool state)
+bool QuectelCellular::setPsm(bool enable, uint32_t periodicUpdateSeconds, uint32_t activeTimeSeconds)
 {
-    uint32_t timeout;
-	QT_DEBUG("setPower: %i", state);
-    if (state == true)
+    QT_LOCK();
+    // Periodic TAU (T3412 extended) and active time (T3324) units
+    static const uint8_t tauUnits[] = { 3, 4, 5, 0, 1, 2, 6 };
+    static const uint32_t tauSeconds[] = { 2, 30, 60, 600, 3600, 36000, 1152000 };
+    static const uint8_t activeUnits[] = { 0, 1, 2 };
+    static const uint32_t activeSeconds[] = { 2, 60, 360 };
+
+    if (!hasFeature(QT_FEATURE_PSM))
     {
-        if (_powerPin != NOT_A_PIN)
+        QT_ERROR("PSM not supported by %s", _profile->name);
+        return false;
+    }
+    if (enable)
+    {
+        // AT+CPSMS=1,,,"10011110","00100001"
+        // OK
+        //
+        // A timer of 0 is left out, the module or network default applies
+        char tau[11] = "";
+        char active[11] = "";
+        if (periodicUpdateSeconds != 0)
         {
-            digitalWrite(_powerPin, LOW);
-            delay(300);
-            digitalWrite(_powerPin, HIGH);
+            tau[0] = '"';
+            formatBits(tau + 1, encodeTimer(periodicUpdateSeconds, tauUnits, tauSeconds, sizeof(tauUnits)), 8);
+            strcat(tau, "\"");
         }
-
-        QT_TRACE_START("Waiting for module");
-        while (!getStatus())
+        if (activeTimeSeconds != 0)
         {
-            QT_TRACE_PART(".");
-            callWatchdog();
-            delay(500);
+            active[0] = '"';
+            formatBits(active + 1, encodeTimer(activeTimeSeconds, activeUnits, activeSeconds, sizeof(activeUnits)), 8);
+            strcat(active, "\"");
         }
-        QT_TRACE_END("");
-
-        QT_DEBUG("Open communications");
-        int32_t timeout = 7000;
-        while (timeout > 0)
+        if (periodicUpdateSeconds == 0 && activeTimeSeconds == 0)
         {
-            flush();
-            if (sendAndCheckReply(_AT, "AT", 1000))
-            {
-                QT_COM_TRACE("GOT AT");
-                break;
-            }
-            callWatchdog();
-            delay(500);
-            timeout -= 500;
+            strcpy(_buffer, "AT+CPSMS=1");
+        }
+        else if (activeTimeSeconds == 0)
+        {
+            sprintf(_buffer, "AT+CPSMS=1,,,%s", tau);
+        }
+        else
+        {
+            sprintf(_buffer, "AT+CPSMS=1,,,%s,%s", tau, active);
         }
+    }
+    else
+    {
+        strcpy(_buffer, "AT+CPSMS=0");
+    }
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        QT_ERROR("Failed to set PSM");
+        return false;
+    }
+    _psmEnabled = enable;
+    return true;
+}
 
-        if (timeout <= 0)
+bool QuectelCellular::setEdrx(bool enable, RadioAccess access, uint32_t cycleMilliseconds)
+{
+    QT_LOCK();
+    // eDRX cycles in ms and their 4 bit values, 3GPP TS 24.008 10.5.5.32.
+    // GSM counts in 51-multiframes, NB-IoT has no cycles below 20.48 s.
+    static const uint8_t gsmValues[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+    static const uint32_t gsmCycles[] =
+    {
+        1883, 3766, 7532, 12240, 24480, 48960, 97920, 195840,
+        391680, 783360, 1566720, 3133440
+    };
+    static const uint8_t lteValues[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    static const uint32_t lteCycles[] =
+    {
+        5120, 10240, 20480, 40960, 61440, 81920, 102400, 122880,
+        143360, 163840, 327680, 655360, 1310720, 2621440, 5242880, 10485760
+    };
+    static const uint8_t nbIotValues[] = { 2, 3, 5, 9, 10, 11, 12, 13, 14, 15 };
+    static const uint32_t nbIotCycles[] =
+    {
+        20480, 40960, 81920, 163840, 327680, 655360, 1310720, 2621440,
+        5242880, 10485760
+    };
+
+    if (!hasFeature(QT_FEATURE_PSM))
+    {
+        QT_ERROR("eDRX not supported by %s", _profile->name);
+        return false;
+    }
+    if (enable)
+    {
+        // AT+CEDRXS=1,4,"0101"
+        // OK
+        uint8_t type;
+        uint8_t value;
+        switch (access)
         {
-            QT_ERROR("Failed to initialize cellular module");
-            return false;
+            case RadioAccess::Gsm:
+                type = 2;
+                value = encodeEdrx(cycleMilliseconds, gsmValues, gsmCycles, sizeof(gsmValues));
+                break;
+            case RadioAccess::CatM1:
+                type = 4;
+                value = encodeEdrx(cycleMilliseconds, lteValues, lteCycles, sizeof(lteValues));
+                break;
+            case RadioAccess::NbIot:
+                type = 5;
+                value = encodeEdrx(cycleMilliseconds, nbIotValues, nbIotCycles, sizeof(nbIotValues));
+                break;
+            default:
+                QT_ERROR("eDRX needs a RAT");
+                return false;
         }
+        char bits[5];
+        formatBits(bits, value, 4);
+        sprintf(_buffer, "AT+CEDRXS=1,%i,\"%s\"", type, bits);
+    }
+    else
+    {
+        strcpy(_buffer, "AT+CEDRXS=0");
+    }
+    if (!sendAndCheckReply(_buffer, _OK, 1000))
+    {
+        QT_ERROR("Failed to set eDRX");
+        return false;
+    }
+    return true;
+}
+
+bool QuectelCellular::sleep()
+{
+    QT_LOCK();
+    // AT+QSCLK=1
+    // OK
+    // With DTR high the module sleeps whenever it is idle, and with PSM
+    // enabled it enters PSM once the active timer has run out
+    if (_dtrPin == NOT_A_PIN)
+    {
+        QT_ERROR("Sleep needs the DTR pin");
+        return false;
+    }
+    if (!sendAndCheckReply("AT+QSCLK=1", _OK, 1000))
+    {
+        QT_ERROR("Failed to enable sleep");
+        return false;
     }
-    else
+    digitalWrite(_dtrPin, HIGH);
+    _powerState = PowerState::Sleep;
+    return true;
+}
+
+bool QuectelCellular::wake()
+{
+    QT_LOCK();
+    uint32_t start = millis();
+    PowerState state = getPowerState();
+    switch (state)
     {
-        if (!getStatus())
-        {
-            QT_COM_TRACE("Module already off");
+        case PowerState::Active:
             return true;
-        }
-        QT_DEBUG("Powering down module");
-        // First check if already awake
-        timeout = 5000;
-        while (timeout > 0)
+        case PowerState::Off:
+            QT_ERROR("Module is off, use begin()");
+            return false;
+        case PowerState::Sleep:
+            digitalWrite(_dtrPin, LOW);
+            break;
+        case PowerState::Psm:
         {
-            flush();
-            if (sendAndCheckReply(_AT, "OK", 1000))
+            if (_dtrPin != NOT_A_PIN)
             {
-                QT_COM_TRACE("GOT AT");
-                break;
+                digitalWrite(_dtrPin, LOW);
             }
-            if (sendAndCheckReply(_AT, "OK", 1000))
+            // PSM_EINT is faster, PWRKEY also works
+            int8_t pin = _wakeupPin != NOT_A_PIN ? _wakeupPin : _powerPin;
+            if (pin == NOT_A_PIN)
             {
-                QT_COM_TRACE("GOT OK");
-                break;
+                QT_ERROR("No pin to wake the module with");
+                return false;
             }
-            callWatchdog();
-            delay(500);
-            timeout -= 500;
-        }
-        sendAndCheckReply("ATE0", _OK, 1000);
-
-		if (!sendAndCheckReply("AT+QCFG=\"urc/port\",1,\"uart1\"", _OK))
-		{
-			QT_ERROR("Could not start urc messages");
-			return false;
-		}
-
-        if (!sendAndCheckReply("AT+QPOWD=1", _OK, 10000))
-        {
-            return false;
-        }
-        timeout = millis() + 60000;  // max 60 seconds for a shutdown
-        while (timeout > millis())
-        {
-            if (readReply(1000, 1))
+            digitalWrite(pin, LOW);
+            delay(pin == _wakeupPin ? QT_PSM_EINT_PULSE : QT_PWRKEY_WAKE_PULSE);
+            digitalWrite(pin, HIGH);
+            while (!getStatus())
             {
-                if (strstr(_buffer, "+QIURC: \"pdpdeact\",1"))
-                {
-                    QT_DEBUG("PDP deactivated");
-                }
-                if (strstr(_buffer, "POWERED DOWN"))
+                if (millis() - start > 10000)
                 {
-                    QT_DEBUG("Module powered down");
-                    break;
+                    QT_ERROR("Module did not leave PSM");
+                    return false;
                 }
+                callWatchdog();
+                delay(10);
             }
-            callWatchdog();
+            break;
         }
+    }
+    if (!waitForUart(5000))
+    {
+        QT_ERROR("No response after wake up");
         return false;
     }
+    if (state == PowerState::Psm)
+    {
+        // The module restarts when leaving PSM, but keeps its registration
+        sendAndCheckReply("ATE0", _OK, 1000);
+        sendAndCheckReply("AT+CMEE=1", _OK, 1000);
+        enableRegistrationUrcs();
+    }
+    _powerState = PowerState::Active;
+    QT_DEBUG("Awake after %lu ms", millis() - start);
     return true;
 }
 
-bool QuectelCellular::getStatus()
+PowerState QuectelCellular::getPowerState()
 {
-    if (_statusPin == NOT_A_PIN)
+    QT_LOCK();
+    if (_psmEnabled &&
+        _statusPin != NOT_A_PIN &&
+        (_powerState == PowerState::Active || _powerState == PowerState::Sleep) &&
+        !getStatus())
     {
-        return true;
+        _powerState = PowerState::Psm;
     }
-    return digitalRead(_statusPin) == HIGH;
+    return _powerState;
+}
+
+bool QuectelCellular::waitForUart(uint32_t timeout)
+{
+    uint32_t start = millis();
+    while (millis() - start < timeout)
+    {
+        // Echo may be on, so look for OK anywhere in the reply
+        if (sendAndWaitFor(_AT, _OK, 100))
+        {
+            return true;
+        }
+        callWatchdog();
+    }
+    return false;
 }
 
 int8_t QuectelCellular::getLastError()
 {
+    QT_LOCK();
     return _lastError;
 }
 
@@ -1293,28 +4646,67 @@ bool QuectelCellular::sendAndWaitForMultilineReply(const char* command, uint8_t
 
 bool QuectelCellular::sendAndWaitForReply(const char* command, uint16_t timeout, uint8_t lines)
 {
-    flush();
-	QT_COM_TRACE(" -> %s", command);
-    _uart->println(command);
-    return readReply(timeout, lines);
+    CommandFamily family = getCommandFamily(command);
+    bool adaptive = isAdaptive(command, timeout);
+    RetryPolicy& policy = _retryPolicies[(uint8_t)family];
+    uint8_t attempts = adaptive ? policy.attempts : 1;
+    uint16_t backoff = policy.backoff;
+    uint16_t firstByteTimeout = adaptive ? getReplyTimeout(family) : 0;
+    for (uint8_t attempt = 1; ; attempt++)
+    {
+        flush();
+        QT_COM_TRACE(" -> %s", command);
+        uint32_t start = millis();
+        uint32_t received = _stats.uartBytesIn;
+        uartWriteLine(command);
+        bool result = readReply(timeout, lines, firstByteTimeout);
+        recordReply(family, start, result);
+        if (result)
+        {
+            // Only replies to the first attempt are timed, a late reply to
+            // an earlier attempt would look fast (Karn's algorithm)
+            if (adaptive && attempt == 1)
+            {
+                updateReplyTimer(family, millis() - start);
+            }
+            return true;
+        }
+        // Without a single byte received _buffer is untouched, so a command
+        // built in it can be sent again
+        if (attempt >= attempts || _stats.uartBytesIn != received)
+        {
+            return false;
+        }
+        QT_DEBUG("No reply, retrying in %u ms", backoff);
+        _stats.retries++;
+        callWatchdog();
+        delay(backoff);
+        backoff = backoff * 2 < QT_RETRY_BACKOFF_MAX ? backoff * 2 : QT_RETRY_BACKOFF_MAX;
+        if (firstByteTimeout > 0)
+        {
+            firstByteTimeout = firstByteTimeout * 2 < timeout ? firstByteTimeout * 2 : 0;
+        }
+    }
 }
 
 bool QuectelCellular::sendAndWaitFor(const char* command, const char* reply, uint16_t timeout)
 {
     uint16_t index = 0;
 
+    CommandFamily family = getCommandFamily(command);
     flush();
 	QT_COM_TRACE(" -> %s", command);
-    _uart->println(command);
+    uint32_t start = millis();
+    uartWriteLine(command);
     while (timeout--)
     {
-        if (index > 254)
+        if (index >= sizeof(_buffer) - 1)
         {
             break;
         }
-        while (_uart->available())
+        while (_transport->available() && index < sizeof(_buffer) - 1)
         {
-            char c = _uart->read();
+            char c = uartRead();
             if (c == '\r')
             {
                 continue;
@@ -1326,17 +4718,31 @@ bool QuectelCellular::sendAndWaitFor(const char* command, const char* reply, uin
             }
             _buffer[index++] = c;
         }
+        _buffer[index] = 0;
 
         if (strstr(_buffer, reply))
         {
             QT_COM_TRACE("Match found");
             break;
         }
+        // An ERROR or +CME ERROR line ends the wait, e.g. a send on a
+        // closed socket
+        if (index > 0 && _buffer[index - 1] == '\n' &&
+            strstr(_buffer, _ERROR) &&
+            !strstr(reply, _ERROR))
+        {
+            QT_COM_TRACE_START(" <- (Error) ");
+            QT_COM_TRACE_ASCII(_buffer, index);
+            QT_COM_TRACE_END("");
+            recordReply(family, start, true);
+            return false;
+        }
         if (timeout <= 0)
         {
             QT_COM_TRACE_START(" <- (Timeout) ");
             QT_COM_TRACE_ASCII(_buffer, index);
             QT_COM_TRACE_END("");
+            recordReply(family, start, false);
             return false;
         }
         callWatchdog();
@@ -1346,6 +4752,7 @@ bool QuectelCellular::sendAndWaitFor(const char* command, const char* reply, uin
     QT_COM_TRACE_START(" <- ");
     QT_COM_TRACE_ASCII(_buffer, index);
     QT_COM_TRACE_END("");
+    recordReply(family, start, true);
     return true;
 }
 
@@ -1355,20 +4762,24 @@ bool QuectelCellular::sendAndCheckReply(const char* command, const char* reply,
     return (strstr(_buffer, reply) != nullptr);
 }
 
-bool QuectelCellular::readReply(uint16_t timeout, uint8_t lines)
+bool QuectelCellular::readReply(uint16_t timeout, uint8_t lines, uint16_t firstByteTimeout)
 {
     uint16_t index = 0;
+    uint16_t lineStart = 0;
     uint16_t linesFound = 0;
+    // With firstByteTimeout, give up early when nothing at all is received
+    uint32_t received = _stats.uartBytesIn;
+    uint32_t start = millis();
 
     while (timeout--)
     {
-	if (index > 254)
+	if (index >= sizeof(_buffer) - 1)
 	{
 	    break;
 	}
-	while (_uart->available())
+	while (_transport->available() && index < sizeof(_buffer) - 1)
 	{
-	    char c = _uart->read();
+	    char c = uartRead();
 	    if (c == '\r')
 	    {
 		continue;
@@ -1381,6 +4792,14 @@ bool QuectelCellular::readReply(uint16_t timeout, uint8_t lines)
 	    _buffer[index++] = c;
 	    if (c == '\n')
 	    {
+		// Unsolicited result codes are handled and removed from the reply
+		_buffer[index] = 0;
+		if (handleUrc(_buffer + lineStart))
+		{
+		    index = lineStart;
+		    continue;
+		}
+		lineStart = index;
 		linesFound++;
 	    }
 	    if (linesFound >= lines)
@@ -1394,7 +4813,9 @@ bool QuectelCellular::readReply(uint16_t timeout, uint8_t lines)
 	    break;
 	}
 
-	if (timeout <= 0)
+	if (timeout <= 0 ||
+	    (firstByteTimeout > 0 && _stats.uartBytesIn == received &&
+	     millis() - start >= firstByteTimeout))
 	{
 	    QT_COM_TRACE_START(" <- (Timeout) ");
 	    QT_COM_TRACE_ASCII(_buffer, index);
@@ -1438,6 +4859,271 @@ bool QuectelCellular::checkResult()
     return false;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UART access
+//
+// All traffic to and from the module goes through these and the transport,
+// so that it can be accounted for in the statistics and captured by a
+// traffic recorder.
+//
+int QuectelCellular::uartRead()
+{
+    uint8_t value;
+    if (_transport->read(&value, 1) == 0)
+    {
+        return -1;
+    }
+    _stats.uartBytesIn++;
+    if (_recorder != nullptr)
+    {
+        _recorder->record(TrafficDirection::FromModule, &value, 1);
+    }
+    return value;
+}
+
+size_t QuectelCellular::uartReadBytes(void* buffer, size_t length, uint16_t timeout)
+{
+    // As Stream::readBytes(), the timeout is the longest gap between bytes
+    uint8_t* data = (uint8_t*)buffer;
+    size_t result = 0;
+    while (result < length)
+    {
+        size_t received = _transport->read(data + result, length - result);
+        if (received > 0)
+        {
+            result += received;
+        }
+        else if (!_transport->waitForData(timeout))
+        {
+            break;
+        }
+    }
+    _stats.uartBytesIn += result;
+    if (_recorder != nullptr)
+    {
+        _recorder->record(TrafficDirection::FromModule, data, result);
+    }
+    return result;
+}
+
+size_t QuectelCellular::uartWrite(const uint8_t* buffer, size_t length)
+{
+    if (_recorder != nullptr)
+    {
+        _recorder->record(TrafficDirection::ToModule, buffer, length);
+    }
+    // The transport takes what fits in its output queue
+    size_t result = 0;
+    uint32_t start = millis();
+    while (result < length)
+    {
+        size_t written = _transport->write(buffer + result, length - result);
+        if (written > 0)
+        {
+            result += written;
+        }
+        else if (millis() - start >= QT_UART_WRITE_TIMEOUT)
+        {
+            QT_ERROR("UART write timeout");
+            break;
+        }
+        else
+        {
+            delay(1);
+        }
+    }
+    _stats.uartBytesOut += result;
+    return result;
+}
+
+size_t QuectelCellular::uartWriteLine(const char* command)
+{
+    size_t result = uartWrite((const uint8_t*)command, strlen(command));
+    return result + uartWrite((const uint8_t*)"\r\n", 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Statistics
+//
+const uint16_t QuectelCellular::latencyBucketLimits[QT_LATENCY_BUCKETS - 1] =
+{
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000
+};
+
+QuectelStats QuectelCellular::getStats()
+{
+    // A copy, the counters change with every command of other tasks
+    QT_LOCK();
+    return _stats;
+}
+
+void QuectelCellular::resetStats()
+{
+    QT_LOCK();
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+CommandFamily QuectelCellular::getCommandFamily(const char* command)
+{
+    if (strncmp(command, "AT", 2) != 0)
+    {
+        // Only the URL sent after AT+QHTTPURL
+        return CommandFamily::Http;
+    }
+    if (strncmp(command, "AT+QHTTP", 8) == 0)
+    {
+        return CommandFamily::Http;
+    }
+    if (strncmp(command, "AT+QF", 5) == 0)
+    {
+        return CommandFamily::File;
+    }
+    if (strncmp(command, "AT+QI", 5) == 0 ||
+        strncmp(command, "AT+QSSL", 7) == 0)
+    {
+        return CommandFamily::Socket;
+    }
+    return CommandFamily::Status;
+}
+
+void QuectelCellular::recordReply(CommandFamily family, uint32_t start, bool replied)
+{
+    _stats.commandsSent++;
+    if (!replied)
+    {
+        _stats.timeouts++;
+        return;
+    }
+
+    uint32_t elapsed = millis() - start;
+    uint8_t bucket = 0;
+    while (bucket < QT_LATENCY_BUCKETS - 1 &&
+           elapsed >= latencyBucketLimits[bucket])
+    {
+        bucket++;
+    }
+    _stats.latency[(uint8_t)family][bucket]++;
+
+    char* token = strstr(_buffer, _CME_ERROR);
+    if (token)
+    {
+        // Numeric with AT+CMEE=1, as set at startup
+        uint16_t code = atoi(token + strlen(_CME_ERROR));
+        _stats.cmeErrors++;
+        for (uint8_t i = 0; i < QT_CME_ERROR_CODES; i++)
+        {
+            CmeErrorCount& entry = _stats.cmeErrorCodes[i];
+            if (entry.count == 0 || entry.code == code)
+            {
+                entry.code = code;
+                entry.count++;
+                break;
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Timeouts and retries
+//
+// Only queries, and settings that leave the same state when sent twice,
+// are sent again. Read commands (ending in '?') and the plain "AT" are
+// always safe; all other commands, e.g. opens, connects, subscribes and
+// deletes, keep the limit of the call and are never sent twice.
+static const char* const retryCommands[] =
+{
+    "ATI", "ATE0", "AT+CMEE=", "AT+CSQ", "AT+GSN", "AT+CIMI", "AT+QCCID", "AT+CBC",
+    "AT+QNWINFO", "AT+QISTATE", "AT+QFLDS=", "AT+QFLST=", "AT+QFPOSITION=",
+    "AT+QCFG=", "AT+QURCCFG=", "AT+QICFG=", "AT+QICSGP=", "AT+QIDNSCFG=",
+    "AT+QSSLCFG=", "AT+QHTTPCFG=", "AT+QMTCFG="
+};
+
+void QuectelCellular::setAdaptiveTimeouts(bool enable)
+{
+    QT_LOCK();
+    _adaptiveTimeouts = enable;
+}
+
+uint16_t QuectelCellular::getReplyTimeout(CommandFamily family)
+{
+    QT_LOCK();
+    const ReplyTimer& timer = _replyTimers[(uint8_t)family];
+    if (timer.samples < QT_REPLY_SAMPLES)
+    {
+        return 0;
+    }
+    int32_t timeout = (timer.srtt >> 3) + timer.rttvar;
+    if (timeout < QT_REPLY_TIMEOUT_MIN)
+    {
+        return QT_REPLY_TIMEOUT_MIN;
+    }
+    return timeout > QT_ADAPTIVE_TIMEOUT_LIMIT ? QT_ADAPTIVE_TIMEOUT_LIMIT : timeout;
+}
+
+void QuectelCellular::setRetryPolicy(CommandFamily family, uint8_t attempts, uint16_t backoff)
+{
+    QT_LOCK();
+    RetryPolicy& policy = _retryPolicies[(uint8_t)family];
+    policy.attempts = attempts > 0 ? attempts : 1;
+    policy.backoff = backoff;
+}
+
+bool QuectelCellular::isAdaptive(const char* command, uint16_t timeout)
+{
+    if (!_adaptiveTimeouts || timeout > QT_ADAPTIVE_TIMEOUT_LIMIT ||
+        strncmp(command, "AT", 2) != 0)
+    {
+        return false;
+    }
+    size_t length = strlen(command);
+    if (length == 2 || command[length - 1] == '?')
+    {
+        return true;
+    }
+    for (uint8_t i = 0; i < sizeof(retryCommands) / sizeof(retryCommands[0]); i++)
+    {
+        if (strncmp(command, retryCommands[i], strlen(retryCommands[i])) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void QuectelCellular::updateReplyTimer(CommandFamily family, uint32_t elapsed)
+{
+    ReplyTimer& timer = _replyTimers[(uint8_t)family];
+    int32_t sample = elapsed > QT_ADAPTIVE_TIMEOUT_LIMIT ? QT_ADAPTIVE_TIMEOUT_LIMIT : elapsed;
+    if (timer.samples == 0)
+    {
+        timer.srtt = sample << 3;
+        timer.rttvar = sample << 1;
+    }
+    else
+    {
+        // srtt += (sample - srtt) / 8, rttvar += (|sample - srtt| - rttvar) / 4
+        int32_t delta = sample - (timer.srtt >> 3);
+        timer.srtt += delta;
+        if (delta < 0)
+        {
+            delta = -delta;
+        }
+        timer.rttvar += delta - (timer.rttvar >> 2);
+    }
+    if (timer.samples < 0xffff)
+    {
+        timer.samples++;
+    }
+}
+
+void QuectelCellular::resetReplyTimers()
+{
+    memset(_replyTimers, 0, sizeof(_replyTimers));
+}
+
 void QuectelCellular::callWatchdog()
 {
     if (watchdogcallback != nullptr)
@@ -1448,5 +5134,91 @@ void QuectelCellular::callWatchdog()
 
 void QuectelCellular::setWatchdogCallback(WATCHDOG_CALLBACK_SIGNATURE)
 {
+    QT_LOCK();
     this->watchdogcallback = watchdogcallback;
 }
+
+void QuectelCellular::setMqttCallback(MQTT_CALLBACK_SIGNATURE, char* buffer, uint16_t size)
+{
+    QT_LOCK();
+    this->mqttcallback = mqttcallback;
+    _mqttMessage = buffer;
+    _mqttMessageSize = buffer != nullptr ? size : 0;
+}
+
+void QuectelCellular::setRegistrationCallback(REGISTRATION_CALLBACK_SIGNATURE)
+{
+    QT_LOCK();
+    this->registrationcallback = registrationcallback;
+}
+
+void QuectelCellular::loop()
+{
+    QT_LOCK();
+    // An I/O thread may start before begin()
+    if (_transport == nullptr)
+    {
+        return;
+    }
+    processUrcs();
+    reactivateContexts();
+    if (_mqttWanted &&
+        !_mqttConnected &&
+        (int32_t)(millis() - _mqttRetryAt) >= 0)
+    {
+        QT_DEBUG("MQTT reconnecting");
+        // Up to QT_MQTT_TIMEOUT s per result, other threads get the lock
+        // while they are awaited
+        _mqttOpening = true;
+        mqttOpen();
+        _mqttOpening = false;
+    }
+    for (uint8_t i = 0; i < 8 && _mqttReceived != 0; i++)
+    {
+        if (_mqttReceived & (1 << i))
+        {
+            _mqttReceived &= ~(1 << i);
+            readMqttMessage(i);
+        }
+    }
+    if (_socketIdle &&
+        millis() - _idleSince >= _idleTimeout)
+    {
+        QT_DEBUG("Closing idle connection");
+        closeSocket();
+        _host[0] = 0;
+    }
+    if (_registrationChanged)
+    {
+        _registrationChanged = false;
+        if (registrationcallback != nullptr)
+        {
+            registrationcallback(_networkState);
+        }
+    }
+}
+
+#ifdef M2M_QUECTEL_THREADS
+bool QuectelCellular::startIoThread(uint16_t interval)
+{
+    _ioInterval = interval;
+    return _ioThread.start(ioThreadMain, this);
+}
+
+void QuectelCellular::stopIoThread()
+{
+    _ioThread.stop();
+}
+
+void QuectelCellular::ioThreadMain(void* cellular)
+{
+    QuectelCellular* self = (QuectelCellular*)cellular;
+    while (!self->_ioThread.isStopping())
+    {
+        // The lock is only held by loop(), other threads get their turn
+        // in between
+        self->loop();
+        delay(self->_ioInterval);
+    }
+}
+#endif
@@ -15,49 +15,101 @@
 #include <SPI.h>
 #include <Ethernet.h>
 #include <M2M_Logger.h>
+#include "QuectelTrafficRecorder.h"
+#include "QuectelTransport.h"
+#include "QuectelThreads.h"
+#include "QuectelCmux.h"
+
+#define M2M_QUECTEL_VERSION "1.2.7"
 
 #define NOT_A_PIN   -1
 #define FLASHSTR	__FlashStringHelper*
-#define M2M_QUECTEL_DEBUG
-#define M2M_QUECTEL_COM_DEBUG
-
-#ifdef M2M_QUECTEL_DEBUG
-#define QT_ERROR(...) if (_logger != nullptr) _logger->error(__VA_ARGS__)
-#define QT_INFO(...) if (_logger != nullptr) _logger->info(__VA_ARGS__)
-#define QT_DEBUG(...) if (_logger != nullptr) _logger->debug(__VA_ARGS__)
-#define QT_TRACE(...) if (_logger != nullptr) _logger->trace(__VA_ARGS__)
-#define QT_TRACE_START(...) if (_logger != nullptr) _logger->traceStart(__VA_ARGS__)
-#define QT_TRACE_PART(...) if (_logger != nullptr) _logger->tracePart(__VA_ARGS__)
-#define QT_TRACE_END(...) if (_logger != nullptr) _logger->traceEnd(__VA_ARGS__)
+// Log levels
+#define QT_LOG_LEVEL_NONE   0
+#define QT_LOG_LEVEL_ERROR  1
+#define QT_LOG_LEVEL_INFO   2
+#define QT_LOG_LEVEL_DEBUG  3
+#define QT_LOG_LEVEL_TRACE  4
+
+// Compile time log levels for the library (QT_*) and the module
+// communication (QT_COM_*). Messages above the level are compiled out,
+// e.g. build with -DM2M_QUECTEL_COM_LOG_LEVEL=QT_LOG_LEVEL_ERROR to drop
+// the payload dumps from release builds.
+#ifndef M2M_QUECTEL_LOG_LEVEL
+#define M2M_QUECTEL_LOG_LEVEL       QT_LOG_LEVEL_TRACE
+#endif
+#ifndef M2M_QUECTEL_COM_LOG_LEVEL
+#define M2M_QUECTEL_COM_LOG_LEVEL   QT_LOG_LEVEL_TRACE
+#endif
+
+// Define M2M_QUECTEL_DEFERRED_LOG to store log records in a RAM ring and
+// format them when flushLog() is called, see QuectelLog.h.
+#ifdef M2M_QUECTEL_DEFERRED_LOG
+#include "QuectelLog.h"
+#define QT_LOG(method, kind, ...) do { if (_logger != nullptr) _logRing.add(QuectelLogKind::kind, __VA_ARGS__); } while (0)
+#define QT_LOG_DUMP(method, kind, buffer, size) do { if (_logger != nullptr) _logRing.addDump(QuectelLogKind::kind, buffer, size); } while (0)
+#else
+#define QT_LOG(method, kind, ...) do { if (_logger != nullptr) _logger->method(__VA_ARGS__); } while (0)
+#define QT_LOG_DUMP(method, kind, buffer, size) do { if (_logger != nullptr) _logger->method(buffer, size); } while (0)
+#endif
+#define QT_NO_LOG do { } while (0)
+
+#if M2M_QUECTEL_LOG_LEVEL >= QT_LOG_LEVEL_ERROR
+#define QT_ERROR(...) QT_LOG(error, Error, __VA_ARGS__)
+#else
+#define QT_ERROR(...) QT_NO_LOG
+#endif
+#if M2M_QUECTEL_LOG_LEVEL >= QT_LOG_LEVEL_INFO
+#define QT_INFO(...) QT_LOG(info, Info, __VA_ARGS__)
+#else
+#define QT_INFO(...) QT_NO_LOG
+#endif
+#if M2M_QUECTEL_LOG_LEVEL >= QT_LOG_LEVEL_DEBUG
+#define QT_DEBUG(...) QT_LOG(debug, Debug, __VA_ARGS__)
+#else
+#define QT_DEBUG(...) QT_NO_LOG
+#endif
+#if M2M_QUECTEL_LOG_LEVEL >= QT_LOG_LEVEL_TRACE
+#define QT_TRACE(...) QT_LOG(trace, Trace, __VA_ARGS__)
+#define QT_TRACE_START(...) QT_LOG(traceStart, TraceStart, __VA_ARGS__)
+#define QT_TRACE_PART(...) QT_LOG(tracePart, TracePart, __VA_ARGS__)
+#define QT_TRACE_END(...) QT_LOG(traceEnd, TraceEnd, __VA_ARGS__)
+#else
+#define QT_TRACE(...) QT_NO_LOG
+#define QT_TRACE_START(...) QT_NO_LOG
+#define QT_TRACE_PART(...) QT_NO_LOG
+#define QT_TRACE_END(...) QT_NO_LOG
+#endif
+
+#if M2M_QUECTEL_COM_LOG_LEVEL >= QT_LOG_LEVEL_ERROR
+#define QT_COM_ERROR(...) QT_LOG(error, Error, __VA_ARGS__)
+#else
+#define QT_COM_ERROR(...) QT_NO_LOG
+#endif
+#if M2M_QUECTEL_COM_LOG_LEVEL >= QT_LOG_LEVEL_INFO
+#define QT_COM_INFO(...) QT_LOG(info, Info, __VA_ARGS__)
 #else
-#define QT_ERROR(...)
-#define QT_INFO(...)
-#define QT_DEBUG(...)
-#define QT_TRACE(...)
-#define QT_TRACE_START(...)
-#define QT_TRACE_PART(...)
-#define QT_TRACE_END(...)
-#endif
-#ifdef M2M_QUECTEL_COM_DEBUG
-#define QT_COM_ERROR(...) if (_logger != nullptr) _logger->error(__VA_ARGS__)
-#define QT_COM_INFO(...) if (_logger != nullptr) _logger->info(__VA_ARGS__)
-#define QT_COM_DEBUG(...) if (_logger != nullptr) _logger->debug(__VA_ARGS__)
-#define QT_COM_TRACE(...) if (_logger != nullptr) _logger->trace(__VA_ARGS__)
-#define QT_COM_TRACE_START(...) if (_logger != nullptr) _logger->traceStart(__VA_ARGS__)
-#define QT_COM_TRACE_PART(...) if (_logger != nullptr) _logger->tracePart(__VA_ARGS__)
-#define QT_COM_TRACE_END(...) if (_logger != nullptr) _logger->traceEnd(__VA_ARGS__)
-#define QT_COM_TRACE_BUFFER(buffer, size) if (_logger != nullptr) _logger->tracePartHexDump(buffer, size)
-#define QT_COM_TRACE_ASCII(buffer, size) if (_logger != nullptr) _logger->tracePartAsciiDump(buffer, size)
+#define QT_COM_INFO(...) QT_NO_LOG
+#endif
+#if M2M_QUECTEL_COM_LOG_LEVEL >= QT_LOG_LEVEL_DEBUG
+#define QT_COM_DEBUG(...) QT_LOG(debug, Debug, __VA_ARGS__)
+#else
+#define QT_COM_DEBUG(...) QT_NO_LOG
+#endif
+#if M2M_QUECTEL_COM_LOG_LEVEL >= QT_LOG_LEVEL_TRACE
+#define QT_COM_TRACE(...) QT_LOG(trace, Trace, __VA_ARGS__)
+#define QT_COM_TRACE_START(...) QT_LOG(traceStart, TraceStart, __VA_ARGS__)
+#define QT_COM_TRACE_PART(...) QT_LOG(tracePart, TracePart, __VA_ARGS__)
+#define QT_COM_TRACE_END(...) QT_LOG(traceEnd, TraceEnd, __VA_ARGS__)
+#define QT_COM_TRACE_BUFFER(buffer, size) QT_LOG_DUMP(tracePartHexDump, HexDump, buffer, size)
+#define QT_COM_TRACE_ASCII(buffer, size) QT_LOG_DUMP(tracePartAsciiDump, AsciiDump, buffer, size)
 #else
-#define QT_COM_ERROR(...)
-#define QT_COM_INFO(...)
-#define QT_COM_DEBUG(...)
-#define QT_COM_TRACE(...)
-#define QT_COM_TRACE_START(...)
-#define QT_COM_TRACE_PART(...)
-#define QT_COM_TRACE_END(...)
-#define QT_COM_TRACE_BUFFER(buffer, size)
-#define QT_COM_TRACE_ASCII(buffer, size)
+#define QT_COM_TRACE(...) QT_NO_LOG
+#define QT_COM_TRACE_START(...) QT_NO_LOG
+#define QT_COM_TRACE_PART(...) QT_NO_LOG
+#define QT_COM_TRACE_END(...) QT_NO_LOG
+#define QT_COM_TRACE_BUFFER(buffer, size) QT_NO_LOG
+#define QT_COM_TRACE_ASCII(buffer, size) QT_NO_LOG
 #endif
 
 enum class QuectelModule : uint8_t
@@ -67,6 +119,29 @@ enum class QuectelModule : uint8_t
 	M95
 };
 
+// Module capabilities, QuectelModuleProfile::features
+#define QT_FEATURE_SSL          0x01    // Secure sockets, AT+QSSL*
+#define QT_FEATURE_EPS          0x02    // LTE registration, AT+CEREG
+#define QT_FEATURE_URC_PORT     0x04    // AT+QCFG="urc/port"
+#define QT_FEATURE_LEGACY_TCPIP 0x08    // M95 style AT+QIOPEN, AT+QIRD and AT+QICLOSE
+#define QT_FEATURE_RAT_CONFIG   0x10    // AT+QCFG="nwscanseq", "nwscanmode", "iotopmode" and "band"
+#define QT_FEATURE_PSM          0x20    // PSM and eDRX, AT+CPSMS and AT+CEDRXS
+#define QT_FEATURE_URC_CONFIG   0x40    // AT+QURCCFG="urcport"
+#define QT_FEATURE_MQTT         0x80    // MQTT client, AT+QMT*
+#define QT_FEATURE_SD_CARD      0x100   // "SD:" file volume
+
+// What differs between the supported modules, selected after ATI
+struct QuectelModuleProfile
+{
+    QuectelModule module;
+    const char* name;               // Model as reported by ATI
+    uint16_t features;
+    uint16_t maxSendSize;           // Bytes per +QISEND/+QSSLSEND
+    uint16_t maxReadSize;           // Bytes per +QIRD/+QSSLRECV
+    uint16_t maxFileReadSize;       // Bytes per +QFREAD
+    uint16_t openTimeout;           // Seconds to wait for a socket to open
+};
+
 enum class NetworkRegistrationState : uint8_t
 {
     NotRegistered = 0,
@@ -77,6 +152,73 @@ enum class NetworkRegistrationState : uint8_t
     Roaming
 };
 
+// Registration is tracked separately per domain, see enableRegistrationUrcs()
+enum class RegistrationDomain : uint8_t
+{
+    Circuit = 0,        // +CREG
+    Packet,             // +CGREG
+    Eps                 // +CEREG
+};
+
+#define QT_REGISTRATION_DOMAINS 3
+
+// Radio access technologies, numbered as in AT+QCFG="nwscanseq"
+enum class RadioAccess : uint8_t
+{
+    Auto = 0,
+    Gsm,
+    CatM1,
+    NbIot
+};
+
+enum class PowerState : uint8_t
+{
+    Off = 0,
+    Active,
+    Sleep,          // UART sleep, AT+QSCLK=1 with DTR high
+    Psm             // Power saving mode, status pin low
+};
+
+// Wake up pulse lengths in ms
+#define QT_PSM_EINT_PULSE       50
+#define QT_PWRKEY_WAKE_PULSE    500
+
+// AT+QCFG="nwscanmode"
+enum class ScanMode : uint8_t
+{
+    Auto = 0,
+    GsmOnly = 1,
+    LteOnly = 3,
+    Unchanged = 0xff
+};
+
+// AT+QCFG="iotopmode"
+enum class IotMode : uint8_t
+{
+    CatM1 = 0,
+    NbIot,
+    CatM1AndNbIot,
+    Unchanged = 0xff
+};
+
+// Radio settings applied by begin() before waiting for registration. The
+// module stores them in its flash, they are only written when they differ.
+// Fields left at their default values are not changed.
+struct QuectelRadioConfig
+{
+    // RATs to scan in order, e.g. "0203" for Cat M1, then NB-IoT
+    const char* scanSequence = nullptr;
+    ScanMode scanMode = ScanMode::Unchanged;
+    IotMode iotMode = IotMode::Unchanged;
+    // Band bit masks as in AT+QCFG="band", all zero leaves them unchanged
+    uint32_t gsmBands = 0;
+    uint64_t catM1Bands = 0;
+    uint64_t nbIotBands = 0;
+    // Move the RAT of the last successful registration first in the
+    // stored scan sequence, so the next boot tries it first
+    bool preferLastRat = false;
+};
+
 enum class TlsEncryption : uint8_t
 {
     None = 0,
@@ -87,63 +229,427 @@ enum class TlsEncryption : uint8_t
     All
 };
 
+enum class CommandFamily : uint8_t
+{
+    Status = 0,
+    Socket,
+    File,
+    Http
+};
+
+#define QT_COMMAND_FAMILIES     4
+#define QT_LATENCY_BUCKETS      10
+#define QT_CME_ERROR_CODES      8
+#define QT_MAX_SOCKETS          4
+#define QT_CLIENT_SOCKET        1
+#define QT_UDP_SOCKET           2
+// Datagrams queued by queueTo() take QT_UDP_HEADER_SIZE bytes of address,
+// port and length each in the setUdpQueue() buffer
+#define QT_UDP_HEADER_SIZE      8
+// Receive buffer of the TCP client, see peekSpan()
+#ifndef QT_READ_BUFFER_SIZE
+#define QT_READ_BUFFER_SIZE     256
+#endif
+// Longest host name kept for reconnects
+#define QT_HOST_LENGTH          64
+// Default ms between socket state queries made by connected()
+#define QT_CONNECTION_CHECK_INTERVAL    60000
+
+// PDP contexts 1 to QT_PDP_CONTEXTS have their state tracked
+#define QT_PDP_CONTEXTS         4
+// ms between reactivations of a lost PDP context by loop()
+#define QT_PDP_RETRY_INTERVAL   10000
+
+enum class ContextState : uint8_t
+{
+    Unknown = 0,
+    Inactive,
+    Active,
+    Lost            // Deactivated by the network, reactivated by loop()
+};
+
+enum class SocketState : uint8_t
+{
+    Closed = 0,
+    Open,
+    Closing         // Closed by the remote end or failed to open, AT+QICLOSE pending
+};
+
+struct CmeErrorCount
+{
+    uint16_t code;
+    uint16_t count;
+};
+
+struct QuectelStats
+{
+    uint32_t commandsSent;
+    uint32_t timeouts;
+    uint32_t retries;
+    uint32_t cmeErrors;
+    // The first distinct codes seen, later codes only add to cmeErrors
+    CmeErrorCount cmeErrorCodes[QT_CME_ERROR_CODES];
+    uint32_t uartBytesIn;
+    uint32_t uartBytesOut;
+    // Indexed by socket connect ID
+    uint32_t socketBytesIn[QT_MAX_SOCKETS];
+    uint32_t socketBytesOut[QT_MAX_SOCKETS];
+    // Reply latency per CommandFamily, bucket upper limits (ms) are in
+    // QuectelCellular::latencyBucketLimits, the last bucket is open ended
+    uint32_t latency[QT_COMMAND_FAMILIES][QT_LATENCY_BUCKETS];
+};
+
+// Commands answered by the module itself get a reply timeout learned per
+// CommandFamily: the smoothed reply time plus four mean deviations, as for
+// TCP (RFC 6298), once QT_REPLY_SAMPLES replies are seen. It limits the
+// wait for the first byte of the reply, a reply that has started gets the
+// full limit of the call. Commands with a longer limit than
+// QT_ADAPTIVE_TIMEOUT_LIMIT wait on the network and keep their limit.
+#define QT_REPLY_SAMPLES            8
+#define QT_REPLY_TIMEOUT_MIN        200
+#define QT_ADAPTIVE_TIMEOUT_LIMIT   10000
+// A command with no reply at all was most likely lost on the UART and is
+// sent again, after a backoff doubled for each attempt
+#define QT_RETRY_ATTEMPTS           3
+#define QT_RETRY_BACKOFF            50
+#define QT_RETRY_BACKOFF_MAX        1000
+
+struct ReplyTimer
+{
+    int32_t srtt;                   // ms, scaled by 8
+    int32_t rttvar;                 // ms, scaled by 4
+    uint16_t samples;
+};
+
+struct RetryPolicy
+{
+    uint8_t attempts;               // Including the first
+    uint16_t backoff;               // ms before the first retry
+};
+
+// SSL contexts of the module, 0 to 5, configured on first use and reused
+// by later connections with the same settings
+#define QT_SSL_CONTEXTS         6
+// Hosts with their own TLS settings, see setTlsConfig()
+#define QT_TLS_HOSTS            4
+
+// AT+QSSLCFG="seclevel"
+enum class TlsVerify : uint8_t
+{
+    None = 0,
+    Server,
+    Mutual
+};
+
+// The struct and its strings must stay valid while registered. The
+// certificates are file names in module storage, see uploadCertificate().
+struct QuectelTlsConfig
+{
+    // nullptr for the settings of hosts without their own
+    const char* host = nullptr;
+    // Used instead of the encryption passed to connect()
+    TlsEncryption version = TlsEncryption::Tls12;
+    const char* cipherSuite = "0xFFFF";
+    TlsVerify verify = TlsVerify::None;
+    const char* caCert = nullptr;
+    const char* clientCert = nullptr;
+    const char* clientKey = nullptr;
+    bool sni = true;
+    // Resume TLS sessions, where the firmware supports it
+    bool sessionReuse = true;
+};
+
+struct SslContextEntry
+{
+    const QuectelTlsConfig* config; // nullptr for the defaults
+    TlsEncryption version;
+    uint32_t lastUsed;
+    bool configured;
+};
+
+// MQTT, on the module's client QT_MQTT_CLIENT
+#define QT_MQTT_CLIENT          0
+// QoS 1 and 2 publishes awaiting their PUBACK/PUBCOMP
+#define QT_MQTT_MAX_IN_FLIGHT   4
+// Topics restored after a reconnect
+#define QT_MQTT_SUBSCRIPTIONS   4
+// Seconds to wait for the result of an MQTT command
+#define QT_MQTT_TIMEOUT         30
+// ms between reconnect attempts made by loop()
+#define QT_MQTT_RETRY_INTERVAL  10000
+
+// The strings must stay valid while connected, they are used to reconnect
+struct QuectelMqttConfig
+{
+    const char* host = nullptr;
+    uint16_t port = 1883;
+    const char* clientId = nullptr;
+    const char* userName = nullptr;
+    const char* password = nullptr;
+    // TLS with the settings of the host, as for the TCP client
+    TlsEncryption encryption = TlsEncryption::None;
+    uint8_t contextId = 1;          // PDP context
+    uint16_t keepAlive = 120;       // Seconds
+    bool cleanSession = true;
+};
+
 #define FILE_HANDLE         uint32_t
 #define NOT_A_FILE_HANDLE   0xffffffff
 
+// Volumes for the file client interface, see setVolume()
+enum class StorageVolume : uint8_t
+{
+    Ram = 0,            // Lost when the module restarts
+    Ufs,                // Module flash
+    Sd                  // SD card
+};
+
+// File metadata cache, see getFileSize()
+#define QT_FILE_CACHE_SIZE      8
+#define QT_FILE_NAME_LENGTH     32      // Including the volume
+#define QT_OPEN_FILES           4
+#define QT_FILE_SIZE_UNKNOWN    0xffffffff
+
+struct FileCacheEntry
+{
+    char name[QT_FILE_NAME_LENGTH]; // With the volume, empty for a free entry
+    bool exists;
+    uint32_t size;                  // QT_FILE_SIZE_UNKNOWN when not known
+};
+
+// Open files, to keep the metadata cache current
+struct OpenFileEntry
+{
+    FILE_HANDLE handle;             // NOT_A_FILE_HANDLE for a free entry
+    char name[QT_FILE_NAME_LENGTH];
+    uint32_t position;              // QT_FILE_SIZE_UNKNOWN when not known
+};
+
+// Result of listFiles()
+struct QuectelFileInfo
+{
+    char name[QT_FILE_NAME_LENGTH]; // Without the volume
+    uint32_t size;
+};
+
 #define WATCHDOG_CALLBACK_SIGNATURE void (*watchdogcallback)()
+#define REGISTRATION_CALLBACK_SIGNATURE void (*registrationcallback)(NetworkRegistrationState state)
+#define MQTT_CALLBACK_SIGNATURE void (*mqttcallback)(const char* topic, const uint8_t* payload, size_t length)
+
+// DNS cache, see resolve()
+#define QT_DNS_CACHE_SIZE       4
+#define QT_DNS_HOST_LENGTH      48
+// Upper limit in seconds for the TTL of cached addresses
+#define QT_DNS_MAX_TTL          86400
+#define QT_DNS_TIMEOUT          60
+
+struct DnsCacheEntry
+{
+    char host[QT_DNS_HOST_LENGTH];  // Empty for a free entry
+    IPAddress address;
+    uint32_t expires;               // millis()
+};
+
+#define QT_URC_BUFFER_SIZE      64
+// Time allowed for the rest of a partly received URC line
+#define QT_URC_LINE_TIMEOUT     10
+// Time allowed for the transport to take written data
+#define QT_UART_WRITE_TIMEOUT   1000
 
 class QuectelCellular : public Client
 {
 public:
-    QuectelCellular(int8_t powerPin = NOT_A_PIN, int8_t statusPin = NOT_A_PIN);
-    bool begin(Uart* uart);
+    // The DTR pin is needed for UART sleep, and the PSM_EINT pin wakes the
+    // module from PSM faster than the power pin
+    QuectelCellular(int8_t powerPin = NOT_A_PIN, int8_t statusPin = NOT_A_PIN,
+                    int8_t dtrPin = NOT_A_PIN, int8_t wakeupPin = NOT_A_PIN);
+    // Reuses a module that is already registered with an active PDP context,
+    // e.g. after an MCU only reset, instead of power cycling it
+    bool begin(HardwareSerial* uart, bool allowWarmStart = true);
+    // Any other transport, e.g. a QuectelPosixTransport on Linux
+    bool begin(QuectelTransport* transport, bool allowWarmStart = true);
+    bool getWarmStarted();
+    // Sets the module (AT+IPR, AT+IFC) and then the transport, false without
+    // touching the module when the transport cannot follow. Neither is
+    // stored in the module profile, so call them after every begin().
+    bool setBaudRate(uint32_t baudRate);
+    bool setFlowControl(bool enabled);
+    // GSM 07.10 multiplexing (AT+CMUX), after begin(). Commands and URCs
+    // move to channel 1, the others can be given to attach() of another
+    // QuectelCellular, so e.g. a file transfer and status polling run side
+    // by side. The TCP client and UDP belong to one object only.
+    bool startCmux(QuectelCmux* mux, uint8_t channels = QT_CMUX_CHANNELS);
+    bool stopCmux();
+    // Uses a module started by another QuectelCellular, e.g. on a CMUX
+    // channel, without power handling or network registration
+    bool attach(QuectelTransport* transport);
 
 	// Logging
 	void setLogger(Logger* logger);
+	void setTrafficRecorder(QuectelTrafficRecorder* recorder);
+	// Outputs deferred log records, see M2M_QUECTEL_DEFERRED_LOG
+	void flushLog();
 
 	bool setPower(bool state);
     bool getStatus();
 
+    // Power saving, PSM and eDRX on modules with QT_FEATURE_PSM. Times are
+    // rounded up to what the timer encodings can express, a PSM timer of 0
+    // is left to the module or network default.
+    bool setPsm(bool enable, uint32_t periodicUpdateSeconds = 0, uint32_t activeTimeSeconds = 0);
+    // The eDRX cycle is rounded down to the nearest value the RAT supports
+    bool setEdrx(bool enable, RadioAccess access = RadioAccess::CatM1, uint32_t cycleMilliseconds = 0);
+    // Lets the module sleep when idle, and enter PSM if enabled
+    bool sleep();
+    // Brings the module back from UART sleep or PSM
+    bool wake();
+    PowerState getPowerState();
+
     //SSL
     void setEncryption(TlsEncryption enc);
+    // Settings for TLS connections to config.host, replacing earlier ones
+    // for the same host
+    bool setTlsConfig(const QuectelTlsConfig& config);
+    // Uploads a certificate unless the same one is already stored, so it
+    // can be called at every start. A hash is kept in "<fileName>.sum".
+    bool uploadCertificate(const char* fileName, const uint8_t* data, uint32_t length);
+    // Forgets the configured SSL contexts, e.g. after certificates change
+    void clearSslContexts();
 
     int8_t getLastError();
 
+    // Statistics
+    QuectelStats getStats();
+    void resetStats();
+    static const uint16_t latencyBucketLimits[QT_LATENCY_BUCKETS - 1];
+
+    // Timeouts and retries
+    void setAdaptiveTimeouts(bool enable);
+    // Learned first byte timeout, 0 until QT_REPLY_SAMPLES replies are seen
+    uint16_t getReplyTimeout(CommandFamily family);
+    // Attempts 1 disables retries for the family
+    void setRetryPolicy(CommandFamily family, uint8_t attempts, uint16_t backoff = QT_RETRY_BACKOFF);
+
     bool getSimPresent();
     const char* getModuleType();
+    const QuectelModuleProfile& getModuleProfile();
 	const char* getFirmwareVersion();
     uint8_t getIMEI(char* buffer);
     uint8_t getOperatorName(char* buffer);
+    // Combined over CREG, CGREG and CEREG, served from the URC tracked
+    // state once begin() has run
     NetworkRegistrationState getNetworkRegistration();
     uint8_t getRSSI();
     uint8_t getSIMCCID(char* buffer);
     uint8_t getSIMIMSI(char* buffer);
     double getVoltage();
 
+    // Radio configuration, on modules with QT_FEATURE_RAT_CONFIG
+    void setRadioConfig(const QuectelRadioConfig& config);
+    // Current RAT and band from AT+QNWINFO
+    RadioAccess getRadioAccess();
+    uint16_t getBand();
+
+    // Sets up and activates PDP context 1
     bool connectNetwork(const char* apn, const char* userid, const char* password);
     bool disconnectNetwork();
 
+    // PDP contexts, 1 to QT_PDP_CONTEXTS, e.g. a private APN for telemetry
+    // next to a public one. The M95 has context 1 only.
+    bool configureContext(uint8_t contextId, const char* apn, const char* userId = "", const char* password = "");
+    bool activateContext(uint8_t contextId);
+    bool deactivateContext(uint8_t contextId);
+    // Tracked from +QIURC: "pdpdeact", without an AT round trip
+    ContextState getContextState(uint8_t contextId);
+    // Context of the TCP client, and of DNS, from the next connect()
+    void setSocketContext(uint8_t contextId);
+    void setHttpContext(uint8_t contextId);
+
+    // DNS, the servers are used for the context of the TCP client
+    bool setDnsServers(const char* primary, const char* secondary = nullptr);
+    // Looks up the address of a host, served from the cache while the TTL
+    // from the DNS reply lasts. Not supported on the M95.
+    bool resolve(const char* host, IPAddress& address);
+    void clearDnsCache();
+
     // HTTP client interface
     bool httpGet(const char* url, const char* fileName);
 
-    // TCP Client interface
+    // TCP Client interface. Plain TCP connections to a host name use the
+    // address from resolve(), TLS connections leave the lookup to the module
+    // since the name is needed for SNI.
     int connect(IPAddress ip, uint16_t port);
     int connect(const char *host, uint16_t port);
     int connect(IPAddress ip, uint16_t port, TlsEncryption encryption);
     int connect(const char *host, uint16_t port, TlsEncryption encryption);
+    // A send that finds the socket closed reopens it once before giving up
     size_t write(uint8_t);
     size_t write(const uint8_t *buf, size_t size);
     int available();
     int read();
     int read(uint8_t *buf, size_t size);
     int peek();
+    // Received data in place: points data at the unread bytes in the
+    // receive buffer, reading more from the module once it is empty, and
+    // returns their number. They stay valid until consume() or stop().
+    size_t peekSpan(const uint8_t*& data);
+    void consume(size_t length);
     void flush();
     void stop();
+    // Served from the locally tracked socket state, which follows the open
+    // and close results and the close URCs. The module is only asked every
+    // connection check interval, or when checkConnection() is called.
     uint8_t connected();
     operator bool()
     {
         return connected();
     }
+    bool checkConnection();
+    // 0 disables the periodic check
+    void setConnectionCheckInterval(uint32_t milliseconds);
+    // With an idle timeout, stop() leaves the socket open. A connect() to
+    // the same host and port within the timeout reuses it, otherwise loop()
+    // closes it when the timeout expires. 0, the default, closes at once.
+    void setIdleTimeout(uint32_t milliseconds);
+    // TCP keepalive for sockets opened after the call, not on the M95
+    bool setKeepAlive(bool enable, uint8_t idleMinutes = 2, uint8_t intervalSeconds = 30, uint8_t probes = 3);
+
+    // UDP, on connect ID QT_UDP_SOCKET, not on the M95. Once beginUdp() has
+    // opened the socket datagrams can be sent to and received from any
+    // address, a local port of 0 lets the module choose one.
+    bool beginUdp(uint16_t localPort = 0, uint8_t contextId = 1);
+    void endUdp();
+    bool sendTo(IPAddress ip, uint16_t port, const uint8_t* data, size_t length);
+    // Datagrams are queued until flushUdp() sends them back to back, or the
+    // queue is full. flushUdp() returns the number sent, the rest is kept.
+    // The queue is in a buffer of the caller, without one queueTo() sends
+    // at once.
+    void setUdpQueue(uint8_t* buffer, uint16_t size);
+    bool queueTo(IPAddress ip, uint16_t port, const uint8_t* data, size_t length);
+    uint8_t flushUdp();
+    // Reads the next datagram, truncated to size, and returns its length.
+    // Returns 0 without a command unless a recv URC has arrived.
+    int receiveFrom(uint8_t* buffer, size_t size, IPAddress& ip, uint16_t& port);
+
+    // MQTT client of the module, on modules with QT_FEATURE_MQTT. loop()
+    // reconnects after the connection is lost and restores the
+    // subscriptions.
+    bool mqttConnect(const QuectelMqttConfig& config);
+    void mqttDisconnect();
+    bool mqttConnected();
+    // Returns once the module has taken the message. QoS 1 and 2 messages
+    // are then tracked by message ID until acknowledged, up to
+    // QT_MQTT_MAX_IN_FLIGHT at a time.
+    bool mqttPublish(const char* topic, const uint8_t* payload, size_t length, uint8_t qos = 0, bool retain = false);
+    // The topic must stay valid, it is subscribed again after a reconnect
+    bool mqttSubscribe(const char* topic, uint8_t qos = 0);
+    bool mqttUnsubscribe(const char* topic);
+    // Publishes awaiting acknowledgement
+    uint8_t getMqttPending();
+    // Publishes that failed or were lost with the connection
+    uint32_t getMqttFailures();
+    // Waits until all publishes are acknowledged
+    bool mqttFlush(uint32_t timeout);
 
     // File client interface
     FILE_HANDLE openFile(const char* fileName, bool overWrite = false);
@@ -157,36 +663,214 @@ public:
 
     bool uploadFile(const char* fileName, const uint8_t* buffer, uint32_t length);
     bool downloadFile(const char* fileName, uint8_t* buffer, uint32_t length);
+    // Answered from the metadata cache when the size is known
     uint32_t getFileSize(const char* fileName);
+    // False when the module could not be asked, size is
+    // QT_FILE_SIZE_UNKNOWN when there is no such file
+    bool getFileSize(const char* fileName, uint32_t& size);
+    bool fileExists(const char* fileName);
     bool deleteFile(const char* fileName);
 
+    // Volume for file names without one, e.g. "UFS:data.bin". RAM: by default.
+    bool setVolume(StorageVolume volume);
+    StorageVolume getVolume();
+    // Lists the files on the current volume matching pattern. Returns the
+    // number of files, which may be more than maxFiles, or -1 on errors.
+    int16_t listFiles(QuectelFileInfo* files, uint16_t maxFiles, const char* pattern = "*");
+    bool getStorageSpace(StorageVolume volume, uint32_t& freeBytes, uint32_t& totalBytes);
+    // Forget the cached file metadata, e.g. after files were changed
+    // without the library
+    void clearFileCache();
+
     // Callbacks
     void setWatchdogCallback(WATCHDOG_CALLBACK_SIGNATURE);
+    // Called from loop() when the combined registration state changes
+    void setRegistrationCallback(REGISTRATION_CALLBACK_SIGNATURE);
+    // Called from loop() for each received MQTT message. The topic and
+    // payload are read into buffer, truncated to size bytes in all.
+    void setMqttCallback(MQTT_CALLBACK_SIGNATURE, char* buffer, uint16_t size);
+
+    // Handles unsolicited result codes and makes callbacks, call regularly
+    void loop();
+#ifdef M2M_QUECTEL_THREADS
+    // Calls loop() from an I/O thread every interval ms, so URCs are
+    // handled and the callbacks made there while other threads use the
+    // module
+    bool startIoThread(uint16_t interval = QT_IO_THREAD_INTERVAL);
+    // Waits for the I/O thread to end, not to be called from a callback
+    void stopIoThread();
+#endif
 
 private:
-    bool activateSsl();
+    int8_t activateSsl(const char* host);
+    bool configureSslContext(uint8_t context, const QuectelTlsConfig* config, TlsEncryption version);
+    const QuectelTlsConfig* findTlsConfig(const char* host);
+    bool tryWarmStart();
+    bool readModuleInfo();
+    bool hasFeature(uint16_t feature);
+    int openConnection(const char* host, uint16_t port);
+    int openSocket(const char* host, uint16_t port);
+    bool waitForOpen(uint8_t connectId);
+    bool waitForResult(const char* prefix, uint32_t timeout);
+    void waitForMqttOpen();
+    bool mqttConfigure();
+    bool mqttOpen();
+    void mqttClose();
+    bool mqttSendSubscribe(const char* topic, uint8_t qos);
+    void mqttLost();
+    bool readMqttMessage(uint8_t recvId);
+    bool reconnect();
+    void closeSocket();
+    int connectLegacy(const char* host, uint16_t port);
+    DnsCacheEntry* findDnsEntry(const char* host);
+    void addDnsEntry(const char* host, const IPAddress& address, uint32_t ttl);
+    const char* getVolumePrefix(const char* fileName);
+    bool getFullFileName(char* name, const char* fileName);
+    FileCacheEntry* findFileEntry(const char* name);
+    void setFileEntry(const char* name, bool exists, uint32_t size);
+    OpenFileEntry* findOpenFile(FILE_HANDLE fileHandle);
+    bool applyRadioConfig();
+    bool preferRadioAccess(RadioAccess access);
+    bool sameScanSequence(const char* a, const char* b);
+    bool getModuleConfig(const char* name, char* value, size_t size);
+    // effect is the trailing take effect argument, 0 = after reboot,
+    // 1 = immediately, -1 for settings that have none
+    bool setModuleConfig(const char* name, const char* value, int8_t effect = -1);
+    bool readNetworkInfo();
+    bool waitForUart(uint32_t timeout);
+    void enableUrcPort();
+    bool getContextActive(uint8_t contextId);
+    bool reactivateContext(uint8_t contextId);
+    void reactivateContexts();
+    void contextLost(uint8_t contextId);
+    void enableRegistrationUrcs();
+    void processUrcs();
+    bool handleUrc(const char* line);
+    void updateRegistration();
     bool useEncryption();
+    uint16_t fillReadBuffer();
 	bool sendAndWaitForReply(const char* command, uint16_t timeout = 1000, uint8_t lines = 1);
 	bool sendAndWaitForMultilineReply(const char* command, uint8_t lines, uint16_t timeout = 1000);
     bool sendAndWaitFor(const char* command, const char* reply, uint16_t timeout);   
 	bool sendAndCheckReply(const char* command, const char* reply, uint16_t timeout = 1000);
-    bool readReply(uint16_t timeout = 1000, uint8_t lines = 1);
+    bool readReply(uint16_t timeout = 1000, uint8_t lines = 1, uint16_t firstByteTimeout = 0);
     bool checkResult();
     void callWatchdog();
+    int uartRead();
+    size_t uartReadBytes(void* buffer, size_t length, uint16_t timeout);
+    size_t uartWrite(const uint8_t* buffer, size_t length);
+    size_t uartWriteLine(const char* command);
+    CommandFamily getCommandFamily(const char* command);
+    void recordReply(CommandFamily family, uint32_t start, bool replied);
+    bool isAdaptive(const char* command, uint16_t timeout);
+    void updateReplyTimer(CommandFamily family, uint32_t elapsed);
+    void resetReplyTimers();
 
     int8_t _powerPin;
     int8_t _statusPin;
+    int8_t _dtrPin;
+    int8_t _wakeupPin;
+    PowerState _powerState = PowerState::Off;
+    bool _psmEnabled = false;
     int8_t _lastError = 0;
-    uint32_t sslLength;
-    Uart* _uart;
+    // Unread bytes in _readBuffer, from _readStart
+    uint16_t _readLength;
+    uint16_t _readStart;
+    QuectelTransport* _transport;
+    QuectelUartTransport _uartTransport;
+    uint32_t _baudRate;
+    QuectelCmux* _cmux;
+#ifdef M2M_QUECTEL_THREADS
+    static void ioThreadMain(void* cellular);
+    bool waitForResultUnlocked(const char* prefix, uint32_t timeout);
+
+    QuectelMutex _mutex;
+    QuectelThread _ioThread;
+    uint16_t _ioInterval;
+    // The result loop() waits for with the lock released, kept by
+    // handleUrc() when the command of another thread reads it
+    char _awaitedPrefix[32] = "";
+    char _awaitedLine[QT_URC_BUFFER_SIZE];
+#endif
     Logger* _logger;
+#ifdef M2M_QUECTEL_DEFERRED_LOG
+    QuectelLogRing _logRing;
+#endif
+    QuectelTrafficRecorder* _recorder = nullptr;
     char _buffer[255];
-    char _readBuffer[255];
+    uint8_t _readBuffer[QT_READ_BUFFER_SIZE];
     char _command[32];
 	QuectelModule _moduleType;
+    const QuectelModuleProfile* _profile;
 	char _firmwareVersion[20];
     WATCHDOG_CALLBACK_SIGNATURE;
+    REGISTRATION_CALLBACK_SIGNATURE;
     TlsEncryption _encryption;
+    QuectelStats _stats;
+    bool _adaptiveTimeouts = true;
+    ReplyTimer _replyTimers[QT_COMMAND_FAMILIES];
+    RetryPolicy _retryPolicies[QT_COMMAND_FAMILIES];
+    bool _warmStarted = false;
+    QuectelRadioConfig _radioConfig;
+    RadioAccess _radioAccess = RadioAccess::Auto;
+    uint16_t _band = 0;
+    char _urcBuffer[QT_URC_BUFFER_SIZE];
+    uint8_t _urcLength = 0;
+    bool _registrationUrcs = false;
+    bool _registrationChanged = false;
+    NetworkRegistrationState _registration[QT_REGISTRATION_DOMAINS];
+    NetworkRegistrationState _networkState = NetworkRegistrationState::Unknown;
+    SocketState _socketState = SocketState::Closed;
+    // Kept for reuse and reconnects
+    char _host[QT_HOST_LENGTH] = "";
+    uint16_t _port = 0;
+    TlsEncryption _socketEncryption = TlsEncryption::None;
+    ContextState _contextStates[QT_PDP_CONTEXTS];
+    uint8_t _socketContext = 1;     // For the next connect()
+    uint8_t _openContext = 1;       // Of the client socket
+    uint8_t _udpContext = 1;
+    uint8_t _httpContext = 1;
+    uint32_t _contextRetryAt = 0;
+    const QuectelTlsConfig* _tlsConfigs[QT_TLS_HOSTS];
+    SslContextEntry _sslContexts[QT_SSL_CONTEXTS];
+    int8_t _socketSslContext = -1;  // Bound to the client socket
+    int8_t _mqttSslContext = -1;    // Bound to the MQTT client
+    bool _socketIdle = false;
+    uint32_t _idleSince = 0;
+    uint32_t _idleTimeout = 0;
+    uint32_t _lastConnectionCheck = 0;
+    uint32_t _connectionCheckInterval = QT_CONNECTION_CHECK_INTERVAL;
+    bool _udpOpen = false;
+    bool _udpPending = false;
+    uint8_t* _udpQueue = nullptr;
+    uint16_t _udpQueueSize = 0;
+    uint16_t _udpQueueLength = 0;
+    QuectelMqttConfig _mqttConfig;
+    bool _mqttWanted = false;
+    bool _mqttConfigured = false;
+    bool _mqttConnected = false;
+    bool _mqttOpening = false;      // loop() reconnecting
+    uint32_t _mqttRetryAt = 0;
+    uint16_t _mqttNextId = 1;
+    uint16_t _mqttInFlight[QT_MQTT_MAX_IN_FLIGHT] = {};   // 0 for a free slot
+    uint32_t _mqttFailures = 0;
+    uint8_t _mqttReceived = 0;     // Bit per module receive buffer
+    const char* _mqttTopics[QT_MQTT_SUBSCRIPTIONS] = {};
+    uint8_t _mqttTopicQos[QT_MQTT_SUBSCRIPTIONS] = {};
+    char* _mqttMessage = nullptr;
+    uint16_t _mqttMessageSize = 0;
+    MQTT_CALLBACK_SIGNATURE;
+    DnsCacheEntry _dnsCache[QT_DNS_CACHE_SIZE];
+    // Lookup in progress, from the +QIURC: "dnsgip" URCs
+    int16_t _dnsError = -1;
+    uint8_t _dnsPending = 0;
+    uint32_t _dnsTtl = 0;
+    bool _dnsResolved = false;
+    IPAddress _dnsAddress;
+    StorageVolume _volume = StorageVolume::Ram;
+    FileCacheEntry _fileCache[QT_FILE_CACHE_SIZE];
+    uint8_t _fileCacheNext = 0;
+    OpenFileEntry _openFiles[QT_OPEN_FILES];
 
     boolean httpsredirect;
     const char* _useragent = "PP";
@@ -0,0 +1,595 @@
+//---------------------------------------------------------------------------------------------
+//
+// GSM 07.10 multiplexer for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "QuectelCmux.h"
+
+// Address byte: DLCI, C/R and EA
+#define ADDRESS_CR          0x02
+#define ADDRESS_EA          0x01
+// Modem status signals: EA, RTC, RTR and DV, and FC to stop the sender
+#define SIGNALS_READY       0x8d
+#define SIGNALS_FC          0x02
+// A channel is stopped with room left for two more frames, the module may
+// have sent one already, and restarted once half of that is read. The gap
+// lets at least a frame through per stop and start.
+#define THROTTLE_LEVEL      (QT_CMUX_BUFFER_SIZE - 2 * QT_CMUX_FRAME_SIZE)
+#define RESUME_LEVEL        (THROTTLE_LEVEL / 2)
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Channel
+//
+QuectelCmuxChannel::QuectelCmuxChannel()
+{
+    _mux = nullptr;
+    _dlci = 0;
+}
+
+bool QuectelCmuxChannel::begin(uint32_t)
+{
+    return isOpen();
+}
+
+int QuectelCmuxChannel::available()
+{
+    return _mux->available(_dlci);
+}
+
+size_t QuectelCmuxChannel::read(uint8_t* buffer, size_t size)
+{
+    return _mux->read(_dlci, buffer, size);
+}
+
+size_t QuectelCmuxChannel::write(const uint8_t* buffer, size_t size)
+{
+    return _mux->write(_dlci, buffer, size);
+}
+
+bool QuectelCmuxChannel::waitForData(uint16_t timeout)
+{
+    uint32_t start = millis();
+    while (available() <= 0)
+    {
+        if (millis() - start >= timeout)
+        {
+            return false;
+        }
+        // Without the multiplexer lock, the frame may be for another
+        // channel and be read by it
+        _mux->_transport->waitForData(1);
+    }
+    return true;
+}
+
+uint8_t QuectelCmuxChannel::getDlci()
+{
+    return _dlci;
+}
+
+bool QuectelCmuxChannel::isOpen()
+{
+    return _mux != nullptr && _mux->isActive() && _mux->_states[_dlci - 1].open;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Multiplexer
+//
+QuectelCmux::QuectelCmux()
+{
+    _transport = nullptr;
+    _count = 0;
+    _active = false;
+    _stopped = false;
+    _acknowledged = 0;
+    _rejected = 0;
+    _closed = false;
+    _frameErrors = 0;
+    _overruns = 0;
+    _state = FrameState::Flag;
+    _headerLength = 0;
+    _length = 0;
+    _index = 0;
+    for (uint8_t i = 0; i < QT_CMUX_CHANNELS; i++)
+    {
+        _channels[i]._mux = this;
+        _channels[i]._dlci = i + 1;
+        _states[i].open = false;
+    }
+}
+
+bool QuectelCmux::begin(QuectelTransport* transport, uint8_t count)
+{
+    QT_LOCK();
+    _transport = transport;
+    _count = count < QT_CMUX_CHANNELS ? count : QT_CMUX_CHANNELS;
+    _active = true;
+    _stopped = false;
+    _state = FrameState::Flag;
+    for (uint8_t i = 0; i < QT_CMUX_CHANNELS; i++)
+    {
+        ChannelState& state = _states[i];
+        state.open = false;
+        state.stopped = false;
+        state.throttled = false;
+        state.head = 0;
+        state.length = 0;
+    }
+    // The control channel first, then the ports
+    for (uint8_t dlci = 0; dlci <= _count; dlci++)
+    {
+        if (!openChannel(dlci))
+        {
+            _active = false;
+            return false;
+        }
+    }
+    return true;
+}
+
+void QuectelCmux::end()
+{
+    QT_LOCK();
+    if (!_active)
+    {
+        return;
+    }
+    // CLD closes all channels at once
+    _closed = false;
+    sendControl(QT_CMUX_CLD, nullptr, 0);
+    uint32_t start = millis();
+    while (!_closed && millis() - start < QT_CMUX_TIMEOUT)
+    {
+        if (_transport->waitForData(10))
+        {
+            poll();
+        }
+    }
+    _active = false;
+    for (uint8_t i = 0; i < QT_CMUX_CHANNELS; i++)
+    {
+        _states[i].open = false;
+    }
+}
+
+void QuectelCmux::close(QuectelTransport* transport)
+{
+    // A UIH frame with CLD, then DISC, both on DLCI 0
+    uint8_t frames[] =
+    {
+        QT_CMUX_FLAG, ADDRESS_CR | ADDRESS_EA, QT_CMUX_UIH, (2 << 1) | 1,
+        QT_CMUX_CLD | QT_CMUX_CR, 1, 0, QT_CMUX_FLAG,
+        QT_CMUX_FLAG, ADDRESS_CR | ADDRESS_EA, QT_CMUX_DISC | QT_CMUX_PF, 1, 0, QT_CMUX_FLAG
+    };
+    frames[6] = fcs(frames + 1, 3);
+    frames[12] = fcs(frames + 9, 3);
+    writeAll(transport, frames, sizeof(frames));
+}
+
+bool QuectelCmux::isActive()
+{
+    return _active;
+}
+
+QuectelCmuxChannel* QuectelCmux::getChannel(uint8_t dlci)
+{
+    if (dlci < 1 || dlci > QT_CMUX_CHANNELS)
+    {
+        return nullptr;
+    }
+    return &_channels[dlci - 1];
+}
+
+QuectelTransport* QuectelCmux::getTransport()
+{
+    return _transport;
+}
+
+void QuectelCmux::poll()
+{
+    QT_LOCK();
+    if (!_active)
+    {
+        return;
+    }
+    uint8_t data[64];
+    size_t length;
+    while ((length = _transport->read(data, sizeof(data))) > 0)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            receive(data[i]);
+        }
+    }
+}
+
+uint32_t QuectelCmux::getFrameErrors()
+{
+    return _frameErrors;
+}
+
+uint32_t QuectelCmux::getOverruns()
+{
+    return _overruns;
+}
+
+bool QuectelCmux::openChannel(uint8_t dlci)
+{
+    // SABM, answered with UA, or DM when refused
+    uint32_t bit = 1UL << dlci;
+    _acknowledged &= ~bit;
+    _rejected &= ~bit;
+    if (!sendFrame(dlci, QT_CMUX_SABM | QT_CMUX_PF, nullptr, 0))
+    {
+        return false;
+    }
+    uint32_t start = millis();
+    while (!(_acknowledged & bit))
+    {
+        if ((_rejected & bit) ||
+            millis() - start >= QT_CMUX_TIMEOUT)
+        {
+            return false;
+        }
+        if (_transport->waitForData(10))
+        {
+            poll();
+        }
+    }
+    if (dlci > 0)
+    {
+        _states[dlci - 1].open = true;
+        // Ready to receive, the module may wait for it before sending
+        sendModemStatus(dlci, false);
+    }
+    return true;
+}
+
+int QuectelCmux::available(uint8_t dlci)
+{
+    QT_LOCK();
+    poll();
+    return _states[dlci - 1].length;
+}
+
+size_t QuectelCmux::read(uint8_t dlci, uint8_t* buffer, size_t size)
+{
+    QT_LOCK();
+    ChannelState& state = _states[dlci - 1];
+    if (state.length == 0)
+    {
+        poll();
+    }
+    size_t length = 0;
+    while (length < size && state.length > 0)
+    {
+        buffer[length++] = state.buffer[state.head];
+        state.head = (state.head + 1) % QT_CMUX_BUFFER_SIZE;
+        state.length--;
+    }
+    if (state.throttled &&
+        state.length <= RESUME_LEVEL)
+    {
+        state.throttled = false;
+        sendModemStatus(dlci, false);
+    }
+    return length;
+}
+
+size_t QuectelCmux::write(uint8_t dlci, const uint8_t* buffer, size_t size)
+{
+    QT_LOCK();
+    ChannelState& state = _states[dlci - 1];
+    if (!_active || !state.open)
+    {
+        return 0;
+    }
+    // Nothing is taken while the module has stopped us, the caller retries
+    if (_stopped || state.stopped)
+    {
+        poll();
+        if (_stopped || state.stopped)
+        {
+            return 0;
+        }
+    }
+    size_t sent = 0;
+    while (sent < size)
+    {
+        uint16_t length = size - sent > QT_CMUX_FRAME_SIZE ? QT_CMUX_FRAME_SIZE : size - sent;
+        if (!sendFrame(dlci, QT_CMUX_UIH, buffer + sent, length))
+        {
+            break;
+        }
+        sent += length;
+    }
+    return sent;
+}
+
+bool QuectelCmux::sendFrame(uint8_t dlci, uint8_t control, const uint8_t* data, uint16_t length, bool command)
+{
+    // F9 address control length(1-2) information FCS F9
+    uint8_t frame[QT_CMUX_FRAME_SIZE + 7];
+    uint16_t index = 0;
+    frame[index++] = QT_CMUX_FLAG;
+    frame[index++] = (dlci << 2) | (command ? ADDRESS_CR : 0) | ADDRESS_EA;
+    frame[index++] = control;
+    if (length <= 127)
+    {
+        frame[index++] = (length << 1) | 1;
+    }
+    else
+    {
+        frame[index++] = (length << 1) & 0xfe;
+        frame[index++] = length >> 7;
+    }
+    uint8_t check = fcs(frame + 1, index - 1);
+    if (length > 0)
+    {
+        memcpy(frame + index, data, length);
+        index += length;
+    }
+    frame[index++] = check;
+    frame[index++] = QT_CMUX_FLAG;
+    return writeAll(_transport, frame, index);
+}
+
+bool QuectelCmux::sendControl(uint8_t type, const uint8_t* data, uint8_t length, bool command)
+{
+    // Type, length and value in a UIH frame on DLCI 0
+    uint8_t message[8];
+    message[0] = type | (command ? QT_CMUX_CR : 0);
+    message[1] = (length << 1) | 1;
+    if (length > 0)
+    {
+        memcpy(message + 2, data, length);
+    }
+    return sendFrame(0, QT_CMUX_UIH, message, length + 2);
+}
+
+bool QuectelCmux::sendModemStatus(uint8_t dlci, bool stop)
+{
+    uint8_t value[2];
+    value[0] = (dlci << 2) | ADDRESS_CR | ADDRESS_EA;
+    value[1] = SIGNALS_READY | (stop ? SIGNALS_FC : 0);
+    return sendControl(QT_CMUX_MSC, value, sizeof(value));
+}
+
+bool QuectelCmux::writeAll(QuectelTransport* transport, const uint8_t* data, size_t length)
+{
+    size_t written = 0;
+    uint32_t start = millis();
+    while (written < length)
+    {
+        size_t result = transport->write(data + written, length - written);
+        if (result > 0)
+        {
+            written += result;
+        }
+        else if (millis() - start >= QT_CMUX_TIMEOUT)
+        {
+            return false;
+        }
+        else
+        {
+            delay(1);
+        }
+    }
+    return true;
+}
+
+void QuectelCmux::receive(uint8_t value)
+{
+    switch (_state)
+    {
+    case FrameState::Flag:
+        if (value == QT_CMUX_FLAG)
+        {
+            _state = FrameState::Address;
+        }
+        break;
+    case FrameState::Address:
+        // Repeated flags between frames
+        if (value == QT_CMUX_FLAG)
+        {
+            break;
+        }
+        _header[0] = value;
+        _headerLength = 1;
+        _state = FrameState::Control;
+        break;
+    case FrameState::Control:
+        _header[_headerLength++] = value;
+        _state = FrameState::Length;
+        break;
+    case FrameState::Length:
+    case FrameState::Length2:
+        _header[_headerLength++] = value;
+        if (_state == FrameState::Length)
+        {
+            _length = value >> 1;
+        }
+        else
+        {
+            _length |= (uint16_t)value << 7;
+        }
+        if (_state == FrameState::Length && !(value & 1))
+        {
+            _state = FrameState::Length2;
+            break;
+        }
+        _index = 0;
+        _state = _length > 0 ? FrameState::Data : FrameState::Fcs;
+        break;
+    case FrameState::Data:
+        // Longer frames than N1 are received to the end and dropped
+        if (_index < sizeof(_frame))
+        {
+            _frame[_index] = value;
+        }
+        if (++_index == _length)
+        {
+            _state = FrameState::Fcs;
+        }
+        break;
+    case FrameState::Fcs:
+        if (value != fcs(_header, _headerLength) ||
+            _length > sizeof(_frame))
+        {
+            _frameErrors++;
+            _state = FrameState::Flag;
+            break;
+        }
+        _state = FrameState::End;
+        break;
+    case FrameState::End:
+        if (value != QT_CMUX_FLAG)
+        {
+            _frameErrors++;
+            _state = FrameState::Flag;
+            break;
+        }
+        // The closing flag may also open the next frame
+        _state = FrameState::Address;
+        handleFrame();
+        break;
+    }
+}
+
+void QuectelCmux::handleFrame()
+{
+    uint8_t dlci = _header[0] >> 2;
+    uint8_t control = _header[1] & ~QT_CMUX_PF;
+    uint32_t bit = dlci < 32 ? 1UL << dlci : 0;
+    bool port = dlci >= 1 && dlci <= _count;
+    switch (control)
+    {
+    case QT_CMUX_UA:
+        _acknowledged |= bit;
+        break;
+    case QT_CMUX_DM:
+        _rejected |= bit;
+        if (port)
+        {
+            _states[dlci - 1].open = false;
+        }
+        break;
+    case QT_CMUX_DISC:
+        sendFrame(dlci, QT_CMUX_UA | QT_CMUX_PF, nullptr, 0, false);
+        if (dlci == 0)
+        {
+            _active = false;
+        }
+        else if (port)
+        {
+            _states[dlci - 1].open = false;
+        }
+        break;
+    case QT_CMUX_UIH:
+    case QT_CMUX_UI:
+        if (dlci == 0)
+        {
+            handleControl();
+        }
+        else if (port)
+        {
+            store(dlci, _frame, _length);
+        }
+        break;
+    }
+}
+
+void QuectelCmux::handleControl()
+{
+    // One message per frame: type, length and value
+    if (_length < 2)
+    {
+        return;
+    }
+    uint8_t type = _frame[0] & ~QT_CMUX_CR;
+    bool command = _frame[0] & QT_CMUX_CR;
+    uint8_t length = _frame[1] >> 1;
+    const uint8_t* value = _frame + 2;
+    if (length > _length - 2)
+    {
+        _frameErrors++;
+        return;
+    }
+    switch (type)
+    {
+    case QT_CMUX_CLD:
+        if (command)
+        {
+            sendControl(QT_CMUX_CLD, nullptr, 0, false);
+            _active = false;
+        }
+        _closed = true;
+        break;
+    case QT_CMUX_MSC:
+        if (command)
+        {
+            uint8_t dlci = value[0] >> 2;
+            if (length >= 2 &&
+                dlci >= 1 && dlci <= _count)
+            {
+                _states[dlci - 1].stopped = value[1] & SIGNALS_FC;
+            }
+            // Answered with the same value
+            sendControl(QT_CMUX_MSC, value, length > 6 ? 6 : length, false);
+        }
+        break;
+    case QT_CMUX_FCON:
+    case QT_CMUX_FCOFF:
+        if (command)
+        {
+            _stopped = type == QT_CMUX_FCOFF;
+            sendControl(type, nullptr, 0, false);
+        }
+        break;
+    }
+}
+
+void QuectelCmux::store(uint8_t dlci, const uint8_t* data, uint16_t length)
+{
+    ChannelState& state = _states[dlci - 1];
+    for (uint16_t i = 0; i < length; i++)
+    {
+        if (state.length == QT_CMUX_BUFFER_SIZE)
+        {
+            // Overrun, like a UART
+            _overruns += length - i;
+            break;
+        }
+        state.buffer[(state.head + state.length) % QT_CMUX_BUFFER_SIZE] = data[i];
+        state.length++;
+    }
+    if (!state.throttled &&
+        state.length > THROTTLE_LEVEL)
+    {
+        state.throttled = true;
+        sendModemStatus(dlci, true);
+    }
+}
+
+uint8_t QuectelCmux::fcs(const uint8_t* data, uint8_t length)
+{
+    // CRC-8, polynomial x^8 + x^2 + x + 1, reversed
+    uint8_t crc = 0xff;
+    for (uint8_t i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xe0 : crc >> 1;
+        }
+    }
+    return 0xff - crc;
+}
@@ -0,0 +1,184 @@
+//---------------------------------------------------------------------------------------------
+//
+// GSM 07.10 multiplexer for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+//---------------------------------------------------------------------------------------------
+//
+// Basic mode framing, as started by AT+CMUX=0. Each frame is
+//
+//   F9 <address> <control> <length> <information> <FCS> F9
+//
+// where the address holds the DLCI, the length is one byte for up to 127
+// information bytes (two bytes above that), and the FCS is the 07.10 CRC-8
+// over address, control and length. DLCI 0 carries the multiplexer
+// control messages, DLCI 1 and up are virtual serial ports, each with its
+// own AT command interpreter in the module.
+//
+// QuectelCmux runs on the module's transport and hands out a
+// QuectelCmuxChannel per DLCI, itself a QuectelTransport, so a
+// QuectelCellular can run on each of them. Received frames are sorted into
+// per channel buffers by whichever channel is read first. A channel whose
+// buffer runs low on space is stopped with a modem status command (the FC
+// bit) until it has been read down well below that level.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __QuectelCmux_h__
+#define __QuectelCmux_h__
+#include <Arduino.h>
+#include "QuectelTransport.h"
+#include "QuectelThreads.h"
+
+// Virtual ports, DLCI 1 up to this
+#ifndef QT_CMUX_CHANNELS
+#define QT_CMUX_CHANNELS        2
+#endif
+// N1, the most information bytes in one frame
+#ifndef QT_CMUX_FRAME_SIZE
+#define QT_CMUX_FRAME_SIZE      127
+#endif
+// Receive buffer of each channel
+#ifndef QT_CMUX_BUFFER_SIZE
+#define QT_CMUX_BUFFER_SIZE     512
+#endif
+// Time to wait for the module to answer a SABM or CLD, ms
+#define QT_CMUX_TIMEOUT         1000
+
+// Frame types, without the P/F bit
+#define QT_CMUX_SABM            0x2f
+#define QT_CMUX_UA              0x63
+#define QT_CMUX_DM              0x0f
+#define QT_CMUX_DISC            0x43
+#define QT_CMUX_UIH             0xef
+#define QT_CMUX_UI              0x03
+#define QT_CMUX_PF              0x10
+#define QT_CMUX_FLAG            0xf9
+
+// Control channel message types, with EA set and C/R clear
+#define QT_CMUX_CLD             0xc1
+#define QT_CMUX_MSC             0xe1
+#define QT_CMUX_FCON            0xa1
+#define QT_CMUX_FCOFF           0x61
+#define QT_CMUX_CR              0x02
+
+class QuectelCmux;
+
+class QuectelCmuxChannel : public QuectelTransport
+{
+public:
+    QuectelCmuxChannel();
+
+    // The channel is opened by QuectelCmux::begin(), it runs at the baud
+    // rate of the module transport
+    bool begin(uint32_t);
+    int available();
+    size_t read(uint8_t* buffer, size_t size);
+    size_t write(const uint8_t* buffer, size_t size);
+    bool waitForData(uint16_t timeout);
+
+    uint8_t getDlci();
+    bool isOpen();
+
+private:
+    friend class QuectelCmux;
+
+    QuectelCmux* _mux;
+    uint8_t _dlci;
+};
+
+class QuectelCmux
+{
+public:
+    QuectelCmux();
+
+    // Opens the control channel and channels 1 to count on a module that
+    // has accepted AT+CMUX, see QuectelCellular::startCmux()
+    bool begin(QuectelTransport* transport, uint8_t count = QT_CMUX_CHANNELS);
+    // Closes the multiplexer, the module goes back to AT commands on the
+    // transport
+    void end();
+    // Sends CLD and DISC on DLCI 0 without waiting for an answer, for a
+    // module that may have been left multiplexing, e.g. by a failed begin()
+    // or an MCU reset. A module taking AT commands sees one bad command.
+    static void close(QuectelTransport* transport);
+    bool isActive();
+
+    // DLCI 1 to QT_CMUX_CHANNELS
+    QuectelCmuxChannel* getChannel(uint8_t dlci);
+    QuectelTransport* getTransport();
+
+    // Reads the transport and sorts the received frames into the channels,
+    // called by the channels
+    void poll();
+    // Frames dropped for a bad FCS or length, and bytes lost to full
+    // channel buffers
+    uint32_t getFrameErrors();
+    uint32_t getOverruns();
+
+private:
+    friend class QuectelCmuxChannel;
+
+    enum class FrameState : uint8_t
+    {
+        Flag = 0,
+        Address,
+        Control,
+        Length,
+        Length2,
+        Data,
+        Fcs,
+        End
+    };
+
+    struct ChannelState
+    {
+        bool open;
+        bool stopped;               // By the module, FC bit or FCoff
+        bool throttled;             // We asked the module to stop
+        uint16_t head;
+        uint16_t length;
+        uint8_t buffer[QT_CMUX_BUFFER_SIZE];
+    };
+
+    bool openChannel(uint8_t dlci);
+    int available(uint8_t dlci);
+    size_t read(uint8_t dlci, uint8_t* buffer, size_t size);
+    size_t write(uint8_t dlci, const uint8_t* buffer, size_t size);
+    bool sendFrame(uint8_t dlci, uint8_t control, const uint8_t* data, uint16_t length, bool command = true);
+    bool sendControl(uint8_t type, const uint8_t* data, uint8_t length, bool command = true);
+    bool sendModemStatus(uint8_t dlci, bool stop);
+    static bool writeAll(QuectelTransport* transport, const uint8_t* data, size_t length);
+    void receive(uint8_t value);
+    void handleFrame();
+    void handleControl();
+    void store(uint8_t dlci, const uint8_t* data, uint16_t length);
+    static uint8_t fcs(const uint8_t* data, uint8_t length);
+
+    QuectelTransport* _transport;
+    QuectelCmuxChannel _channels[QT_CMUX_CHANNELS];
+    ChannelState _states[QT_CMUX_CHANNELS];
+    uint8_t _count;
+    bool _active;
+    bool _stopped;                  // FCoff, all channels
+    uint32_t _acknowledged;         // UA per DLCI
+    uint32_t _rejected;             // DM per DLCI
+    bool _closed;                   // CLD answered
+    uint32_t _frameErrors;
+    uint32_t _overruns;
+
+    FrameState _state;
+    uint8_t _header[4];             // Address, control and length, for the FCS
+    uint8_t _headerLength;
+    uint16_t _length;
+    uint16_t _index;
+    uint8_t _frame[QT_CMUX_FRAME_SIZE];
+#ifdef M2M_QUECTEL_THREADS
+    QuectelMutex _mutex;
+#endif
+};
+
+#endif
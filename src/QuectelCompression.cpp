@@ -0,0 +1,357 @@
+//---------------------------------------------------------------------------------------------
+//
+// Streaming LZSS compression for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "QuectelCompression.h"
+
+#define WINDOW_MASK     (QT_LZ_WINDOW_SIZE - 1)
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Output
+//
+QuectelCodecOutput::QuectelCodecOutput()
+{
+    _sink = nullptr;
+    _buffer = nullptr;
+    _bufferSize = 0;
+    QuectelCodecOutput::reset();
+}
+
+void QuectelCodecOutput::begin(Print* sink)
+{
+    _buffer = nullptr;
+    _bufferSize = 0;
+    _sink = sink;
+    reset();
+}
+
+void QuectelCodecOutput::begin(uint8_t* buffer, size_t size)
+{
+    _sink = nullptr;
+    _buffer = buffer;
+    _bufferSize = size;
+    reset();
+}
+
+uint32_t QuectelCodecOutput::getInputBytes()
+{
+    return _inputBytes;
+}
+
+uint32_t QuectelCodecOutput::getOutputBytes()
+{
+    return _outputBytes;
+}
+
+bool QuectelCodecOutput::isOverflowed()
+{
+    return _overflowed;
+}
+
+void QuectelCodecOutput::reset()
+{
+    _inputBytes = 0;
+    _outputBytes = 0;
+    _overflowed = false;
+    _outputLength = 0;
+}
+
+void QuectelCodecOutput::put(uint8_t value)
+{
+    if (_buffer)
+    {
+        if (_outputBytes < _bufferSize)
+        {
+            _buffer[_outputBytes] = value;
+        }
+        else
+        {
+            _overflowed = true;
+        }
+    }
+    else if (_sink)
+    {
+        _output[_outputLength++] = value;
+        if (_outputLength == sizeof(_output))
+        {
+            flushOutput();
+        }
+    }
+    // Without a sink or buffer the output is only counted
+    _outputBytes++;
+}
+
+void QuectelCodecOutput::flushOutput()
+{
+    if (_sink && _outputLength > 0)
+    {
+        if (_sink->write(_output, _outputLength) != _outputLength)
+        {
+            _overflowed = true;
+        }
+    }
+    _outputLength = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Compressor
+//
+QuectelCompressor::QuectelCompressor()
+{
+    QuectelCompressor::reset();
+}
+
+void QuectelCompressor::reset()
+{
+    QuectelCodecOutput::reset();
+    _windowHead = 0;
+    _windowLength = 0;
+    _lookaheadLength = 0;
+    _bits = 0;
+    _bitCount = 0;
+}
+
+size_t QuectelCompressor::write(uint8_t value)
+{
+    _lookahead[_lookaheadLength++] = value;
+    _inputBytes++;
+    if (_lookaheadLength == QT_LZ_LOOKAHEAD_SIZE)
+    {
+        encodeStep();
+    }
+    return 1;
+}
+
+size_t QuectelCompressor::write(const uint8_t* buffer, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        write(buffer[i]);
+    }
+    return size;
+}
+
+uint32_t QuectelCompressor::finish()
+{
+    while (_lookaheadLength > 0)
+    {
+        encodeStep();
+    }
+    if (_bitCount > 0)
+    {
+        put(_bits << (8 - _bitCount));
+        _bits = 0;
+        _bitCount = 0;
+    }
+    flushOutput();
+    return _outputBytes;
+}
+
+float QuectelCompressor::getRatio()
+{
+    if (_outputBytes == 0)
+    {
+        return 0;
+    }
+    return (float)_inputBytes / _outputBytes;
+}
+
+// Position 0 is the oldest byte in the window, the lookahead follows the
+// window so a match may run on into it, e.g. a run of one byte
+uint8_t QuectelCompressor::historyAt(uint16_t position)
+{
+    if (position < _windowLength)
+    {
+        return _window[(_windowHead - _windowLength + position) & WINDOW_MASK];
+    }
+    return _lookahead[position - _windowLength];
+}
+
+void QuectelCompressor::encodeStep()
+{
+    // Longest match, the nearest one of equal length
+    uint8_t count = 0;
+    uint16_t offset = 0;
+    for (uint16_t candidate = 1; candidate <= _windowLength; candidate++)
+    {
+        uint16_t start = _windowLength - candidate;
+        uint8_t length = 0;
+        while (length < _lookaheadLength && historyAt(start + length) == _lookahead[length])
+        {
+            length++;
+        }
+        if (length > count)
+        {
+            count = length;
+            offset = candidate;
+            if (count == _lookaheadLength)
+            {
+                break;
+            }
+        }
+    }
+
+    if (count >= QT_LZ_MIN_MATCH)
+    {
+        putBits(0, 1);
+        putBits(offset - 1, QT_LZ_WINDOW_BITS);
+        putBits(count - 1, QT_LZ_COUNT_BITS);
+    }
+    else
+    {
+        count = 1;
+        putBits(1, 1);
+        putBits(_lookahead[0], 8);
+    }
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        _window[_windowHead] = _lookahead[i];
+        _windowHead = (_windowHead + 1) & WINDOW_MASK;
+        if (_windowLength < QT_LZ_WINDOW_SIZE)
+        {
+            _windowLength++;
+        }
+    }
+    _lookaheadLength -= count;
+    memmove(_lookahead, _lookahead + count, _lookaheadLength);
+}
+
+void QuectelCompressor::putBits(uint16_t value, uint8_t count)
+{
+    while (count > 0)
+    {
+        count--;
+        _bits = (_bits << 1) | ((value >> count) & 1);
+        if (++_bitCount == 8)
+        {
+            put(_bits);
+            _bits = 0;
+            _bitCount = 0;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Decompressor
+//
+QuectelDecompressor::QuectelDecompressor()
+{
+    QuectelDecompressor::reset();
+}
+
+void QuectelDecompressor::reset()
+{
+    QuectelCodecOutput::reset();
+    memset(_window, 0, sizeof(_window));
+    _windowHead = 0;
+    _state = State::Tag;
+    _offset = 0;
+    _bits = 0;
+    _bitCount = 0;
+}
+
+size_t QuectelDecompressor::write(uint8_t value)
+{
+    _inputBytes++;
+    _bits = (_bits << 8) | value;
+    _bitCount += 8;
+
+    // Each state takes a field of the stream, padding at the end is too
+    // short for a copy and is dropped
+    while (true)
+    {
+        uint8_t needed;
+        switch (_state)
+        {
+        case State::Tag:
+            needed = 1;
+            break;
+        case State::Literal:
+            needed = 8;
+            break;
+        case State::Offset:
+            needed = QT_LZ_WINDOW_BITS;
+            break;
+        default:
+            needed = QT_LZ_COUNT_BITS;
+            break;
+        }
+        if (_bitCount < needed)
+        {
+            return 1;
+        }
+        _bitCount -= needed;
+        uint16_t field = (_bits >> _bitCount) & ((1 << needed) - 1);
+
+        switch (_state)
+        {
+        case State::Tag:
+            _state = field ? State::Literal : State::Offset;
+            break;
+        case State::Literal:
+            emit(field);
+            _state = State::Tag;
+            break;
+        case State::Offset:
+            _offset = field + 1;
+            _state = State::Count;
+            break;
+        case State::Count:
+            for (uint16_t i = 0; i <= field; i++)
+            {
+                emit(_window[(_windowHead - _offset) & WINDOW_MASK]);
+            }
+            _state = State::Tag;
+            break;
+        }
+    }
+}
+
+size_t QuectelDecompressor::write(const uint8_t* buffer, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        write(buffer[i]);
+    }
+    return size;
+}
+
+void QuectelDecompressor::finish()
+{
+    flushOutput();
+}
+
+bool QuectelDecompressor::decompressFile(QuectelCellular* cellular, FILE_HANDLE fileHandle, uint32_t length)
+{
+    uint8_t chunk[QT_LZ_OUTPUT_SIZE];
+    while (length > 0)
+    {
+        uint32_t size = length < sizeof(chunk) ? length : sizeof(chunk);
+        if (!cellular->readFile(fileHandle, chunk, size))
+        {
+            return false;
+        }
+        write(chunk, size);
+        length -= size;
+    }
+    finish();
+    return !isOverflowed();
+}
+
+void QuectelDecompressor::emit(uint8_t value)
+{
+    put(value);
+    _window[_windowHead] = value;
+    _windowHead = (_windowHead + 1) & WINDOW_MASK;
+}
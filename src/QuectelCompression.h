@@ -0,0 +1,145 @@
+//---------------------------------------------------------------------------------------------
+//
+// Streaming LZSS compression for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+//---------------------------------------------------------------------------------------------
+//
+// The bit stream is the one used by heatshrink with a window of
+// 2^QT_LZ_WINDOW_BITS and a lookahead of 2^QT_LZ_COUNT_BITS bytes (by
+// default "heatshrink -w 8 -l 4"), most significant bit first:
+//
+//   1 <byte>                   literal, 8 bits
+//   0 <offset - 1> <count - 1> copy count bytes from offset bytes back
+//
+// The last byte is padded with zero bits. All state is in fixed buffers
+// in the objects, nothing is allocated.
+//
+// Both classes write their output to a Print, e.g. QuectelCellular to send
+// it on the socket, or to a caller supplied buffer, e.g. for uploadFile().
+// Output is collected and written QT_LZ_OUTPUT_SIZE bytes at a time, so a
+// socket gets few large +QISEND commands.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __QuectelCompression_h__
+#define __QuectelCompression_h__
+#include <Arduino.h>
+#include "M2M_Quectel.h"
+
+#define QT_LZ_WINDOW_BITS       8
+#define QT_LZ_COUNT_BITS        4
+#define QT_LZ_WINDOW_SIZE       (1 << QT_LZ_WINDOW_BITS)
+#define QT_LZ_LOOKAHEAD_SIZE    (1 << QT_LZ_COUNT_BITS)
+// A copy costs more bits than a literal below this length
+#define QT_LZ_MIN_MATCH         2
+#ifndef QT_LZ_OUTPUT_SIZE
+#define QT_LZ_OUTPUT_SIZE       128
+#endif
+
+// Output side shared by the compressor and the decompressor
+class QuectelCodecOutput : public Print
+{
+public:
+    // Output to a sink, e.g. QuectelCellular
+    void begin(Print* sink);
+    // Output to a buffer, see getOutputBytes() and isOverflowed()
+    void begin(uint8_t* buffer, size_t size);
+
+    uint32_t getInputBytes();
+    uint32_t getOutputBytes();
+    // Bytes written to the sink or buffer could not all be stored
+    bool isOverflowed();
+
+protected:
+    QuectelCodecOutput();
+    virtual void reset();
+    void put(uint8_t value);
+    void flushOutput();
+
+    uint32_t _inputBytes;
+    uint32_t _outputBytes;
+
+private:
+    Print* _sink;
+    uint8_t* _buffer;
+    size_t _bufferSize;
+    bool _overflowed;
+    uint8_t _output[QT_LZ_OUTPUT_SIZE];
+    uint16_t _outputLength;
+};
+
+class QuectelCompressor : public QuectelCodecOutput
+{
+public:
+    QuectelCompressor();
+
+    size_t write(uint8_t value);
+    size_t write(const uint8_t* buffer, size_t size);
+    using Print::write;
+    // Compress the rest of the input and write out everything. Returns the
+    // compressed size.
+    uint32_t finish();
+
+    // Input bytes per output byte, e.g. 3.5
+    float getRatio();
+
+protected:
+    void reset();
+
+private:
+    void encodeStep();
+    uint8_t historyAt(uint16_t position);
+    void putBits(uint16_t value, uint8_t count);
+
+    uint8_t _window[QT_LZ_WINDOW_SIZE];
+    uint16_t _windowHead;           // Next position to write
+    uint16_t _windowLength;
+    uint8_t _lookahead[QT_LZ_LOOKAHEAD_SIZE];
+    uint8_t _lookaheadLength;
+    uint8_t _bits;
+    uint8_t _bitCount;
+};
+
+class QuectelDecompressor : public QuectelCodecOutput
+{
+public:
+    QuectelDecompressor();
+
+    // Takes compressed data
+    size_t write(uint8_t value);
+    size_t write(const uint8_t* buffer, size_t size);
+    using Print::write;
+    // Writes out the decompressed data still collected
+    void finish();
+
+    // Reads length compressed bytes of an open module file with readFile(),
+    // in chunks of QT_LZ_OUTPUT_SIZE bytes
+    bool decompressFile(QuectelCellular* cellular, FILE_HANDLE fileHandle, uint32_t length);
+
+protected:
+    void reset();
+
+private:
+    enum class State : uint8_t
+    {
+        Tag = 0,
+        Literal,
+        Offset,
+        Count
+    };
+
+    void emit(uint8_t value);
+
+    uint8_t _window[QT_LZ_WINDOW_SIZE];
+    uint16_t _windowHead;
+    State _state;
+    uint16_t _offset;
+    uint32_t _bits;
+    uint8_t _bitCount;
+};
+
+#endif
@@ -0,0 +1,448 @@
+//---------------------------------------------------------------------------------------------
+//
+// Log structured key-value store for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "QuectelKeyValueStore.h"
+
+QuectelKeyValueStore::QuectelKeyValueStore(QuectelCellular* cellular, const char* name)
+{
+    _cellular = cellular;
+    strncpy(_name, name, QT_KV_NAME_LENGTH - 1);
+    _name[QT_KV_NAME_LENGTH - 1] = 0;
+    _handle = NOT_A_FILE_HANDLE;
+    _file = 0;
+    _generation = 0;
+    _size = 0;
+    _position = 0;
+    _count = 0;
+}
+
+bool QuectelKeyValueStore::begin()
+{
+    _count = 0;
+    bool valid[2];
+    uint8_t generation[2];
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        // A log the module could not be asked about is never taken as
+        // missing, that would lose the store
+        uint32_t size;
+        if (!_cellular->getFileSize(getFileName(i), size))
+        {
+            return false;
+        }
+        valid[i] = false;
+        if (size == QT_FILE_SIZE_UNKNOWN)
+        {
+            continue;
+        }
+        int8_t result = readGeneration(i, size, generation[i]);
+        if (result < 0)
+        {
+            return false;
+        }
+        valid[i] = result > 0;
+        if (!valid[i])
+        {
+            _cellular->deleteFile(getFileName(i));
+        }
+    }
+    if (valid[0] && valid[1])
+    {
+        // A compaction was interrupted, the newer log may be incomplete
+        uint8_t newer = (uint8_t)(generation[1] - generation[0]) == 1 ? 1 : 0;
+        _cellular->deleteFile(getFileName(newer));
+        valid[newer] = false;
+    }
+
+    if (!valid[0] && !valid[1])
+    {
+        _file = 0;
+        _generation = 0;
+        uint8_t header[QT_KV_FILE_HEADER_SIZE] = { 'K', _generation };
+        return open(_file, true) && append(header, sizeof(header));
+    }
+    _file = valid[0] ? 0 : 1;
+    _generation = generation[_file];
+    return open(_file, false) && scan();
+}
+
+bool QuectelKeyValueStore::end()
+{
+    if (_handle == NOT_A_FILE_HANDLE)
+    {
+        return true;
+    }
+    bool result = _cellular->closeFile(_handle);
+    _handle = NOT_A_FILE_HANDLE;
+    return result;
+}
+
+int16_t QuectelKeyValueStore::get(const char* key, uint8_t* value, uint16_t size)
+{
+    IndexEntry* entry = find(key);
+    if (entry == nullptr || _handle == NOT_A_FILE_HANDLE)
+    {
+        return -1;
+    }
+    uint16_t length = entry->length < size ? entry->length : size;
+    if (length > 0)
+    {
+        if (!seek(entry->offset) || !_cellular->readFile(_handle, value, length))
+        {
+            _position = QT_FILE_SIZE_UNKNOWN;
+            return -1;
+        }
+        _position += length;
+    }
+    return entry->length;
+}
+
+bool QuectelKeyValueStore::put(const char* key, const uint8_t* value, uint16_t length)
+{
+    size_t keyLength = strlen(key);
+    if (_handle == NOT_A_FILE_HANDLE ||
+        keyLength == 0 || keyLength >= QT_KV_KEY_LENGTH ||
+        QT_KV_HEADER_SIZE + keyLength + length > QT_KV_BUFFER_SIZE ||
+        (find(key) == nullptr && _count >= QT_KV_MAX_KEYS))
+    {
+        return false;
+    }
+    if (_size > QT_KV_COMPACT_SIZE && getLiveSize() * 2 < _size)
+    {
+        // Failing to compact only means a larger log
+        compact();
+    }
+    _buffer[0] = keyLength;
+    _buffer[1] = length;
+    _buffer[2] = length >> 8;
+    memcpy(_buffer + QT_KV_HEADER_SIZE, key, keyLength);
+    memcpy(_buffer + QT_KV_HEADER_SIZE + keyLength, value, length);
+    uint32_t offset = _size + QT_KV_HEADER_SIZE + keyLength;
+    if (!append(_buffer, QT_KV_HEADER_SIZE + keyLength + length))
+    {
+        return false;
+    }
+    setEntry(key, offset, length);
+    return true;
+}
+
+bool QuectelKeyValueStore::remove(const char* key)
+{
+    if (find(key) == nullptr)
+    {
+        return true;
+    }
+    size_t keyLength = strlen(key);
+    _buffer[0] = keyLength;
+    _buffer[1] = QT_KV_REMOVED & 0xff;
+    _buffer[2] = QT_KV_REMOVED >> 8;
+    memcpy(_buffer + QT_KV_HEADER_SIZE, key, keyLength);
+    if (!append(_buffer, QT_KV_HEADER_SIZE + keyLength))
+    {
+        return false;
+    }
+    removeEntry(key);
+    return true;
+}
+
+bool QuectelKeyValueStore::contains(const char* key)
+{
+    return find(key) != nullptr;
+}
+
+bool QuectelKeyValueStore::getString(const char* key, char* value, uint16_t size)
+{
+    if (size == 0)
+    {
+        return false;
+    }
+    int16_t length = get(key, (uint8_t*)value, size - 1);
+    if (length < 0)
+    {
+        return false;
+    }
+    value[length < size - 1 ? length : size - 1] = 0;
+    return true;
+}
+
+bool QuectelKeyValueStore::putString(const char* key, const char* value)
+{
+    return put(key, (const uint8_t*)value, strlen(value));
+}
+
+uint32_t QuectelKeyValueStore::getUInt32(const char* key, uint32_t defaultValue)
+{
+    uint8_t value[4];
+    if (get(key, value, sizeof(value)) != sizeof(value))
+    {
+        return defaultValue;
+    }
+    return value[0] | value[1] << 8 | (uint32_t)value[2] << 16 | (uint32_t)value[3] << 24;
+}
+
+bool QuectelKeyValueStore::putUInt32(const char* key, uint32_t value)
+{
+    uint8_t stored[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+    return put(key, stored, sizeof(stored));
+}
+
+uint8_t QuectelKeyValueStore::getCount()
+{
+    return _count;
+}
+
+bool QuectelKeyValueStore::compact()
+{
+    if (_handle == NOT_A_FILE_HANDLE)
+    {
+        return false;
+    }
+    uint8_t next = 1 - _file;
+    FILE_HANDLE target = _cellular->openFile(getFileName(next), true);
+    if (target == NOT_A_FILE_HANDLE)
+    {
+        return false;
+    }
+
+    // Records are collected in the buffer and written a buffer at a time
+    uint32_t offsets[QT_KV_MAX_KEYS];
+    uint32_t written = 0;
+    uint16_t used = QT_KV_FILE_HEADER_SIZE;
+    bool ok = true;
+    _buffer[0] = 'K';
+    _buffer[1] = _generation + 1;
+    for (uint8_t i = 0; i < _count && ok; i++)
+    {
+        IndexEntry& entry = _index[i];
+        size_t keyLength = strlen(entry.key);
+        uint16_t recordLength = QT_KV_HEADER_SIZE + keyLength + entry.length;
+        if (used + recordLength > QT_KV_BUFFER_SIZE)
+        {
+            ok = _cellular->writeFile(target, _buffer, used);
+            written += used;
+            used = 0;
+        }
+        uint8_t* record = _buffer + used;
+        record[0] = keyLength;
+        record[1] = entry.length;
+        record[2] = entry.length >> 8;
+        memcpy(record + QT_KV_HEADER_SIZE, entry.key, keyLength);
+        if (ok && entry.length > 0)
+        {
+            ok = seek(entry.offset) &&
+                 _cellular->readFile(_handle, record + QT_KV_HEADER_SIZE + keyLength, entry.length);
+            _position = ok ? entry.offset + entry.length : QT_FILE_SIZE_UNKNOWN;
+        }
+        offsets[i] = written + used + QT_KV_HEADER_SIZE + keyLength;
+        used += recordLength;
+    }
+    if (ok && used > 0)
+    {
+        ok = _cellular->writeFile(target, _buffer, used);
+        written += used;
+    }
+    if (!ok)
+    {
+        _cellular->closeFile(target);
+        _cellular->deleteFile(getFileName(next));
+        return false;
+    }
+
+    // The new log is complete, the old one can go
+    _cellular->closeFile(_handle);
+    _cellular->deleteFile(getFileName(_file));
+    _handle = target;
+    _file = next;
+    _generation++;
+    _size = written;
+    _position = written;
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        _index[i].offset = offsets[i];
+    }
+    return true;
+}
+
+// Private
+
+const char* QuectelKeyValueStore::getFileName(uint8_t file)
+{
+    sprintf(_fileName, "%s.kv%u", _name, file);
+    return _fileName;
+}
+
+bool QuectelKeyValueStore::open(uint8_t file, bool overWrite)
+{
+    _handle = _cellular->openFile(getFileName(file), overWrite);
+    if (_handle == NOT_A_FILE_HANDLE)
+    {
+        return false;
+    }
+    _position = 0;
+    _size = overWrite ? 0 : _cellular->getFileSize(getFileName(file));
+    return _size != QT_FILE_SIZE_UNKNOWN;
+}
+
+int8_t QuectelKeyValueStore::readGeneration(uint8_t file, uint32_t size, uint8_t& generation)
+{
+    // 1 for a valid log, 0 for a corrupt one, -1 when it could not be read
+    if (size < QT_KV_FILE_HEADER_SIZE)
+    {
+        // Cut short by a reset while it was created
+        return 0;
+    }
+    FILE_HANDLE handle = _cellular->openFile(getFileName(file));
+    if (handle == NOT_A_FILE_HANDLE)
+    {
+        return -1;
+    }
+    uint8_t header[QT_KV_FILE_HEADER_SIZE];
+    bool read = _cellular->readFile(handle, header, sizeof(header));
+    _cellular->closeFile(handle);
+    if (!read)
+    {
+        return -1;
+    }
+    generation = header[1];
+    return header[0] == 'K' ? 1 : 0;
+}
+
+bool QuectelKeyValueStore::scan()
+{
+    // Reads the log a buffer at a time. Only the record headers and keys
+    // are needed, a buffer is read from the next record that is not
+    // completely in the current one.
+    uint32_t offset = QT_KV_FILE_HEADER_SIZE;
+    uint32_t bufferStart = 0;
+    uint16_t bufferLength = 0;
+    while (offset < _size)
+    {
+        if (offset < bufferStart ||
+            offset + QT_KV_HEADER_SIZE > bufferStart + bufferLength ||
+            offset + QT_KV_HEADER_SIZE + _buffer[offset - bufferStart] > bufferStart + bufferLength)
+        {
+            bufferStart = offset;
+            bufferLength = _size - offset < QT_KV_BUFFER_SIZE ? _size - offset : QT_KV_BUFFER_SIZE;
+            if (!seek(offset) || !_cellular->readFile(_handle, _buffer, bufferLength))
+            {
+                _position = QT_FILE_SIZE_UNKNOWN;
+                return false;
+            }
+            _position += bufferLength;
+        }
+        const uint8_t* record = _buffer + (offset - bufferStart);
+        uint8_t keyLength = record[0];
+        uint16_t length = record[1] | record[2] << 8;
+        uint32_t end = offset + QT_KV_HEADER_SIZE + keyLength + (length == QT_KV_REMOVED ? 0 : length);
+        if (keyLength == 0 || keyLength >= QT_KV_KEY_LENGTH ||
+            offset + QT_KV_HEADER_SIZE + keyLength > bufferStart + bufferLength ||
+            end > _size)
+        {
+            // Cut short by a reset while it was appended, drop it
+            break;
+        }
+        char key[QT_KV_KEY_LENGTH];
+        memcpy(key, record + QT_KV_HEADER_SIZE, keyLength);
+        key[keyLength] = 0;
+        if (length == QT_KV_REMOVED)
+        {
+            removeEntry(key);
+        }
+        else
+        {
+            setEntry(key, offset + QT_KV_HEADER_SIZE + keyLength, length);
+        }
+        offset = end;
+    }
+    if (offset < _size)
+    {
+        if (!seek(offset) || !_cellular->truncateFile(_handle))
+        {
+            return false;
+        }
+        _size = offset;
+    }
+    return true;
+}
+
+bool QuectelKeyValueStore::append(const uint8_t* data, uint16_t length)
+{
+    if (!seek(_size) || !_cellular->writeFile(_handle, data, length))
+    {
+        _position = QT_FILE_SIZE_UNKNOWN;
+        return false;
+    }
+    _size += length;
+    _position = _size;
+    return true;
+}
+
+bool QuectelKeyValueStore::seek(uint32_t offset)
+{
+    if (_position == offset)
+    {
+        return true;
+    }
+    if (!_cellular->seekFile(_handle, offset))
+    {
+        _position = QT_FILE_SIZE_UNKNOWN;
+        return false;
+    }
+    _position = offset;
+    return true;
+}
+
+QuectelKeyValueStore::IndexEntry* QuectelKeyValueStore::find(const char* key)
+{
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        if (strcmp(_index[i].key, key) == 0)
+        {
+            return &_index[i];
+        }
+    }
+    return nullptr;
+}
+
+void QuectelKeyValueStore::setEntry(const char* key, uint32_t offset, uint16_t length)
+{
+    IndexEntry* entry = find(key);
+    if (entry == nullptr)
+    {
+        if (_count >= QT_KV_MAX_KEYS)
+        {
+            return;
+        }
+        entry = &_index[_count++];
+        strcpy(entry->key, key);
+    }
+    entry->offset = offset;
+    entry->length = length;
+}
+
+void QuectelKeyValueStore::removeEntry(const char* key)
+{
+    IndexEntry* entry = find(key);
+    if (entry != nullptr)
+    {
+        *entry = _index[--_count];
+    }
+}
+
+uint32_t QuectelKeyValueStore::getLiveSize()
+{
+    uint32_t size = QT_KV_FILE_HEADER_SIZE;
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        size += QT_KV_HEADER_SIZE + strlen(_index[i].key) + _index[i].length;
+    }
+    return size;
+}
@@ -0,0 +1,111 @@
+//---------------------------------------------------------------------------------------------
+//
+// Log structured key-value store for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+//---------------------------------------------------------------------------------------------
+//
+// Values are appended to "<name>.kv0" or "<name>.kv1" in the module file
+// system, one record per put():
+//
+//   key length     1 byte
+//   value length   16 bits little endian, 0xffff for a removed key
+//   key, value
+//
+// Each file starts with 'K' and a generation number. begin() reads the log
+// once to build an index of where each value is, so get() is one seek and
+// one read and put() is one write. When most of the log is overwritten
+// values, the live ones are copied to the other file with the next
+// generation and the old file is deleted. A reset during the copy leaves
+// both files, and the older, complete one is used.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __QuectelKeyValueStore_h__
+#define __QuectelKeyValueStore_h__
+#include <Arduino.h>
+#include "M2M_Quectel.h"
+
+#ifndef QT_KV_MAX_KEYS
+#define QT_KV_MAX_KEYS          16
+#endif
+#define QT_KV_KEY_LENGTH        16      // Including the terminator
+// Largest record, and the buffer used to read the log and to compact
+#ifndef QT_KV_BUFFER_SIZE
+#define QT_KV_BUFFER_SIZE       128
+#endif
+// The log is compacted when it is larger than this and more than half of
+// it is overwritten values
+#define QT_KV_COMPACT_SIZE      1024
+#define QT_KV_NAME_LENGTH       32
+#define QT_KV_HEADER_SIZE       3
+#define QT_KV_FILE_HEADER_SIZE  2
+#define QT_KV_REMOVED           0xffff
+
+class QuectelKeyValueStore
+{
+public:
+    // The name is used for the files, without extension. Without a volume,
+    // e.g. "UFS:config", the current volume is used.
+    QuectelKeyValueStore(QuectelCellular* cellular, const char* name);
+
+    // False, with the logs left as they are, when the module cannot be
+    // asked about them
+    bool begin();
+    bool end();
+
+    // Returns the length of the value, or -1 if the key is not stored.
+    // Values longer than size are cut.
+    int16_t get(const char* key, uint8_t* value, uint16_t size);
+    // Keys are at most QT_KV_KEY_LENGTH - 1 characters, and a record at
+    // most QT_KV_BUFFER_SIZE bytes
+    bool put(const char* key, const uint8_t* value, uint16_t length);
+    bool remove(const char* key);
+    bool contains(const char* key);
+
+    // Stored without the terminator
+    bool getString(const char* key, char* value, uint16_t size);
+    bool putString(const char* key, const char* value);
+    uint32_t getUInt32(const char* key, uint32_t defaultValue = 0);
+    bool putUInt32(const char* key, uint32_t value);
+
+    uint8_t getCount();
+    // Copy the live values to a new log
+    bool compact();
+
+private:
+    struct IndexEntry
+    {
+        char key[QT_KV_KEY_LENGTH];
+        uint32_t offset;            // Of the value
+        uint16_t length;
+    };
+
+    const char* getFileName(uint8_t file);
+    bool open(uint8_t file, bool overWrite);
+    int8_t readGeneration(uint8_t file, uint32_t size, uint8_t& generation);
+    bool scan();
+    bool append(const uint8_t* data, uint16_t length);
+    bool seek(uint32_t offset);
+    IndexEntry* find(const char* key);
+    void setEntry(const char* key, uint32_t offset, uint16_t length);
+    void removeEntry(const char* key);
+    uint32_t getLiveSize();
+
+    QuectelCellular* _cellular;
+    char _name[QT_KV_NAME_LENGTH];
+    char _fileName[QT_KV_NAME_LENGTH + 4];
+    FILE_HANDLE _handle;
+    uint8_t _file;                  // 0 or 1, the log in use
+    uint8_t _generation;
+    uint32_t _size;
+    uint32_t _position;             // File position of the handle
+    IndexEntry _index[QT_KV_MAX_KEYS];
+    uint8_t _count;
+    uint8_t _buffer[QT_KV_BUFFER_SIZE];
+};
+
+#endif
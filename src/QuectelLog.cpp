@@ -0,0 +1,320 @@
+//---------------------------------------------------------------------------------------------
+//
+// Deferred logging for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "QuectelLog.h"
+
+// Record layout: kind, body length, millis() (4 bytes), body
+#define QT_LOG_HEADER_SIZE  6
+
+QuectelLogRing::QuectelLogRing()
+{
+    _tail = 0;
+    _used = 0;
+    _dropped = 0;
+}
+
+void QuectelLogRing::addDump(QuectelLogKind kind, const void* data, uint32_t size)
+{
+    uint8_t body[2 + QT_LOG_MAX_DUMP];
+    uint16_t total = size > 0xffff ? 0xffff : size;
+    uint8_t stored = size > QT_LOG_MAX_DUMP ? QT_LOG_MAX_DUMP : size;
+    memcpy(body, &total, 2);
+    memcpy(body + 2, data, stored);
+    commit(kind, body, 2 + stored);
+}
+
+void QuectelLogRing::flush(Logger* logger)
+{
+    uint8_t body[QT_LOG_MAX_RECORD];
+    char text[QT_LOG_MAX_TEXT];
+
+    while (true)
+    {
+        // The record is taken out under the lock, the logger is called
+        // without it
+        QuectelLogKind kind;
+        uint8_t length;
+        uint32_t time = 0;
+        {
+            QT_LOCK();
+            if (_used < QT_LOG_HEADER_SIZE)
+            {
+                break;
+            }
+            kind = (QuectelLogKind)ringAt(0);
+            length = ringAt(1);
+            for (uint8_t i = 0; i < 4; i++)
+            {
+                time |= (uint32_t)ringAt(2 + i) << (i * 8);
+            }
+            for (uint8_t i = 0; i < length; i++)
+            {
+                body[i] = ringAt(QT_LOG_HEADER_SIZE + i);
+            }
+            _tail = (_tail + QT_LOG_HEADER_SIZE + length) % QT_LOG_RING_SIZE;
+            _used -= QT_LOG_HEADER_SIZE + length;
+        }
+
+        if (kind == QuectelLogKind::HexDump ||
+            kind == QuectelLogKind::AsciiDump)
+        {
+            uint16_t total;
+            memcpy(&total, body, 2);
+            if (kind == QuectelLogKind::HexDump)
+            {
+                logger->tracePartHexDump(body + 2, length - 2);
+            }
+            else
+            {
+                logger->tracePartAsciiDump(body + 2, length - 2);
+            }
+            if (total > length - 2)
+            {
+                logger->tracePart(" ...(%u bytes)", total);
+            }
+            continue;
+        }
+
+        const char* formatString;
+        memcpy(&formatString, body, sizeof(formatString));
+        format(text, formatString, body + sizeof(formatString), body + length);
+        switch (kind)
+        {
+            case QuectelLogKind::Error:
+                logger->error("[%lu] %s", (unsigned long)time, text);
+                break;
+            case QuectelLogKind::Info:
+                logger->info("[%lu] %s", (unsigned long)time, text);
+                break;
+            case QuectelLogKind::Debug:
+                logger->debug("[%lu] %s", (unsigned long)time, text);
+                break;
+            case QuectelLogKind::Trace:
+                logger->trace("[%lu] %s", (unsigned long)time, text);
+                break;
+            case QuectelLogKind::TraceStart:
+                logger->traceStart("[%lu] %s", (unsigned long)time, text);
+                break;
+            case QuectelLogKind::TracePart:
+                logger->tracePart("%s", text);
+                break;
+            default:
+                logger->traceEnd("%s", text);
+                break;
+        }
+    }
+    if (_dropped > 0)
+    {
+        logger->error("%lu log records dropped", (unsigned long)_dropped);
+        _dropped = 0;
+    }
+}
+
+uint32_t QuectelLogRing::getDroppedRecords()
+{
+    QT_LOCK();
+    return _dropped;
+}
+
+void QuectelLogRing::packSigned(uint8_t* body, uint8_t& length, int32_t value)
+{
+    if (length + 5 > QT_LOG_MAX_RECORD)
+    {
+        return;
+    }
+    body[length++] = 'i';
+    memcpy(body + length, &value, 4);
+    length += 4;
+}
+
+void QuectelLogRing::packUnsigned(uint8_t* body, uint8_t& length, uint32_t value)
+{
+    if (length + 5 > QT_LOG_MAX_RECORD)
+    {
+        return;
+    }
+    body[length++] = 'u';
+    memcpy(body + length, &value, 4);
+    length += 4;
+}
+
+void QuectelLogRing::packFloat(uint8_t* body, uint8_t& length, float value)
+{
+    if (length + 5 > QT_LOG_MAX_RECORD)
+    {
+        return;
+    }
+    body[length++] = 'f';
+    memcpy(body + length, &value, 4);
+    length += 4;
+}
+
+void QuectelLogRing::packString(uint8_t* body, uint8_t& length, const char* value)
+{
+    if (length + 2 > QT_LOG_MAX_RECORD)
+    {
+        return;
+    }
+    if (value == nullptr)
+    {
+        value = "(null)";
+    }
+    uint8_t count = 0;
+    while (value[count] && count < QT_LOG_MAX_STRING &&
+           length + 2 + count < QT_LOG_MAX_RECORD)
+    {
+        count++;
+    }
+    body[length++] = 's';
+    body[length++] = count;
+    memcpy(body + length, value, count);
+    length += count;
+}
+
+void QuectelLogRing::commit(QuectelLogKind kind, const uint8_t* body, uint8_t length)
+{
+    uint16_t needed = QT_LOG_HEADER_SIZE + length;
+    QT_LOCK();
+    if (QT_LOG_RING_SIZE - _used < needed)
+    {
+        _dropped++;
+        return;
+    }
+    uint8_t header[QT_LOG_HEADER_SIZE];
+    uint32_t time = millis();
+    header[0] = (uint8_t)kind;
+    header[1] = length;
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        header[2 + i] = time >> (i * 8);
+    }
+    for (uint16_t i = 0; i < needed; i++)
+    {
+        _ring[(_tail + _used) % QT_LOG_RING_SIZE] = i < QT_LOG_HEADER_SIZE ? header[i] : body[i - QT_LOG_HEADER_SIZE];
+        _used++;
+    }
+}
+
+void QuectelLogRing::format(char* text, const char* format, const uint8_t* args, const uint8_t* end)
+{
+    // Expands the stored arguments with the same conversions the immediate
+    // logger would have used. Length modifiers are replaced since all
+    // numbers are stored as 32 bits.
+    char* out = text;
+    char* limit = text + QT_LOG_MAX_TEXT - 1;
+    while (*format && out < limit)
+    {
+        if (*format != '%')
+        {
+            *out++ = *format++;
+            continue;
+        }
+        if (format[1] == '%')
+        {
+            *out++ = '%';
+            format += 2;
+            continue;
+        }
+
+        char spec[16];
+        uint8_t specLength = 0;
+        spec[specLength++] = *format++;
+        while (*format && strchr("-+ #0123456789.", *format) && specLength < 10)
+        {
+            spec[specLength++] = *format++;
+        }
+        while (*format && strchr("hlLzjt", *format))
+        {
+            format++;
+        }
+        char conversion = *format;
+        if (!conversion)
+        {
+            break;
+        }
+        format++;
+
+        int written = 0;
+        size_t room = limit - out + 1;
+        char tag = args < end ? *args++ : 0;
+        int32_t number = 0;
+        float real = 0;
+        char string[QT_LOG_MAX_STRING + 1] = "";
+        if (tag == 'i' || tag == 'u')
+        {
+            memcpy(&number, args, 4);
+            args += 4;
+        }
+        else if (tag == 'f')
+        {
+            memcpy(&real, args, 4);
+            args += 4;
+        }
+        else if (tag == 's')
+        {
+            uint8_t count = *args++;
+            memcpy(string, args, count);
+            string[count] = 0;
+            args += count;
+        }
+
+        if (tag == 0)
+        {
+            written = snprintf(out, room, "?");
+        }
+        else if (conversion == 's')
+        {
+            spec[specLength++] = 's';
+            spec[specLength] = 0;
+            written = snprintf(out, room, spec, tag == 's' ? string : "?");
+        }
+        else if (conversion == 'c')
+        {
+            spec[specLength++] = 'c';
+            spec[specLength] = 0;
+            written = snprintf(out, room, spec, tag == 's' ? string[0] : (char)number);
+        }
+        else if (strchr("feEgG", conversion))
+        {
+            spec[specLength++] = conversion;
+            spec[specLength] = 0;
+            written = snprintf(out, room, spec, tag == 'f' ? (double)real : (double)number);
+        }
+        else
+        {
+            spec[specLength++] = 'l';
+            spec[specLength++] = conversion;
+            spec[specLength] = 0;
+            if (tag == 'f')
+            {
+                number = (int32_t)real;
+            }
+            if (conversion == 'd' || conversion == 'i')
+            {
+                written = snprintf(out, room, spec, tag == 'u' ? (long)(uint32_t)number : (long)number);
+            }
+            else
+            {
+                written = snprintf(out, room, spec, (unsigned long)(uint32_t)number);
+            }
+        }
+        if (written > 0)
+        {
+            out += (size_t)written < room ? written : room - 1;
+        }
+    }
+    *out = 0;
+}
+
+uint8_t QuectelLogRing::ringAt(uint16_t offset)
+{
+    return _ring[(_tail + offset) % QT_LOG_RING_SIZE];
+}
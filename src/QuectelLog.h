@@ -0,0 +1,113 @@
+//---------------------------------------------------------------------------------------------
+//
+// Deferred logging for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+//---------------------------------------------------------------------------------------------
+//
+// With M2M_QUECTEL_DEFERRED_LOG defined, the QT_* log macros store a compact
+// binary record instead of formatting: the format string pointer, the
+// arguments tagged by type, and any dumped buffer as raw bytes. The text is
+// produced later by QuectelCellular::flushLog(), outside the hot path.
+//
+// Format strings must be literals, as only their address is stored. String
+// arguments are copied, truncated to QT_LOG_MAX_STRING characters.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __QuectelLog_h__
+#define __QuectelLog_h__
+#include <Arduino.h>
+#include <M2M_Logger.h>
+#include "QuectelThreads.h"
+
+#ifndef QT_LOG_RING_SIZE
+#define QT_LOG_RING_SIZE    1024
+#endif
+#define QT_LOG_MAX_RECORD   96
+#define QT_LOG_MAX_STRING   40
+#define QT_LOG_MAX_DUMP     64
+#define QT_LOG_MAX_TEXT     160
+
+enum class QuectelLogKind : uint8_t
+{
+    Error = 0,
+    Info,
+    Debug,
+    Trace,
+    TraceStart,
+    TracePart,
+    TraceEnd,
+    HexDump,
+    AsciiDump
+};
+
+class QuectelLogRing
+{
+public:
+    QuectelLogRing();
+
+    template<typename... Args>
+    void add(QuectelLogKind kind, const char* format, Args... args)
+    {
+        uint8_t body[QT_LOG_MAX_RECORD];
+        uint8_t length = sizeof(format);
+        memcpy(body, &format, sizeof(format));
+        packAll(body, length, args...);
+        commit(kind, body, length);
+    }
+    void addDump(QuectelLogKind kind, const void* data, uint32_t size);
+
+    // Format and output all stored records
+    void flush(Logger* logger);
+    uint32_t getDroppedRecords();
+
+private:
+    void packAll(uint8_t*, uint8_t&)
+    {
+    }
+    template<typename T, typename... Rest>
+    void packAll(uint8_t* body, uint8_t& length, T value, Rest... rest)
+    {
+        pack(body, length, value);
+        packAll(body, length, rest...);
+    }
+
+    void pack(uint8_t* body, uint8_t& length, char value) { packSigned(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, signed char value) { packSigned(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, short value) { packSigned(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, int value) { packSigned(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, long value) { packSigned(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, long long value) { packSigned(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, bool value) { packUnsigned(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, unsigned char value) { packUnsigned(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, unsigned short value) { packUnsigned(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, unsigned int value) { packUnsigned(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, unsigned long value) { packUnsigned(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, unsigned long long value) { packUnsigned(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, float value) { packFloat(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, double value) { packFloat(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, const char* value) { packString(body, length, value); }
+    void pack(uint8_t* body, uint8_t& length, const void* value) { packUnsigned(body, length, (uintptr_t)value); }
+
+    void packSigned(uint8_t* body, uint8_t& length, int32_t value);
+    void packUnsigned(uint8_t* body, uint8_t& length, uint32_t value);
+    void packFloat(uint8_t* body, uint8_t& length, float value);
+    void packString(uint8_t* body, uint8_t& length, const char* value);
+    void commit(QuectelLogKind kind, const uint8_t* body, uint8_t length);
+    void format(char* text, const char* format, const uint8_t* args, const uint8_t* end);
+    uint8_t ringAt(uint16_t offset);
+
+    uint8_t _ring[QT_LOG_RING_SIZE];
+    uint16_t _tail;
+    uint16_t _used;
+    uint32_t _dropped;
+#ifdef M2M_QUECTEL_THREADS
+    QuectelMutex _mutex;
+#endif
+};
+
+#endif
@@ -0,0 +1,220 @@
+//---------------------------------------------------------------------------------------------
+//
+// POSIX serial transport for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "QuectelPosixTransport.h"
+
+#ifdef QT_POSIX_TRANSPORT
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+static const struct
+{
+    uint32_t baudRate;
+    speed_t speed;
+} baudRates[] =
+{
+    { 9600, B9600 },
+    { 19200, B19200 },
+    { 38400, B38400 },
+    { 57600, B57600 },
+    { 115200, B115200 },
+    { 230400, B230400 },
+#ifdef B460800
+    { 460800, B460800 },
+#endif
+#ifdef B921600
+    { 921600, B921600 },
+#endif
+};
+
+QuectelPosixTransport::QuectelPosixTransport(const char* device)
+{
+    _device = device;
+    _fd = -1;
+    _owned = true;
+}
+
+QuectelPosixTransport::QuectelPosixTransport(int fd)
+{
+    _device = nullptr;
+    _fd = fd;
+    _owned = false;
+}
+
+QuectelPosixTransport::~QuectelPosixTransport()
+{
+    end();
+}
+
+bool QuectelPosixTransport::begin(uint32_t baudRate)
+{
+    if (_fd < 0)
+    {
+        if (_device == nullptr)
+        {
+            return false;
+        }
+        _fd = open(_device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (_fd < 0)
+        {
+            return false;
+        }
+    }
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+
+    // Raw 8N1, reads return at once
+    struct termios options;
+    if (isatty(_fd) && tcgetattr(_fd, &options) == 0)
+    {
+        cfmakeraw(&options);
+        options.c_cflag |= CLOCAL | CREAD;
+        options.c_cc[VMIN] = 0;
+        options.c_cc[VTIME] = 0;
+        tcsetattr(_fd, TCSANOW, &options);
+        tcflush(_fd, TCIOFLUSH);
+        setBaudRate(baudRate);
+    }
+    return true;
+}
+
+void QuectelPosixTransport::end()
+{
+    if (_owned && _fd >= 0)
+    {
+        close(_fd);
+        _fd = -1;
+    }
+}
+
+int QuectelPosixTransport::available()
+{
+    int length = 0;
+    if (_fd < 0 || ioctl(_fd, FIONREAD, &length) < 0)
+    {
+        return 0;
+    }
+    return length;
+}
+
+size_t QuectelPosixTransport::read(uint8_t* buffer, size_t size)
+{
+    if (_fd < 0)
+    {
+        return 0;
+    }
+    ssize_t length = ::read(_fd, buffer, size);
+    // EAGAIN when nothing is received
+    return length > 0 ? length : 0;
+}
+
+size_t QuectelPosixTransport::write(const uint8_t* buffer, size_t size)
+{
+    if (_fd < 0)
+    {
+        return 0;
+    }
+    ssize_t length = ::write(_fd, buffer, size);
+    // EAGAIN when the output queue is full
+    return length > 0 ? length : 0;
+}
+
+bool QuectelPosixTransport::waitForData(uint16_t timeout)
+{
+    if (_fd < 0)
+    {
+        return false;
+    }
+    struct pollfd descriptor;
+    descriptor.fd = _fd;
+    descriptor.events = POLLIN;
+    descriptor.revents = 0;
+    int result;
+    do
+    {
+        result = poll(&descriptor, 1, timeout);
+    }
+    while (result < 0 && errno == EINTR);
+    return result > 0 && (descriptor.revents & POLLIN);
+}
+
+bool QuectelPosixTransport::setBaudRate(uint32_t baudRate)
+{
+    struct termios options;
+    if (_fd < 0 || tcgetattr(_fd, &options) != 0)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(baudRates) / sizeof(baudRates[0]); i++)
+    {
+        if (baudRates[i].baudRate == baudRate)
+        {
+            cfsetispeed(&options, baudRates[i].speed);
+            cfsetospeed(&options, baudRates[i].speed);
+            // Lets the last command go out at the old rate
+            return tcsetattr(_fd, TCSADRAIN, &options) == 0;
+        }
+    }
+    return false;
+}
+
+bool QuectelPosixTransport::setFlowControl(bool enabled)
+{
+#ifdef CRTSCTS
+    struct termios options;
+    if (_fd < 0 || tcgetattr(_fd, &options) != 0)
+    {
+        return false;
+    }
+    if (enabled)
+    {
+        options.c_cflag |= CRTSCTS;
+    }
+    else
+    {
+        options.c_cflag &= ~CRTSCTS;
+    }
+    return tcsetattr(_fd, TCSADRAIN, &options) == 0;
+#else
+    return false;
+#endif
+}
+
+bool QuectelPosixTransport::supportsBaudRate(uint32_t baudRate)
+{
+    for (size_t i = 0; i < sizeof(baudRates) / sizeof(baudRates[0]); i++)
+    {
+        if (baudRates[i].baudRate == baudRate)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool QuectelPosixTransport::supportsFlowControl()
+{
+#ifdef CRTSCTS
+    return true;
+#else
+    return false;
+#endif
+}
+
+int QuectelPosixTransport::getDescriptor()
+{
+    return _fd;
+}
+
+#endif
@@ -0,0 +1,63 @@
+//---------------------------------------------------------------------------------------------
+//
+// POSIX serial transport for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+//---------------------------------------------------------------------------------------------
+//
+// Runs the library on a Linux gateway with the module on a serial or USB
+// device, e.g. "/dev/ttyUSB2", set to raw mode with termios. A descriptor
+// that is already open, e.g. the master side of a pseudo terminal with a
+// simulated module on the other end, can be given instead. The descriptor
+// is non-blocking and received data is waited for with poll().
+//
+// Only built where QT_POSIX_TRANSPORT is defined, by default on Linux and
+// macOS.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __QuectelPosixTransport_h__
+#define __QuectelPosixTransport_h__
+#include <Arduino.h>
+#include "QuectelTransport.h"
+
+#if !defined(QT_POSIX_TRANSPORT) && (defined(__linux__) || defined(__APPLE__))
+#define QT_POSIX_TRANSPORT
+#endif
+
+#ifdef QT_POSIX_TRANSPORT
+
+class QuectelPosixTransport : public QuectelTransport
+{
+public:
+    // The device name must stay valid, it is opened by begin()
+    QuectelPosixTransport(const char* device);
+    // An open descriptor, which is not closed by end()
+    QuectelPosixTransport(int fd);
+    ~QuectelPosixTransport();
+
+    bool begin(uint32_t baudRate);
+    void end();
+    int available();
+    size_t read(uint8_t* buffer, size_t size);
+    size_t write(const uint8_t* buffer, size_t size);
+    bool waitForData(uint16_t timeout);
+    bool setBaudRate(uint32_t baudRate);
+    // RTS/CTS
+    bool setFlowControl(bool enabled);
+    bool supportsBaudRate(uint32_t baudRate);
+    bool supportsFlowControl();
+
+    int getDescriptor();
+
+private:
+    const char* _device;
+    int _fd;
+    bool _owned;
+};
+
+#endif
+#endif
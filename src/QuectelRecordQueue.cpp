@@ -0,0 +1,389 @@
+//---------------------------------------------------------------------------------------------
+//
+// Persistent record queue for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "QuectelRecordQueue.h"
+
+QuectelRecordQueue::QuectelRecordQueue(QuectelCellular* cellular, const char* name)
+{
+    _cellular = cellular;
+    snprintf(_dataName, sizeof(_dataName), "%s.dat", name);
+    snprintf(_cursorName, sizeof(_cursorName), "%s.pos", name);
+    _dataHandle = NOT_A_FILE_HANDLE;
+    _cursorHandle = NOT_A_FILE_HANDLE;
+    _maxSize = QT_QUEUE_MAX_SIZE;
+    _size = 0;
+    _cursor = 0;
+    _position = 0;
+    _peeked = 0;
+    _staged = 0;
+}
+
+bool QuectelRecordQueue::begin(uint32_t maxSize)
+{
+    _maxSize = maxSize;
+    _staged = 0;
+    _peeked = 0;
+    _dataHandle = _cellular->openFile(_dataName);
+    _cursorHandle = _cellular->openFile(_cursorName);
+    if (_dataHandle == NOT_A_FILE_HANDLE || _cursorHandle == NOT_A_FILE_HANDLE)
+    {
+        return false;
+    }
+    _position = 0;
+    // An unknown size is not taken as empty, records would be appended
+    // over the pending ones
+    if (!_cellular->getFileSize(_dataName, _size))
+    {
+        return false;
+    }
+    if (_size == QT_FILE_SIZE_UNKNOWN)
+    {
+        _size = 0;
+    }
+
+    _cursor = 0;
+    uint32_t end = QT_FILE_SIZE_UNKNOWN;
+    uint32_t cursorSize;
+    if (!_cellular->getFileSize(_cursorName, cursorSize))
+    {
+        return false;
+    }
+    if (cursorSize != QT_FILE_SIZE_UNKNOWN && cursorSize >= 4)
+    {
+        uint8_t stored[8];
+        uint8_t length = cursorSize >= 8 ? 8 : 4;
+        if (!_cellular->readFile(_cursorHandle, stored, length))
+        {
+            return false;
+        }
+        _cursor = stored[0] | stored[1] << 8 | (uint32_t)stored[2] << 16 | (uint32_t)stored[3] << 24;
+        if (length == 8)
+        {
+            end = stored[4] | stored[5] << 8 | (uint32_t)stored[6] << 16 | (uint32_t)stored[7] << 24;
+        }
+    }
+    if (end != QT_FILE_SIZE_UNKNOWN)
+    {
+        // Reset while compacting, the data ends at the moved records
+        if (end < _size)
+        {
+            if (!seek(end) || !_cellular->truncateFile(_dataHandle))
+            {
+                return false;
+            }
+            _size = end;
+        }
+        if (!writeCursor())
+        {
+            return false;
+        }
+    }
+    if (_cursor > _size)
+    {
+        // Reset after the data file was truncated but before the cursor
+        // was cleared, the queue was drained
+        _cursor = 0;
+    }
+    return scan();
+}
+
+bool QuectelRecordQueue::end()
+{
+    bool result = flush();
+    if (_dataHandle != NOT_A_FILE_HANDLE)
+    {
+        _cellular->closeFile(_dataHandle);
+        _dataHandle = NOT_A_FILE_HANDLE;
+    }
+    if (_cursorHandle != NOT_A_FILE_HANDLE)
+    {
+        _cellular->closeFile(_cursorHandle);
+        _cursorHandle = NOT_A_FILE_HANDLE;
+    }
+    return result;
+}
+
+bool QuectelRecordQueue::push(const uint8_t* data, uint16_t length)
+{
+    uint32_t needed = QT_QUEUE_HEADER_SIZE + length;
+    if (_dataHandle == NOT_A_FILE_HANDLE || length > QT_QUEUE_RECORD_SIZE)
+    {
+        return false;
+    }
+    if (_size + _staged + needed > _maxSize &&
+        (!compact() || _size + _staged + needed > _maxSize))
+    {
+        return false;
+    }
+    uint8_t header[QT_QUEUE_HEADER_SIZE] = { (uint8_t)length, (uint8_t)(length >> 8) };
+    if (needed > QT_QUEUE_STAGING_SIZE)
+    {
+        // Too large to collect, append it directly
+        return flush() && append(header, QT_QUEUE_HEADER_SIZE) && append(data, length);
+    }
+    if (_staged + needed > QT_QUEUE_STAGING_SIZE && !flush())
+    {
+        return false;
+    }
+    memcpy(_staging + _staged, header, QT_QUEUE_HEADER_SIZE);
+    memcpy(_staging + _staged + QT_QUEUE_HEADER_SIZE, data, length);
+    _staged += needed;
+    return true;
+}
+
+bool QuectelRecordQueue::flush()
+{
+    if (_staged == 0)
+    {
+        return true;
+    }
+    if (!append(_staging, _staged))
+    {
+        return false;
+    }
+    _staged = 0;
+    return true;
+}
+
+uint32_t QuectelRecordQueue::peek(uint8_t* buffer, uint32_t size, uint16_t& count)
+{
+    count = 0;
+    _peeked = 0;
+    if (_dataHandle == NOT_A_FILE_HANDLE || !flush())
+    {
+        return 0;
+    }
+    while (_cursor < _size)
+    {
+        uint32_t length = _size - _cursor;
+        if (length > size)
+        {
+            length = size;
+        }
+        if (!seek(_cursor) || !_cellular->readFile(_dataHandle, buffer, length))
+        {
+            _position = QT_FILE_SIZE_UNKNOWN;
+            return 0;
+        }
+        _position += length;
+
+        uint32_t offset = 0;
+        uint32_t record = 0;
+        while (offset + QT_QUEUE_HEADER_SIZE <= length)
+        {
+            record = QT_QUEUE_HEADER_SIZE + (buffer[offset] | buffer[offset + 1] << 8);
+            if (offset + record > length)
+            {
+                break;
+            }
+            offset += record;
+            count++;
+        }
+        if (count > 0)
+        {
+            _peeked = offset;
+            return offset;
+        }
+        if (_size - _cursor >= QT_QUEUE_HEADER_SIZE &&
+            (length < QT_QUEUE_HEADER_SIZE || _cursor + record <= _size))
+        {
+            // The first record does not fit in the buffer, it is kept
+            return 0;
+        }
+
+        // Cut short by a reset while it was appended, drop it rather than
+        // block the queue
+        _peeked = _size - _cursor;
+        if (!acknowledge())
+        {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+bool QuectelRecordQueue::acknowledge()
+{
+    if (_peeked == 0)
+    {
+        return true;
+    }
+    _cursor += _peeked;
+    _peeked = 0;
+    if (_cursor >= _size)
+    {
+        // Drained. The data file is emptied first, a cursor beyond the end
+        // of the file is read as an empty queue.
+        if (!seek(0) || !_cellular->truncateFile(_dataHandle))
+        {
+            return false;
+        }
+        _size = 0;
+        _cursor = 0;
+    }
+    return writeCursor();
+}
+
+const uint8_t* QuectelRecordQueue::nextRecord(const uint8_t*& position, uint16_t& length)
+{
+    length = position[0] | position[1] << 8;
+    const uint8_t* record = position + QT_QUEUE_HEADER_SIZE;
+    position = record + length;
+    return record;
+}
+
+uint32_t QuectelRecordQueue::getPending()
+{
+    return _size - _cursor + _staged;
+}
+
+bool QuectelRecordQueue::isEmpty()
+{
+    return getPending() == 0;
+}
+
+// Private
+
+bool QuectelRecordQueue::append(const uint8_t* data, uint32_t length)
+{
+    if (!seek(_size) || !_cellular->writeFile(_dataHandle, data, length))
+    {
+        _position = QT_FILE_SIZE_UNKNOWN;
+        return false;
+    }
+    _size += length;
+    _position = _size;
+    return true;
+}
+
+bool QuectelRecordQueue::compact()
+{
+    // Moves the unacknowledged records to the start of the file. Only done
+    // when they fit below the cursor, so the records being moved are never
+    // overwritten and a reset at any point loses nothing.
+    if (_cursor == 0 || !flush())
+    {
+        return false;
+    }
+    uint32_t pending = _size - _cursor;
+    if (pending > _cursor)
+    {
+        return false;
+    }
+    uint32_t moved = 0;
+    while (moved < pending)
+    {
+        uint32_t length = pending - moved;
+        if (length > QT_QUEUE_STAGING_SIZE)
+        {
+            length = QT_QUEUE_STAGING_SIZE;
+        }
+        if (!seek(_cursor + moved) || !_cellular->readFile(_dataHandle, _staging, length))
+        {
+            _position = QT_FILE_SIZE_UNKNOWN;
+            return false;
+        }
+        _position += length;
+        if (!seek(moved) || !_cellular->writeFile(_dataHandle, _staging, length))
+        {
+            _position = QT_FILE_SIZE_UNKNOWN;
+            return false;
+        }
+        _position += length;
+        moved += length;
+    }
+
+    // The new end is stored with the cursor, begin() truncates the file
+    // if a reset comes before the truncate
+    _cursor = 0;
+    if (!writeCursor(pending) || !seek(pending) || !_cellular->truncateFile(_dataHandle))
+    {
+        return false;
+    }
+    _size = pending;
+    return writeCursor();
+}
+
+bool QuectelRecordQueue::scan()
+{
+    // Finds the end of the last complete record. A record cut short by a
+    // reset while it was appended would otherwise take the records
+    // appended after it as its data. Only the length prefixes are used,
+    // each buffer is read from the first record not yet passed.
+    uint32_t offset = _cursor;
+    while (offset + QT_QUEUE_HEADER_SIZE <= _size)
+    {
+        uint32_t length = _size - offset;
+        if (length > QT_QUEUE_STAGING_SIZE)
+        {
+            length = QT_QUEUE_STAGING_SIZE;
+        }
+        if (!seek(offset) || !_cellular->readFile(_dataHandle, _staging, length))
+        {
+            _position = QT_FILE_SIZE_UNKNOWN;
+            return false;
+        }
+        _position += length;
+        uint32_t next = 0;
+        while (next + QT_QUEUE_HEADER_SIZE <= length)
+        {
+            uint32_t record = QT_QUEUE_HEADER_SIZE + (_staging[next] | _staging[next + 1] << 8);
+            if (offset + next + record > _size)
+            {
+                break;
+            }
+            next += record;
+        }
+        offset += next;
+        if (next + QT_QUEUE_HEADER_SIZE <= length)
+        {
+            // The record at offset runs past the end of the file
+            break;
+        }
+    }
+    if (offset < _size)
+    {
+        if (!seek(offset) || !_cellular->truncateFile(_dataHandle))
+        {
+            return false;
+        }
+        _size = offset;
+    }
+    return true;
+}
+
+bool QuectelRecordQueue::seek(uint32_t offset)
+{
+    if (_position == offset)
+    {
+        return true;
+    }
+    if (!_cellular->seekFile(_dataHandle, offset))
+    {
+        _position = QT_FILE_SIZE_UNKNOWN;
+        return false;
+    }
+    _position = offset;
+    return true;
+}
+
+bool QuectelRecordQueue::writeCursor(uint32_t end)
+{
+    // The end of the data is QT_FILE_SIZE_UNKNOWN unless a compaction is
+    // under way
+    uint8_t stored[8] =
+    {
+        (uint8_t)_cursor, (uint8_t)(_cursor >> 8), (uint8_t)(_cursor >> 16), (uint8_t)(_cursor >> 24),
+        (uint8_t)end, (uint8_t)(end >> 8), (uint8_t)(end >> 16), (uint8_t)(end >> 24)
+    };
+    return _cellular->seekFile(_cursorHandle, 0) &&
+           _cellular->writeFile(_cursorHandle, stored, sizeof(stored));
+}
@@ -0,0 +1,99 @@
+//---------------------------------------------------------------------------------------------
+//
+// Persistent record queue for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+//---------------------------------------------------------------------------------------------
+//
+// Records are appended to "<name>.dat" in the module file system, each
+// preceded by its length, 16 bits little endian. The offset of the oldest
+// record not yet acknowledged is kept in "<name>.pos", so after a restart
+// only unacknowledged records are read again. Delivery is at least once: a
+// reset between sending a batch and acknowledging it sends it again.
+// While the file is compacted, "<name>.pos" also holds the new end of the
+// data, so a reset before the file is truncated does not read the old
+// records behind it. begin() drops a record cut short by a reset while it
+// was appended, so later records are not read as its data.
+//
+// push() collects records in RAM and appends them with one +QFWRITE once
+// QT_QUEUE_STAGING_SIZE bytes are collected, on flush() and before reading.
+// Records still in RAM are lost on a reset.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __QuectelRecordQueue_h__
+#define __QuectelRecordQueue_h__
+#include <Arduino.h>
+#include "M2M_Quectel.h"
+
+#ifndef QT_QUEUE_STAGING_SIZE
+#define QT_QUEUE_STAGING_SIZE   256
+#endif
+#define QT_QUEUE_MAX_SIZE       65536
+// Longest record push() accepts, peek() needs a buffer of at least this
+// plus QT_QUEUE_HEADER_SIZE bytes
+#ifndef QT_QUEUE_RECORD_SIZE
+#define QT_QUEUE_RECORD_SIZE    1024
+#endif
+#define QT_QUEUE_NAME_LENGTH    32
+#define QT_QUEUE_HEADER_SIZE    2
+
+class QuectelRecordQueue
+{
+public:
+    // The name is used for the two files, without extension. Without a
+    // volume, e.g. "UFS:telemetry", the current volume is used.
+    QuectelRecordQueue(QuectelCellular* cellular, const char* name);
+
+    // Open the queue files, the data file never grows beyond maxSize bytes.
+    // False when the module cannot be asked about them.
+    bool begin(uint32_t maxSize = QT_QUEUE_MAX_SIZE);
+    // Append the collected records and close the files
+    bool end();
+
+    // Add a record, false if the queue is full or the record is longer
+    // than QT_QUEUE_RECORD_SIZE
+    bool push(const uint8_t* data, uint16_t length);
+    // Append the records collected in RAM to the data file
+    bool flush();
+
+    // Read as many whole records from the front of the queue as fit in the
+    // buffer, with one +QFREAD. The records keep their length prefix, step
+    // through them with nextRecord(). Returns the number of bytes read, 0
+    // with records pending if the first one does not fit in the buffer.
+    uint32_t peek(uint8_t* buffer, uint32_t size, uint16_t& count);
+    // Remove the records returned by the last peek()
+    bool acknowledge();
+    // Returns the next record of a batch read with peek() and advances
+    // position past it
+    static const uint8_t* nextRecord(const uint8_t*& position, uint16_t& length);
+
+    // Bytes waiting to be sent, including length prefixes
+    uint32_t getPending();
+    bool isEmpty();
+
+private:
+    bool append(const uint8_t* data, uint32_t length);
+    bool compact();
+    bool scan();
+    bool seek(uint32_t offset);
+    bool writeCursor(uint32_t end = QT_FILE_SIZE_UNKNOWN);
+
+    QuectelCellular* _cellular;
+    char _dataName[QT_QUEUE_NAME_LENGTH];
+    char _cursorName[QT_QUEUE_NAME_LENGTH];
+    FILE_HANDLE _dataHandle;
+    FILE_HANDLE _cursorHandle;
+    uint32_t _maxSize;
+    uint32_t _size;                 // Bytes in the data file
+    uint32_t _cursor;               // Offset of the oldest unacknowledged record
+    uint32_t _position;             // File position of the data handle
+    uint32_t _peeked;               // Bytes returned by the last peek()
+    uint16_t _staged;
+    uint8_t _staging[QT_QUEUE_STAGING_SIZE];
+};
+
+#endif
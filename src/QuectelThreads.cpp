@@ -0,0 +1,158 @@
+//---------------------------------------------------------------------------------------------
+//
+// Mutex and thread wrappers for the threaded mode of the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "QuectelThreads.h"
+
+#ifdef M2M_QUECTEL_THREADS
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Mutex
+//
+#ifdef QT_THREADS_FREERTOS
+QuectelMutex::QuectelMutex()
+{
+    _mutex = xSemaphoreCreateRecursiveMutex();
+}
+
+QuectelMutex::~QuectelMutex()
+{
+    vSemaphoreDelete(_mutex);
+}
+
+void QuectelMutex::lock()
+{
+    xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+}
+
+void QuectelMutex::unlock()
+{
+    xSemaphoreGiveRecursive(_mutex);
+}
+#else
+QuectelMutex::QuectelMutex()
+{
+}
+
+QuectelMutex::~QuectelMutex()
+{
+}
+
+void QuectelMutex::lock()
+{
+    _mutex.lock();
+}
+
+void QuectelMutex::unlock()
+{
+    _mutex.unlock();
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Thread
+//
+#ifdef QT_THREADS_FREERTOS
+QuectelThread::QuectelThread()
+{
+    _function = nullptr;
+    _argument = nullptr;
+    _task = nullptr;
+    _running = false;
+    _stopping = false;
+}
+
+QuectelThread::~QuectelThread()
+{
+    stop();
+}
+
+bool QuectelThread::start(void (*function)(void*), void* argument)
+{
+    if (_running)
+    {
+        return false;
+    }
+    _function = function;
+    _argument = argument;
+    _stopping = false;
+    _running = true;
+    if (xTaskCreate(run, "quectel", QT_IO_THREAD_STACK_SIZE, this,
+                    QT_IO_THREAD_PRIORITY, &_task) != pdPASS)
+    {
+        _running = false;
+        return false;
+    }
+    return true;
+}
+
+void QuectelThread::run(void* thread)
+{
+    QuectelThread* self = (QuectelThread*)thread;
+    self->_function(self->_argument);
+    self->_running = false;
+    vTaskDelete(nullptr);
+}
+
+void QuectelThread::stop()
+{
+    _stopping = true;
+    while (_running)
+    {
+        delay(1);
+    }
+    _task = nullptr;
+}
+#else
+QuectelThread::QuectelThread() : _running(false), _stopping(false)
+{
+}
+
+QuectelThread::~QuectelThread()
+{
+    stop();
+}
+
+bool QuectelThread::start(void (*function)(void*), void* argument)
+{
+    if (_running)
+    {
+        return false;
+    }
+    _stopping = false;
+    _running = true;
+    _thread = std::thread(function, argument);
+    return true;
+}
+
+void QuectelThread::stop()
+{
+    _stopping = true;
+    if (_thread.joinable())
+    {
+        _thread.join();
+    }
+    _running = false;
+}
+#endif
+
+bool QuectelThread::isRunning()
+{
+    return _running;
+}
+
+bool QuectelThread::isStopping()
+{
+    return _stopping;
+}
+
+#endif
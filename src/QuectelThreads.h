@@ -0,0 +1,124 @@
+//---------------------------------------------------------------------------------------------
+//
+// Mutex and thread wrappers for the threaded mode of the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+//---------------------------------------------------------------------------------------------
+//
+// Built with M2M_QUECTEL_THREADS defined, QuectelCellular takes a
+// recursive mutex in each public call, so tasks sharing one object get
+// whole commands and replies, and can run an I/O thread that calls loop()
+// to handle URCs. The wrappers use FreeRTOS when QT_THREADS_FREERTOS is
+// defined, and std::recursive_mutex and std::thread otherwise, e.g. on
+// Linux.
+// Without M2M_QUECTEL_THREADS they compile to nothing.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __QuectelThreads_h__
+#define __QuectelThreads_h__
+#include <Arduino.h>
+
+#ifdef M2M_QUECTEL_THREADS
+#ifdef QT_THREADS_FREERTOS
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#else
+#include <FreeRTOS.h>
+#include <semphr.h>
+#include <task.h>
+#endif
+#else
+#include <atomic>
+#include <mutex>
+#include <thread>
+#endif
+#endif
+
+// Time between loop() calls of the I/O thread, ms
+#ifndef QT_IO_THREAD_INTERVAL
+#define QT_IO_THREAD_INTERVAL   10
+#endif
+#ifndef QT_IO_THREAD_STACK_SIZE
+#define QT_IO_THREAD_STACK_SIZE 2048    // Words, FreeRTOS only
+#endif
+#ifndef QT_IO_THREAD_PRIORITY
+#define QT_IO_THREAD_PRIORITY   2       // FreeRTOS only
+#endif
+
+#ifdef M2M_QUECTEL_THREADS
+
+// Recursive, the library calls its own public functions
+class QuectelMutex
+{
+public:
+    QuectelMutex();
+    ~QuectelMutex();
+    void lock();
+    void unlock();
+
+private:
+#ifdef QT_THREADS_FREERTOS
+    SemaphoreHandle_t _mutex;
+#else
+    std::recursive_mutex _mutex;
+#endif
+};
+
+class QuectelLock
+{
+public:
+    QuectelLock(QuectelMutex& mutex) : _mutex(mutex)
+    {
+        _mutex.lock();
+    }
+    ~QuectelLock()
+    {
+        _mutex.unlock();
+    }
+
+private:
+    QuectelMutex& _mutex;
+};
+
+// Runs function(argument) until stop() is called, function checks
+// isStopping() and returns
+class QuectelThread
+{
+public:
+    QuectelThread();
+    ~QuectelThread();
+    bool start(void (*function)(void*), void* argument);
+    // Waits for the function to return
+    void stop();
+    bool isRunning();
+    bool isStopping();
+
+private:
+#ifdef QT_THREADS_FREERTOS
+    static void run(void* thread);
+
+    void (*_function)(void*);
+    void* _argument;
+    TaskHandle_t _task;
+    volatile bool _running;
+    volatile bool _stopping;
+#else
+    std::thread _thread;
+    std::atomic<bool> _running;
+    std::atomic<bool> _stopping;
+#endif
+};
+
+#define QT_LOCK()   QuectelLock _lock(_mutex)
+
+#else
+#define QT_LOCK()
+#endif
+
+#endif
@@ -0,0 +1,383 @@
+//---------------------------------------------------------------------------------------------
+//
+// Binary UART traffic recorder and replayer for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "QuectelTrafficRecorder.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Recorder
+//
+QuectelTrafficRecorder::QuectelTrafficRecorder()
+{
+    _sink = nullptr;
+    _ring = nullptr;
+    _ringSize = 0;
+    _ringTail = 0;
+    _ringUsed = 0;
+    _tailBase = 0;
+    _lastCommitted = 0;
+    _dropped = 0;
+    _open = false;
+    _direction = TrafficDirection::FromModule;
+    _recordTime = 0;
+    _lastByteTime = 0;
+    _length = 0;
+}
+
+void QuectelTrafficRecorder::begin(uint8_t* buffer, size_t size)
+{
+    _sink = nullptr;
+    _ring = buffer;
+    _ringSize = size;
+    clear();
+}
+
+void QuectelTrafficRecorder::begin(Print* sink)
+{
+    _ring = nullptr;
+    _ringSize = 0;
+    _sink = sink;
+    clear();
+
+    uint8_t sync[5] = { QT_RECORD_SYNC };
+    memcpy(sync + 1, &_lastCommitted, 4);
+    _sink->write(sync, sizeof(sync));
+}
+
+void QuectelTrafficRecorder::end()
+{
+    flush();
+    _sink = nullptr;
+}
+
+void QuectelTrafficRecorder::record(TrafficDirection direction, const uint8_t* data, size_t length)
+{
+    if (_sink == nullptr && _ring == nullptr)
+    {
+        return;
+    }
+    uint32_t now = micros();
+    for (size_t i = 0; i < length; i++)
+    {
+        if (_open &&
+            (direction != _direction ||
+             _length == QT_RECORD_MAX_PAYLOAD ||
+             now - _lastByteTime > QT_RECORD_MERGE_US))
+        {
+            commit();
+        }
+        if (!_open)
+        {
+            _open = true;
+            _direction = direction;
+            _recordTime = now;
+            _length = 0;
+        }
+        _payload[_length++] = data[i];
+        _lastByteTime = now;
+    }
+}
+
+void QuectelTrafficRecorder::flush()
+{
+    commit();
+}
+
+size_t QuectelTrafficRecorder::dump(Print* out)
+{
+    flush();
+    uint8_t sync[5] = { QT_RECORD_SYNC };
+    memcpy(sync + 1, &_tailBase, 4);
+    size_t result = out->write(sync, sizeof(sync));
+
+    size_t first = _ringSize - _ringTail;
+    if (first > _ringUsed)
+    {
+        first = _ringUsed;
+    }
+    result += out->write(_ring + _ringTail, first);
+    result += out->write(_ring, _ringUsed - first);
+    return result;
+}
+
+void QuectelTrafficRecorder::clear()
+{
+    _ringTail = 0;
+    _ringUsed = 0;
+    _dropped = 0;
+    _open = false;
+    _lastCommitted = micros();
+    _tailBase = _lastCommitted;
+}
+
+size_t QuectelTrafficRecorder::getSize()
+{
+    return _ringUsed;
+}
+
+uint32_t QuectelTrafficRecorder::getDroppedRecords()
+{
+    return _dropped;
+}
+
+void QuectelTrafficRecorder::commit()
+{
+    if (!_open)
+    {
+        return;
+    }
+    _open = false;
+
+    uint8_t header[6];
+    header[0] = (_direction == TrafficDirection::ToModule ? QT_RECORD_TX : 0) | _length;
+    uint8_t headerLength = 1 + encodeDelta(_recordTime - _lastCommitted, header + 1);
+
+    if (_sink != nullptr)
+    {
+        _sink->write(header, headerLength);
+        _sink->write(_payload, _length);
+    }
+    else
+    {
+        size_t needed = headerLength + _length;
+        if (needed > _ringSize)
+        {
+            _dropped++;
+            return;
+        }
+        while (_ringSize - _ringUsed < needed)
+        {
+            dropOldest();
+        }
+        if (_ringUsed == 0)
+        {
+            _tailBase = _lastCommitted;
+        }
+        put(header, headerLength);
+        put(_payload, _length);
+    }
+    _lastCommitted = _recordTime;
+}
+
+void QuectelTrafficRecorder::put(const uint8_t* data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        _ring[(_ringTail + _ringUsed) % _ringSize] = data[i];
+        _ringUsed++;
+    }
+}
+
+void QuectelTrafficRecorder::dropOldest()
+{
+    uint8_t length = ringAt(0) & QT_RECORD_MAX_PAYLOAD;
+    size_t offset = 1;
+    uint32_t delta = 0;
+    uint8_t shift = 0;
+    uint8_t value;
+    do
+    {
+        value = ringAt(offset++);
+        delta |= (uint32_t)(value & 0x7f) << shift;
+        shift += 7;
+    }
+    while (value & 0x80);
+
+    size_t size = offset + length;
+    _tailBase += delta;
+    _ringTail = (_ringTail + size) % _ringSize;
+    _ringUsed -= size;
+    _dropped++;
+}
+
+uint8_t QuectelTrafficRecorder::ringAt(size_t offset)
+{
+    return _ring[(_ringTail + offset) % _ringSize];
+}
+
+uint8_t QuectelTrafficRecorder::encodeDelta(uint32_t delta, uint8_t* out)
+{
+    uint8_t length = 0;
+    do
+    {
+        uint8_t value = delta & 0x7f;
+        delta >>= 7;
+        out[length++] = value | (delta ? 0x80 : 0);
+    }
+    while (delta);
+    return length;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Replayer
+//
+QuectelTrafficReplayer::QuectelTrafficReplayer(const uint8_t* capture, size_t length)
+{
+    _capture = capture;
+    _length = length;
+    _position = 0;
+    _timing = false;
+    _recordTx = false;
+    _recordRemaining = 0;
+    _recordTime = 0;
+    _mismatches = 0;
+    _firstMismatch = -1;
+    nextRecord();
+    _captureAnchor = _recordTime;
+    _replayAnchor = micros();
+}
+
+void QuectelTrafficReplayer::setTiming(bool enabled)
+{
+    _timing = enabled;
+}
+
+bool QuectelTrafficReplayer::isDone()
+{
+    return _recordRemaining == 0;
+}
+
+uint32_t QuectelTrafficReplayer::getMismatches()
+{
+    return _mismatches;
+}
+
+int32_t QuectelTrafficReplayer::getFirstMismatch()
+{
+    return _firstMismatch;
+}
+
+void QuectelTrafficReplayer::begin(unsigned long)
+{
+    _replayAnchor = micros();
+}
+
+void QuectelTrafficReplayer::begin(unsigned long baudRate, uint16_t)
+{
+    begin(baudRate);
+}
+
+void QuectelTrafficReplayer::end()
+{
+}
+
+int QuectelTrafficReplayer::available()
+{
+    return receiveReady() ? _recordRemaining : 0;
+}
+
+int QuectelTrafficReplayer::peek()
+{
+    return receiveReady() ? _capture[_position] : -1;
+}
+
+int QuectelTrafficReplayer::read()
+{
+    if (!receiveReady())
+    {
+        return -1;
+    }
+    uint8_t value = _capture[_position++];
+    if (--_recordRemaining == 0)
+    {
+        nextRecord();
+    }
+    return value;
+}
+
+void QuectelTrafficReplayer::flush()
+{
+}
+
+size_t QuectelTrafficReplayer::write(uint8_t value)
+{
+    // Received data the library never read means the session diverged,
+    // skip ahead to the next command
+    while (_recordRemaining > 0 && !_recordTx)
+    {
+        _mismatches++;
+        _firstMismatch = _firstMismatch < 0 ? _position : _firstMismatch;
+        _position += _recordRemaining;
+        nextRecord();
+    }
+    if (_recordRemaining == 0)
+    {
+        _mismatches++;
+        _firstMismatch = _firstMismatch < 0 ? _position : _firstMismatch;
+        return 1;
+    }
+    if (_capture[_position] != value)
+    {
+        _mismatches++;
+        _firstMismatch = _firstMismatch < 0 ? _position : _firstMismatch;
+    }
+    _position++;
+    if (--_recordRemaining == 0)
+    {
+        _captureAnchor = _recordTime;
+        _replayAnchor = micros();
+        nextRecord();
+    }
+    return 1;
+}
+
+void QuectelTrafficReplayer::nextRecord()
+{
+    _recordRemaining = 0;
+    while (_recordRemaining == 0 && _position < _length)
+    {
+        uint8_t header = _capture[_position++];
+        if (header == QT_RECORD_SYNC)
+        {
+            if (_position + 4 > _length)
+            {
+                _position = _length;
+                return;
+            }
+            memcpy(&_recordTime, _capture + _position, 4);
+            _position += 4;
+            continue;
+        }
+        uint32_t delta = 0;
+        uint8_t shift = 0;
+        uint8_t value;
+        do
+        {
+            value = _position < _length ? _capture[_position++] : 0;
+            delta |= (uint32_t)(value & 0x7f) << shift;
+            shift += 7;
+        }
+        while (value & 0x80);
+
+        _recordTime += delta;
+        _recordTx = header & QT_RECORD_TX;
+        _recordRemaining = header & QT_RECORD_MAX_PAYLOAD;
+        if (_position + _recordRemaining > _length)
+        {
+            // Truncated capture
+            _recordRemaining = _length - _position;
+        }
+    }
+}
+
+bool QuectelTrafficReplayer::receiveReady()
+{
+    if (_recordRemaining == 0 || _recordTx)
+    {
+        return false;
+    }
+    if (!_timing)
+    {
+        return true;
+    }
+    return (int32_t)(micros() - _replayAnchor) >= (int32_t)(_recordTime - _captureAnchor);
+}
@@ -0,0 +1,134 @@
+//---------------------------------------------------------------------------------------------
+//
+// Binary UART traffic recorder and replayer for the Quectel library.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+//---------------------------------------------------------------------------------------------
+//
+// Capture format, one record after another:
+//
+//   header   bit 7 = direction (1 = to module), bits 0-6 = payload length 1..127
+//   delta    microseconds since the previous record, unsigned LEB128
+//   payload  the bytes
+//
+// A header of 0x00 is a sync record, followed by a 32 bit little endian
+// absolute micros() value that the next delta refers to. Consecutive bytes
+// in the same direction are merged into one record.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __QuectelTrafficRecorder_h__
+#define __QuectelTrafficRecorder_h__
+#include <Arduino.h>
+
+#define QT_RECORD_MAX_PAYLOAD   127
+#define QT_RECORD_SYNC          0x00
+#define QT_RECORD_TX            0x80
+// Bytes further apart than this start a new record
+#define QT_RECORD_MERGE_US      1000
+
+enum class TrafficDirection : uint8_t
+{
+    FromModule = 0,
+    ToModule
+};
+
+class QuectelTrafficRecorder
+{
+public:
+    QuectelTrafficRecorder();
+
+    // Record into a caller supplied RAM ring, oldest records are dropped
+    // when it is full
+    void begin(uint8_t* buffer, size_t size);
+    // Record straight to a sink, e.g. a file or a second serial port
+    void begin(Print* sink);
+    void end();
+
+    void record(TrafficDirection direction, const uint8_t* data, size_t length);
+    // Commit the record being merged
+    void flush();
+
+    // Write the ring contents, preceded by a sync record, to a Print
+    size_t dump(Print* out);
+    void clear();
+    size_t getSize();
+    uint32_t getDroppedRecords();
+
+private:
+    void commit();
+    void put(const uint8_t* data, size_t length);
+    void dropOldest();
+    uint8_t ringAt(size_t offset);
+    static uint8_t encodeDelta(uint32_t delta, uint8_t* out);
+
+    Print* _sink;
+    uint8_t* _ring;
+    size_t _ringSize;
+    size_t _ringTail;
+    size_t _ringUsed;
+    uint32_t _tailBase;             // Time the oldest record's delta refers to
+    uint32_t _lastCommitted;        // Time of the newest committed record
+    uint32_t _dropped;
+
+    bool _open;
+    TrafficDirection _direction;
+    uint32_t _recordTime;
+    uint32_t _lastByteTime;
+    uint8_t _length;
+    uint8_t _payload[QT_RECORD_MAX_PAYLOAD];
+};
+
+//
+// Feeds a captured session back to QuectelCellular in place of the module.
+// Received data is released in capture order once the library has written
+// the commands that preceded it. With timing enabled each received record
+// is also held back by its captured delay after the last command.
+//
+class QuectelTrafficReplayer : public HardwareSerial
+{
+public:
+    QuectelTrafficReplayer(const uint8_t* capture, size_t length);
+    void setTiming(bool enabled);
+
+    bool isDone();
+    // Number of bytes written by the library that differ from the capture
+    uint32_t getMismatches();
+    // Capture offset of the first difference, or -1
+    int32_t getFirstMismatch();
+
+    void begin(unsigned long baudRate);
+    void begin(unsigned long baudRate, uint16_t config);
+    void end();
+    int available();
+    int peek();
+    int read();
+    void flush();
+    size_t write(uint8_t value);
+    using Print::write;
+    operator bool()
+    {
+        return true;
+    }
+
+private:
+    void nextRecord();
+    bool receiveReady();
+
+    const uint8_t* _capture;
+    size_t _length;
+    size_t _position;
+    bool _timing;
+    bool _recordTx;
+    uint8_t _recordRemaining;
+    uint32_t _recordTime;           // Capture time of the current record
+    uint32_t _captureAnchor;        // Capture time of the last completed command
+    uint32_t _replayAnchor;         // micros() when it completed during replay
+    uint32_t _mismatches;
+    int32_t _firstMismatch;
+};
+
+#endif
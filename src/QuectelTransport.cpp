@@ -0,0 +1,102 @@
+//---------------------------------------------------------------------------------------------
+//
+// Byte transports between the Quectel library and the module.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <Arduino.h>
+#include "QuectelTransport.h"
+
+bool QuectelTransport::waitForData(uint16_t timeout)
+{
+    uint32_t start = millis();
+    while (available() <= 0)
+    {
+        if (millis() - start >= timeout)
+        {
+            return false;
+        }
+        delay(1);
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// HardwareSerial
+//
+QuectelUartTransport::QuectelUartTransport(HardwareSerial* uart)
+{
+    _uart = uart;
+}
+
+void QuectelUartTransport::setUart(HardwareSerial* uart)
+{
+    _uart = uart;
+}
+
+bool QuectelUartTransport::begin(uint32_t baudRate)
+{
+    _uart->begin(baudRate);
+    return true;
+}
+
+bool QuectelUartTransport::supportsBaudRate(uint32_t)
+{
+    return true;
+}
+
+void QuectelUartTransport::end()
+{
+    _uart->end();
+}
+
+int QuectelUartTransport::available()
+{
+    return _uart->available();
+}
+
+size_t QuectelUartTransport::read(uint8_t* buffer, size_t size)
+{
+    size_t length = 0;
+    while (length < size && _uart->available() > 0)
+    {
+        int value = _uart->read();
+        if (value < 0)
+        {
+            break;
+        }
+        buffer[length++] = value;
+    }
+    return length;
+}
+
+size_t QuectelUartTransport::write(const uint8_t* buffer, size_t size)
+{
+    // HardwareSerial blocks while its output buffer is full, so only what
+    // fits is taken. At least one byte, which waits no longer than one
+    // character time, as some cores always report 0 here.
+    int space = _uart->availableForWrite();
+    if (space < 1)
+    {
+        space = 1;
+    }
+    if (size > (size_t)space)
+    {
+        size = space;
+    }
+    return _uart->write(buffer, size);
+}
+
+bool QuectelUartTransport::setBaudRate(uint32_t baudRate)
+{
+    // Lets the last command go out at the old rate
+    _uart->flush();
+    _uart->end();
+    _uart->begin(baudRate);
+    return true;
+}
@@ -0,0 +1,86 @@
+//---------------------------------------------------------------------------------------------
+//
+// Byte transports between the Quectel library and the module.
+//
+// Copyright 2018, M2M Solutions AB
+//
+// Licensed under the MIT license, see the LICENSE.txt file.
+//
+//---------------------------------------------------------------------------------------------
+//
+// QuectelCellular does all its module I/O through a QuectelTransport. Reads
+// and writes never block: read() returns what has been received so far and
+// write() what could be queued, and the library waits between calls. A
+// transport for a DMA UART driver, a USB CDC port or a test harness only
+// needs to implement available(), read() and write().
+//
+// QuectelUartTransport wraps an Arduino HardwareSerial, and is used when a
+// HardwareSerial is passed to QuectelCellular::begin(). On Linux, see
+// QuectelPosixTransport.h for serial devices and pseudo terminals.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __QuectelTransport_h__
+#define __QuectelTransport_h__
+#include <Arduino.h>
+
+class QuectelTransport
+{
+public:
+    virtual ~QuectelTransport() {}
+
+    virtual bool begin(uint32_t baudRate) = 0;
+    virtual void end() {}
+
+    // Bytes that can be read without waiting
+    virtual int available() = 0;
+    // Returns the number of bytes read, 0 when nothing is received
+    virtual size_t read(uint8_t* buffer, size_t size) = 0;
+    // Returns the number of bytes taken, which may be less than size
+    virtual size_t write(const uint8_t* buffer, size_t size) = 0;
+
+    // Waits at most timeout ms for received data. The default polls
+    // available() once per ms.
+    virtual bool waitForData(uint16_t timeout);
+
+    // Changes the local side only, the module is set by QuectelCellular.
+    // Return false when not supported.
+    virtual bool setBaudRate(uint32_t)
+    {
+        return false;
+    }
+    virtual bool setFlowControl(bool)
+    {
+        return false;
+    }
+    // Asked before the module is changed, so it is never left at a setting
+    // the transport cannot follow
+    virtual bool supportsBaudRate(uint32_t)
+    {
+        return false;
+    }
+    virtual bool supportsFlowControl()
+    {
+        return false;
+    }
+};
+
+class QuectelUartTransport : public QuectelTransport
+{
+public:
+    QuectelUartTransport(HardwareSerial* uart = nullptr);
+    void setUart(HardwareSerial* uart);
+
+    bool begin(uint32_t baudRate);
+    void end();
+    int available();
+    size_t read(uint8_t* buffer, size_t size);
+    size_t write(const uint8_t* buffer, size_t size);
+    bool setBaudRate(uint32_t baudRate);
+    bool supportsBaudRate(uint32_t baudRate);
+
+private:
+    HardwareSerial* _uart;
+};
+
+#endif